@@ -0,0 +1,240 @@
+//
+//  IPTSContactDetector.cpp
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#include <string.h>
+
+#include "IPTSContactDetector.hpp"
+
+#define IPTS_CONTACT_CENTROID_RADIUS    2
+#define IPTS_CONTACT_SIZE_RADIUS        3
+#define IPTS_CONTACT_TRACK_DISTANCE     2048    // logical units a contact may move between two frames
+
+SInt32 IPTSContactDetector::floatToFixed(UInt32 bits) {
+    SInt32 exponent = (bits >> 23) & 0xFF;
+    if (exponent == 0)
+        return 0;   // zero and denormals
+
+    // value = mantissa * 2^(exponent - 150), 16 more bits for the fraction
+    UInt64 mantissa = (bits & 0x7FFFFF) | 0x800000;
+    SInt32 shift = exponent - 150 + 16;
+    UInt64 value;
+    if (shift >= 0)
+        value = shift > 40 ? 0x7FFFFFFF : mantissa << shift;
+    else
+        value = shift < -24 ? 0 : mantissa >> -shift;
+    if (value > 0x7FFFFFFF)
+        value = 0x7FFFFFFF;
+
+    return (bits >> 31) ? -static_cast<SInt32>(value) : static_cast<SInt32>(value);
+}
+
+bool IPTSContactDetector::configure(UInt32 rows, UInt32 columns, const UInt32 *transform) {
+    if (!rows || !columns || rows * columns > IPTS_CONTACT_MAX_CELLS)
+        return false;
+
+    this->rows = rows;
+    this->columns = columns;
+    swap_axes = invert_x = invert_y = false;
+    if (transform) {
+        // screen x = xx * column + yx * row + tx, screen y = xy * column + yy * row + ty
+        SInt32 xx = floatToFixed(transform[0]);
+        SInt32 yx = floatToFixed(transform[1]);
+        SInt32 xy = floatToFixed(transform[3]);
+        SInt32 yy = floatToFixed(transform[4]);
+        swap_axes = (yx < 0 ? -yx : yx) > (xx < 0 ? -xx : xx);
+        invert_x = (swap_axes ? yx : xx) < 0;
+        invert_y = (swap_axes ? xy : yy) < 0;
+    }
+
+    reset();
+    return true;
+}
+
+const UInt8 *IPTSContactDetector::findHeatmap(const UInt8 *frame, UInt32 size) {
+    IPTSHeatmapHeader header;
+    if (!rows || size < sizeof(IPTSHeatmapHeader))
+        return nullptr;
+    memcpy(&header, frame, sizeof(IPTSHeatmapHeader));
+    // a different size means the metadata does not describe this sensor (anymore)
+    if (header.size != rows * columns || header.size > size - sizeof(IPTSHeatmapHeader))
+        return nullptr;
+    return frame + sizeof(IPTSHeatmapHeader);
+}
+
+void IPTSContactDetector::reset() {
+    memset(baseline, 0, sizeof(baseline));
+    memset(signal, 0, sizeof(signal));
+    previous_num = 0;
+}
+
+void IPTSContactDetector::subtractBackground(const UInt8 *heatmap) {
+    UInt32 cells = rows * columns;
+    SInt32 quiet_level = threshold;
+
+    // branch free so the loop stays a straight line of integer ops, or vectorises outside the kernel
+    for (UInt32 i = 0; i < cells; i++) {
+        SInt32 value = 0xFF - heatmap[i];
+        SInt32 diff = value - (baseline[i] >> 8);
+        diff = diff > 0 ? diff : 0;
+        signal[i] = diff;
+
+        // cells without a contact follow the background by 1/16 per frame, the others by 1/2^stale_shift
+        SInt32 quiet = diff < quiet_level;
+        SInt32 shift = stale_shift + quiet * (4 - stale_shift);
+        baseline[i] += ((value << 8) - static_cast<SInt32>(baseline[i])) >> shift;
+    }
+}
+
+bool IPTSContactDetector::isLocalMaximum(UInt32 row, UInt32 column) {
+    UInt8 value = signal[row * columns + column];
+    for (SInt32 dr = -1; dr <= 1; dr++) {
+        SInt32 r = row + dr;
+        if (r < 0 || r >= static_cast<SInt32>(rows))
+            continue;
+        for (SInt32 dc = -1; dc <= 1; dc++) {
+            SInt32 c = column + dc;
+            if ((dr == 0 && dc == 0) || c < 0 || c >= static_cast<SInt32>(columns))
+                continue;
+            UInt8 neighbour = signal[r * columns + c];
+            // a plateau belongs to its first cell in scan order
+            if (neighbour > value || (neighbour == value && (dr < 0 || (dr == 0 && dc < 0))))
+                return false;
+        }
+    }
+    return true;
+}
+
+void IPTSContactDetector::measureContact(UInt32 row, UInt32 column, IPTSContact *contact) {
+    UInt8 peak = signal[row * columns + column];
+    UInt32 floor = threshold / 2;
+    UInt64 sum_w = 0, sum_x = 0, sum_y = 0;
+    UInt32 size = 0;
+
+    UInt32 r0 = row > IPTS_CONTACT_SIZE_RADIUS ? row - IPTS_CONTACT_SIZE_RADIUS : 0;
+    UInt32 r1 = row + IPTS_CONTACT_SIZE_RADIUS < rows ? row + IPTS_CONTACT_SIZE_RADIUS : rows - 1;
+    UInt32 c0 = column > IPTS_CONTACT_SIZE_RADIUS ? column - IPTS_CONTACT_SIZE_RADIUS : 0;
+    UInt32 c1 = column + IPTS_CONTACT_SIZE_RADIUS < columns ? column + IPTS_CONTACT_SIZE_RADIUS : columns - 1;
+    for (UInt32 r = r0; r <= r1; r++) {
+        const UInt8 *line = signal + r * columns;
+        bool centroid_row = (r > row ? r - row : row - r) <= IPTS_CONTACT_CENTROID_RADIUS;
+        for (UInt32 c = c0; c <= c1; c++) {
+            UInt32 s = line[c];
+            size += s * 2 >= peak;
+            if (!centroid_row || (c > column ? c - column : column - c) > IPTS_CONTACT_CENTROID_RADIUS)
+                continue;
+            UInt32 w = s > floor ? s - floor : 0;
+            sum_w += w;
+            sum_x += w * (c << 8);
+            sum_y += w * (r << 8);
+        }
+    }
+
+    // centroid in 8.8 heatmap cells, then scaled to the logical range
+    UInt64 cx = sum_w ? sum_x / sum_w : column << 8;
+    UInt64 cy = sum_w ? sum_y / sum_w : row << 8;
+    UInt64 x = columns > 1 ? cx * IPTS_CONTACT_LOGICAL_MAX / ((columns - 1) << 8) : 0;
+    UInt64 y = rows > 1 ? cy * IPTS_CONTACT_LOGICAL_MAX / ((rows - 1) << 8) : 0;
+    if (swap_axes) {
+        UInt64 temp = x;
+        x = y;
+        y = temp;
+    }
+    if (x > IPTS_CONTACT_LOGICAL_MAX)
+        x = IPTS_CONTACT_LOGICAL_MAX;
+    if (y > IPTS_CONTACT_LOGICAL_MAX)
+        y = IPTS_CONTACT_LOGICAL_MAX;
+
+    contact->x = invert_x ? IPTS_CONTACT_LOGICAL_MAX - x : x;
+    contact->y = invert_y ? IPTS_CONTACT_LOGICAL_MAX - y : y;
+    contact->size = size;
+    contact->peak = peak;
+    contact->palm = size > palm_size;
+    contact->id = 0;
+}
+
+void IPTSContactDetector::trackContacts(IPTSContact *contacts, UInt32 num) {
+    UInt32 previous_ids = 0;
+    UInt32 used = 0;
+    bool matched[IPTS_CONTACT_MAX_NUM] = {false};
+
+    for (UInt32 j = 0; j < previous_num; j++)
+        previous_ids |= 1 << previous[j].id;
+
+    for (UInt32 i = 0; i < num; i++) {
+        SInt64 best_dist = static_cast<SInt64>(IPTS_CONTACT_TRACK_DISTANCE) * IPTS_CONTACT_TRACK_DISTANCE;
+        SInt32 best = -1;
+        for (UInt32 j = 0; j < previous_num; j++) {
+            if (used & (1 << previous[j].id))
+                continue;
+            SInt64 dx = static_cast<SInt64>(contacts[i].x) - previous[j].x;
+            SInt64 dy = static_cast<SInt64>(contacts[i].y) - previous[j].y;
+            if (dx * dx + dy * dy < best_dist) {
+                best_dist = dx * dx + dy * dy;
+                best = j;
+            }
+        }
+        if (best >= 0) {
+            contacts[i].id = previous[best].id;
+            used |= 1 << contacts[i].id;
+            matched[i] = true;
+        }
+    }
+
+    // new contacts never reuse an id that was alive in the last frame
+    for (UInt32 i = 0; i < num; i++) {
+        if (matched[i])
+            continue;
+        UInt32 id = 0;
+        while ((used | previous_ids) & (1 << id))
+            id++;
+        contacts[i].id = id;
+        used |= 1 << id;
+    }
+
+    memcpy(previous, contacts, num * sizeof(IPTSContact));
+    previous_num = num;
+}
+
+UInt32 IPTSContactDetector::process(const UInt8 *heatmap, IPTSContact *contacts, UInt32 max_contacts) {
+    if (!rows)
+        return 0;
+
+    subtractBackground(heatmap);
+
+    IPTSContact found[IPTS_CONTACT_MAX_NUM];
+    UInt32 num = 0;
+    for (UInt32 r = 0; r < rows; r++) {
+        const UInt8 *line = signal + r * columns;
+        for (UInt32 c = 0; c < columns; c++) {
+            if (line[c] < threshold || !isLocalMaximum(r, c))
+                continue;
+
+            IPTSContact contact;
+            measureContact(r, c, &contact);
+            if (num < IPTS_CONTACT_MAX_NUM) {
+                found[num++] = contact;
+                continue;
+            }
+            // keep the strongest contacts when there are too many maxima
+            UInt32 weakest = 0;
+            for (UInt32 i = 1; i < num; i++) {
+                if (found[i].peak < found[weakest].peak)
+                    weakest = i;
+            }
+            if (contact.peak > found[weakest].peak)
+                found[weakest] = contact;
+        }
+    }
+
+    trackContacts(found, num);
+
+    if (num > max_contacts)
+        num = max_contacts;
+    memcpy(contacts, found, num * sizeof(IPTSContact));
+    return num;
+}
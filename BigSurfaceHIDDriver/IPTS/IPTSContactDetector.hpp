@@ -0,0 +1,98 @@
+//
+//  IPTSContactDetector.hpp
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#ifndef IPTSContactDetector_hpp
+#define IPTSContactDetector_hpp
+
+#include "IPTSPortableTypes.h"
+
+#define IPTS_CONTACT_MAX_CELLS      8192
+#define IPTS_CONTACT_MAX_NUM        10      // same as IPTS_TOUCH_SCREEN_FINGER_CNT
+#define IPTS_CONTACT_LOGICAL_MAX    32767   // logical range of the touch screen report descriptor
+
+// Leads the data of an IPTS_HID_FRAME_TYPE_HEATMAP frame, the heatmap itself follows
+struct __attribute__((packed)) IPTSHeatmapHeader {
+    UInt8  reserved[3];
+    UInt32 size;        // bytes of heatmap, rows * columns
+};
+
+struct IPTSContact {
+    UInt16 x;       // 0 - IPTS_CONTACT_LOGICAL_MAX
+    UInt16 y;
+    UInt16 size;    // cells above half of the peak
+    UInt8  peak;
+    UInt8  id;
+    bool   palm;
+};
+
+/*
+ * Finds finger contacts in heatmap frames without floating point, so it can run in the kernel.
+ *
+ * Every frame goes through background subtraction against a baseline that adapts quickly where nothing touches
+ * and very slowly under contacts, local maxima detection, and a weighted centroid and size estimation around
+ * each maximum. Contacts keep their id across frames by nearest neighbour matching. All per cell work is done
+ * in plain row loops.
+ */
+class IPTSContactDetector {
+public:
+    UInt8 threshold {20};       // minimal signal of a contact peak
+    UInt16 palm_size {24};      // contacts covering more cells are reported as palms
+    // cells that never drop below the threshold still follow the background by 1/2^stale_shift per frame, so a
+    // water drop or a baseline shift after a temperature change fades out, 12 is about half a minute at 120 Hz
+    UInt8 stale_shift {12};
+
+    /*
+     * @rows, @columns: heatmap dimensions from IPTSDeviceMetaData
+     * @transform: IPTSMetadataTransform as raw IEEE 754 bits, only used to orient the axes, may be NULL
+     */
+    bool configure(UInt32 rows, UInt32 columns, const UInt32 *transform);
+
+    bool isConfigured() { return rows > 0; }
+
+    UInt32 getCells() { return rows * columns; }
+
+    /*
+     * Finds the heatmap in the data of a heatmap frame
+     *
+     * @return NULL if the frame is truncated or its heatmap is not rows * columns bytes
+     */
+    const UInt8 *findHeatmap(const UInt8 *frame, UInt32 size);
+
+    // Forget the background and tracked contacts, e.g. after the sensor was reset
+    void reset();
+
+    /*
+     * Process one heatmap of rows * columns bytes, 0xFF means no touch
+     *
+     * @return number of contacts written to @contacts
+     */
+    UInt32 process(const UInt8 *heatmap, IPTSContact *contacts, UInt32 max_contacts);
+
+    // Converts IEEE 754 single precision bits to 16.16 fixed point
+    static SInt32 floatToFixed(UInt32 bits);
+
+private:
+    UInt32 rows {0};
+    UInt32 columns {0};
+    bool swap_axes {false};
+    bool invert_x {false};
+    bool invert_y {false};
+
+    UInt16 baseline[IPTS_CONTACT_MAX_CELLS];    // 8.8 fixed point
+    UInt8 signal[IPTS_CONTACT_MAX_CELLS];
+
+    IPTSContact previous[IPTS_CONTACT_MAX_NUM];
+    UInt32 previous_num {0};
+
+    void subtractBackground(const UInt8 *heatmap);
+    bool isLocalMaximum(UInt32 row, UInt32 column);
+    void measureContact(UInt32 row, UInt32 column, IPTSContact *contact);
+    void trackContacts(IPTSContact *contacts, UInt32 num);
+};
+
+#endif /* IPTSContactDetector_hpp */
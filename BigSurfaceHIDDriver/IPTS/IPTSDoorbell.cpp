@@ -0,0 +1,65 @@
+//
+//  IPTSDoorbell.cpp
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#include "IPTSDoorbell.hpp"
+
+void IPTSDoorbell::setActions(void *owner, ClassifyAction classify, HandleAction handle, RefillAction refill) {
+    this->owner = owner;
+    this->classify = classify;
+    this->handle = handle;
+    this->refill = refill;
+}
+
+UInt32 IPTSDoorbell::drain(UInt32 value) {
+    if (value == current)
+        return 0;
+    if (value < current) {
+        current = value;
+        return IPTS_DOORBELL_RESET;
+    }
+
+    UInt32 pending = drain_all ? value - current : 1;
+    if (pending > IPTS_BUFFER_NUM) {
+        // the ME can not be more than a full ring ahead of us, older buffers were already overwritten
+        drops += pending - IPTS_BUFFER_NUM;
+        current = value - IPTS_BUFFER_NUM;
+        pending = IPTS_BUFFER_NUM;
+    }
+
+    // only the newest frame of each class for the daemon is worth copying when coalescing,
+    // a touch frame must not make a pending stylus frame stale nor the other way round
+    UInt32 latest[IPTSFrameClassNum];
+    IPTSFrameClass buffer_class[IPTS_BUFFER_NUM];
+    for (UInt32 c = 0; c < IPTSFrameClassNum; c++)
+        latest[c] = current + pending - 1;
+    for (UInt32 i = 0; i < IPTS_BUFFER_NUM; i++)
+        buffer_class[i] = IPTSFrameClassTouch;
+    if (coalesce && pending > 1) {
+        for (UInt32 i = current; i != current + pending; i++) {
+            if (classify(owner, i % IPTS_BUFFER_NUM, &buffer_class[i % IPTS_BUFFER_NUM]))
+                latest[buffer_class[i % IPTS_BUFFER_NUM]] = i;
+        }
+    }
+
+    for (UInt32 i = 0; i < pending; i++) {
+        UInt32 buffer = current % IPTS_BUFFER_NUM;
+        // live frames never carry the replay bit, nor the invalid sequence once it wraps
+        sequence = (sequence + 1) & ~IPTS_FRAME_SEQUENCE_REPLAY;
+        if (sequence == IPTS_FRAME_SEQUENCE_INVALID)
+            sequence++;
+        frames++;
+        if (handle(owner, buffer, sequence, !coalesce || current == latest[buffer_class[buffer]]))
+            refill(owner, 1 << buffer);
+        current++;
+    }
+
+    wakeups++;
+    if (pending > max_drained)
+        max_drained = pending;
+    return pending;
+}
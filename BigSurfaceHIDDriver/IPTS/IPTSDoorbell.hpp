@@ -0,0 +1,82 @@
+//
+//  IPTSDoorbell.hpp
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#ifndef IPTSDoorbell_hpp
+#define IPTSDoorbell_hpp
+
+#include "IPTSProtocol.h"
+
+#define IPTS_DOORBELL_RESET     0xFFFFFFFF
+
+/*
+ * Takes the rx buffers the ME filled since the last poll off the doorbell. Buffers the ME has already overwritten
+ * again are skipped, every buffer gets the next frame sequence and, when coalescing, only the newest frame of each
+ * IPTSFrameClass is delivered to the daemon.
+ * What a buffer holds is up to the owner, it is called back for every buffer. Kept free of IOKit so the simulator
+ * drives the same code as the driver.
+ */
+class IPTSDoorbell {
+public:
+    // @return true if @buffer holds a frame for the daemon, @frame_class tells which
+    typedef bool (*ClassifyAction)(void *owner, UInt32 buffer, IPTSFrameClass *frame_class);
+
+    // @deliver: false if a newer frame of the same class follows, @return true if @buffer can go back to the ME
+    typedef bool (*HandleAction)(void *owner, UInt32 buffer, UInt32 sequence, bool deliver);
+
+    // Give the buffers in @mask back to the ME
+    typedef void (*RefillAction)(void *owner, UInt32 mask);
+
+    void setActions(void *owner, ClassifyAction classify, HandleAction handle, RefillAction refill);
+
+    // @drain: take every buffer the ME has filled instead of one per poll, @coalesce: see above
+    void setOptions(bool drain, bool coalesce) { this->drain_all = drain; this->coalesce = coalesce; }
+
+    // Continue at @value, e.g. once the ME starts over from the beginning
+    void resync(UInt32 value) { current = value; }
+
+    /*
+     * Handle the buffers up to the doorbell @value
+     *
+     * @return number of buffers handled, IPTS_DOORBELL_RESET if the doorbell went back because the ME was reset,
+     *         nothing is handled then and the doorbell continues at @value
+     */
+    UInt32 drain(UInt32 value);
+
+    // Doorbell of the buffer being handled
+    UInt32 getCurrent() { return current; }
+
+    // Sequence of the newest frame, never IPTS_FRAME_SEQUENCE_INVALID nor with IPTS_FRAME_SEQUENCE_REPLAY set
+    UInt32 getSequence() { return sequence; }
+
+    UInt64 getFrames() { return frames; }
+
+    // Buffers overwritten by the ME before they were polled
+    UInt64 getDrops() { return drops; }
+
+    // Polls that found buffers
+    UInt64 getWakeups() { return wakeups; }
+
+    UInt32 getMaxDrained() { return max_drained; }
+
+private:
+    void *owner {nullptr};
+    ClassifyAction classify {nullptr};
+    HandleAction handle {nullptr};
+    RefillAction refill {nullptr};
+    bool drain_all {true};
+    bool coalesce {true};
+
+    UInt32 current {0};
+    UInt32 sequence {0};
+    UInt64 frames {0};
+    UInt64 drops {0};
+    UInt64 wakeups {0};
+    UInt32 max_drained {0};
+};
+
+#endif /* IPTSDoorbell_hpp */
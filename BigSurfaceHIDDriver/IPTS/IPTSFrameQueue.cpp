@@ -0,0 +1,167 @@
+//
+//  IPTSFrameQueue.cpp
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#include <string.h>
+
+#include "IPTSFrameQueue.hpp"
+
+void IPTSFrameQueue::reset(IPTSFrameRing *ring, UInt32 slot_size, UInt32 data_offset) {
+    this->ring = ring;
+    held = 0;
+    publish_index = 0;
+    for (UInt32 i = 0; i < IPTS_INPUT_CLIENT_NUM; i++)
+        cursors[i].read = 0;
+    if (!ring)
+        return;
+    memset(ring, 0, sizeof(IPTSFrameRing));
+    ring->slot_size = slot_size;
+    ring->data_offset = data_offset;
+}
+
+bool IPTSFrameQueue::attach(bool primary, UInt32 *cursor) {
+    for (UInt32 i = 0; i < IPTS_INPUT_CLIENT_NUM; i++) {
+        if (cursors[i].attached)
+            continue;
+        cursors[i].attached = true;
+        cursors[i].primary = primary;
+        cursors[i].read = ring ? ring->head : 0;
+        if (primary)
+            this->primary = &cursors[i];
+        *cursor = i;
+        return true;
+    }
+    return false;
+}
+
+UInt32 IPTSFrameQueue::detach(UInt32 cursor) {
+    memset(&cursors[cursor], 0, sizeof(IPTSFrameCursor));
+    if (&cursors[cursor] != primary)
+        return 0;
+    // whatever the daemon still held goes back to the ME
+    primary = nullptr;
+    return ring ? release() : 0;
+}
+
+bool IPTSFrameQueue::hasFrame(UInt32 cursor) {
+    return ring && cursors[cursor].read != ring->head;
+}
+
+void IPTSFrameQueue::peek(UInt32 cursor, UInt64 *frame) {
+    IPTSFrameCursor *reader = &cursors[cursor];
+    if (!reader->primary && ring->head - reader->read > IPTS_FRAME_RING_SIZE) {
+        // the oldest frames of a slow observer have been overwritten already, it must not hold back the daemon
+        observer_overruns += ring->head - IPTS_FRAME_RING_SIZE - reader->read;
+        reader->missed += ring->head - IPTS_FRAME_RING_SIZE - reader->read;
+        reader->read = ring->head - IPTS_FRAME_RING_SIZE;
+    }
+    UInt32 slot = reader->read % IPTS_FRAME_RING_SIZE;
+    frame[0] = slot;
+    frame[1] = ring->slots[slot].size;
+    frame[2] = ring->slots[slot].sequence | static_cast<UInt64>(reader->missed) << 32;
+    frame[3] = ring->slots[slot].buffer;
+}
+
+void IPTSFrameQueue::invalidate(UInt32 slot) {
+    ring->slots[slot].sequence = IPTS_FRAME_SEQUENCE_INVALID;
+    IPTS_MEMORY_BARRIER();
+}
+
+void IPTSFrameQueue::skipObservers(UInt32 index) {
+    for (UInt32 i = 0; i < IPTS_INPUT_CLIENT_NUM; i++) {
+        IPTSFrameCursor *reader = &cursors[i];
+        // read - index - 1 wraps for readers still at or before the frame, they get the new one
+        if (!reader->attached || reader->primary || reader->read - index - 1 >= ring->head - index)
+            continue;
+        reader->missed++;
+        observer_overruns++;
+    }
+}
+
+void IPTSFrameQueue::resetBuffers() {
+    held = 0;
+    if (!ring)
+        return;
+    // frames the primary has not released yet and those left for observers alike, the readers drop them
+    for (UInt32 i = 0; i < IPTS_FRAME_RING_SIZE; i++) {
+        if (ring->slots[i].buffer != IPTS_FRAME_IN_SLOT && ring->slots[i].sequence != IPTS_FRAME_SEQUENCE_INVALID)
+            invalidate(i);
+    }
+}
+
+UInt32 IPTSFrameQueue::release() {
+    // every frame handed to the daemon so far has been consumed, give back the receive buffers they pinned
+    UInt32 read = primaryRead();
+    UInt32 released = 0;
+    for (UInt32 i = ring->tail; i != read; i++) {
+        UInt32 buffer = ring->slots[i % IPTS_FRAME_RING_SIZE].buffer;
+        if (buffer == IPTS_FRAME_IN_SLOT || !(held & (1 << buffer)))
+            continue;
+        invalidate(i % IPTS_FRAME_RING_SIZE);
+        held &= ~(1 << buffer);
+        released |= 1 << buffer;
+    }
+    ring->tail = read;
+    return released;
+}
+
+UInt8 *IPTSFrameQueue::acquire(IPTSFrameClass frame_class, UInt32 *released) {
+    *released = 0;
+    if (policy[frame_class] == IPTSDeliveryLatest) {
+        // at most one frame of the class waits for the daemon, a newer one takes over its slot
+        for (UInt32 i = primaryRead(); i != ring->head; i++) {
+            UInt32 slot = i % IPTS_FRAME_RING_SIZE;
+            if (slot_class[slot] != frame_class)
+                continue;
+            invalidate(slot);
+            skipObservers(i);
+            superseded[frame_class]++;
+            // the frame was never handed to the daemon, so its receive buffer can go back to the ME right away
+            UInt32 buffer = ring->slots[slot].buffer;
+            if (buffer != IPTS_FRAME_IN_SLOT && (held & (1 << buffer))) {
+                held &= ~(1 << buffer);
+                *released = 1 << buffer;
+            }
+            publish_index = i;
+            return IPTS_FRAME_RING_SLOT_DATA(ring, slot);
+        }
+    }
+    if (ring->head - ring->tail >= IPTS_FRAME_RING_SIZE) {
+        // the daemon still owns every slot
+        ring_drops++;
+        dropped[frame_class]++;
+        return nullptr;
+    }
+    publish_index = ring->head;
+    slot_class[publish_index % IPTS_FRAME_RING_SIZE] = frame_class;
+    invalidate(publish_index % IPTS_FRAME_RING_SIZE);
+    return IPTS_FRAME_RING_SLOT_DATA(ring, publish_index % IPTS_FRAME_RING_SIZE);
+}
+
+bool IPTSFrameQueue::publish(UInt32 size, UInt32 sequence, UInt64 time, UInt32 buffer, UInt32 offset, UInt32 *released) {
+    IPTSFrameRingSlot *slot = &ring->slots[publish_index % IPTS_FRAME_RING_SIZE];
+    *released = 0;
+    if (buffer != IPTS_FRAME_IN_SLOT)
+        held |= 1 << buffer;
+    slot->size = size;
+    slot->buffer = buffer;
+    slot->offset = offset;
+    frame_time[publish_index % IPTS_FRAME_RING_SIZE] = time;
+    // the slot must be complete before its sequence marks it valid
+    IPTS_MEMORY_BARRIER();
+    slot->sequence = sequence;
+    // slot contents must be visible before the daemon can see the new head
+    IPTS_MEMORY_BARRIER();
+    if (publish_index != ring->head) {
+        // replaced a frame the daemon has not seen yet, it is still queued for delivery
+        return false;
+    }
+    ring->head++;
+    if (!primary)
+        *released = release();  // nobody owns the frame, observers can read it until the ring wraps
+    return true;
+}
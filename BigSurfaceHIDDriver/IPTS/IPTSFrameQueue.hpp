@@ -0,0 +1,141 @@
+//
+//  IPTSFrameQueue.hpp
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#ifndef IPTSFrameQueue_hpp
+#define IPTSFrameQueue_hpp
+
+#include "IPTSPortableTypes.h"
+#include "IPTSKenerlUserShared.h"
+
+#define IPTS_INPUT_CLIENT_NUM       4
+
+// Every user client reading frames has its own cursor into the frame ring
+struct IPTSFrameCursor {
+    bool attached;
+    bool primary;           // owns the frames it was handed until it releases them
+    UInt32 read;            // next frame to hand out
+    UInt32 missed;          // frames an observer missed since the last one handed out
+};
+
+/*
+ * The driver side of the frame ring shared with user space, see IPTSFrameRing for the layout and the rules readers
+ * follow. Decides which slot a frame goes to under the delivery policy of its class, hands frames out through
+ * the cursors of the clients and keeps track of the receive buffers the primary client holds with zero copy input.
+ * Receive buffers that can go back to the ME are returned as a mask of buffer indices, giving them back is up to
+ * the caller.
+ * Not thread safe, the driver only calls it from inside its command gate. Kept free of IOKit so it can be
+ * stressed by threads on other hosts.
+ */
+class IPTSFrameQueue {
+public:
+    // Start over on @ring of IPTS_FRAME_RING_SIZE slots, or on nothing once the memory behind it is gone
+    void reset(IPTSFrameRing *ring, UInt32 slot_size, UInt32 data_offset);
+
+    IPTSFrameRing *getRing() { return ring; }
+
+    UInt32 getSlotSize() { return ring ? ring->slot_size : 0; }
+
+    // The ME took every receive buffer back and is about to overwrite them, no frame may point into one any more
+    void resetBuffers();
+
+    bool hasPrimary() { return primary != nullptr; }
+
+    // @return false if every cursor is taken, @cursor starts at the newest frame
+    bool attach(bool primary, UInt32 *cursor);
+
+    // @return the receive buffers the primary held, they can go back to the ME
+    UInt32 detach(UInt32 cursor);
+
+    bool isPrimary(UInt32 cursor) { return &cursors[cursor] == primary; }
+
+    // @return true if a frame is waiting for @cursor
+    bool hasFrame(UInt32 cursor);
+
+    /*
+     * @return true if a frame for @cursor should be sent with a notification now. The primary is notified of the
+     *         next frame only once it released the ones it was handed, the frames queued meanwhile stay open to
+     *         the delivery policy instead of going out the moment they arrive
+     */
+    bool canNotify(UInt32 cursor) { return hasFrame(cursor) && (&cursors[cursor] != primary || primary->read == ring->tail); }
+
+    // Slot, size, sequence and receive buffer of the next frame for @cursor, the values kMethodReceiveInput returns
+    void peek(UInt32 cursor, UInt64 *frame);
+
+    // The frame peek returned was handed to the client, the frames it missed have been reported with it
+    void consume(UInt32 cursor) { cursors[cursor].read++; cursors[cursor].missed = 0; }
+
+    /*
+     * Find a slot for a frame of @frame_class, publish fills it in
+     *
+     * @released: receive buffers of a superseded frame, they can go back to the ME
+     * @return the slot data, nullptr if the frame has to be dropped
+     */
+    UInt8 *acquire(IPTSFrameClass frame_class, UInt32 *released);
+
+    /*
+     * Publish the frame in the slot acquire returned
+     *
+     * @buffer: the receive buffer holding the frame with zero copy input, held until the primary releases it,
+     *          IPTS_FRAME_IN_SLOT if the frame was copied into the slot
+     * @released: receive buffers nobody holds any more
+     * @return true if the frame was appended, false if it took over the slot of a frame still waiting for the primary
+     */
+    bool publish(UInt32 size, UInt32 sequence, UInt64 time, UInt32 buffer, UInt32 offset, UInt32 *released);
+
+    // Every frame handed to the primary so far has been consumed, @return the receive buffers they held
+    UInt32 release();
+
+    // @return true if the primary has taken every frame
+    bool isDrained() { return primaryRead() == ring->head; }
+
+    // @return true if no frame waits for the primary or is still held by it
+    bool isEmpty() { return !ring || ring->head == ring->tail; }
+
+    // When the frame in @slot was taken from the doorbell
+    UInt64 getFrameTime(UInt32 slot) { return frame_time[slot]; }
+
+    // When the oldest frame the primary has not released was taken from the doorbell
+    UInt64 getOldestTime() { return frame_time[ring->tail % IPTS_FRAME_RING_SIZE]; }
+
+    void setPolicy(IPTSFrameClass frame_class, IPTSDeliveryPolicy value) { policy[frame_class] = value; }
+
+    IPTSDeliveryPolicy getPolicy(IPTSFrameClass frame_class) { return static_cast<IPTSDeliveryPolicy>(policy[frame_class]); }
+
+    UInt64 getRingDrops() { return ring_drops; }
+
+    UInt64 getSuperseded(IPTSFrameClass frame_class) { return superseded[frame_class]; }
+
+    UInt64 getDropped(IPTSFrameClass frame_class) { return dropped[frame_class]; }
+
+    UInt64 getObserverOverruns() { return observer_overruns; }
+
+private:
+    // without a primary client every published frame counts as handed out
+    UInt32 primaryRead() { return primary ? primary->read : ring->head; }
+
+    // observers check the sequence again after reading, it has to change before anything behind the slot does
+    void invalidate(UInt32 slot);
+
+    // The frame at @index is replaced in place, observers already past it never see the new one
+    void skipObservers(UInt32 index);
+
+    IPTSFrameRing *ring {nullptr};
+    IPTSFrameCursor cursors[IPTS_INPUT_CLIENT_NUM] {};
+    IPTSFrameCursor *primary {nullptr};
+    UInt32 publish_index {0};
+    UInt32 held {0};        // receive buffers behind frames of the primary
+    UInt64 frame_time[IPTS_FRAME_RING_SIZE] {};
+    UInt8 slot_class[IPTS_FRAME_RING_SIZE] {};
+    UInt8 policy[IPTSFrameClassNum] {IPTSDeliveryLatest, IPTSDeliveryFIFO};
+    UInt64 ring_drops {0};
+    UInt64 superseded[IPTSFrameClassNum] {};
+    UInt64 dropped[IPTSFrameClassNum] {};
+    UInt64 observer_overruns {0};
+};
+
+#endif /* IPTSFrameQueue_hpp */
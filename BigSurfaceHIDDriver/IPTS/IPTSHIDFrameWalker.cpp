@@ -0,0 +1,55 @@
+//
+//  IPTSHIDFrameWalker.cpp
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#include <string.h>
+
+#include "IPTSHIDFrameWalker.hpp"
+
+IPTSHIDFrameWalker::IPTSHIDFrameWalker(const UInt8 *root, UInt32 size) : base(root), offset(IPTS_HID_FRAME_HEADER_SIZE) {
+    if (!root || size < IPTS_HID_FRAME_HEADER_SIZE) {
+        limit[0] = 0;
+        malformed = true;
+        return;
+    }
+    UInt32 root_size;
+    memcpy(&root_size, root, sizeof(UInt32));
+    limit[0] = root_size < size ? root_size : size;
+}
+
+bool IPTSHIDFrameWalker::next(IPTSHIDSubFrame *frame) {
+    while (!malformed) {
+        if (offset + IPTS_HID_FRAME_HEADER_SIZE > limit[depth]) {
+            // the rest of this container is too short for another header
+            if (!depth)
+                return false;
+            offset = limit[depth--];
+            continue;
+        }
+
+        UInt32 size;
+        memcpy(&size, base + offset, sizeof(UInt32));
+        UInt8 type = base[offset + 5];
+        if (size < IPTS_HID_FRAME_HEADER_SIZE || size > limit[depth] - offset) {
+            malformed = true;
+            break;
+        }
+
+        if (type == IPTS_HID_FRAME_TYPE_HID && depth + 1 < IPTS_HID_FRAME_MAX_DEPTH) {
+            limit[++depth] = offset + size;
+            offset += IPTS_HID_FRAME_HEADER_SIZE;
+            continue;
+        }
+
+        frame->type = type;
+        frame->data = base + offset + IPTS_HID_FRAME_HEADER_SIZE;
+        frame->size = size - IPTS_HID_FRAME_HEADER_SIZE;
+        offset += size;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,54 @@
+//
+//  IPTSHIDFrameWalker.hpp
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#ifndef IPTSHIDFrameWalker_hpp
+#define IPTSHIDFrameWalker_hpp
+
+#include "IPTSPortableTypes.h"
+
+#define IPTS_HID_FRAME_TYPE_HID         0x0
+#define IPTS_HID_FRAME_TYPE_HEATMAP     0x1
+#define IPTS_HID_FRAME_TYPE_METADATA    0x2
+#define IPTS_HID_FRAME_TYPE_RAW         0xEE    // Made-up type for passing raw IPTS data in a HID report.
+#define IPTS_HID_FRAME_TYPE_REPORTS     0xFF
+
+#define IPTS_HID_FRAME_HEADER_SIZE      7       // sizeof(IPTSHIDHeader)
+#define IPTS_HID_FRAME_MAX_DEPTH        3
+
+struct IPTSHIDSubFrame {
+    UInt8 type;         // IPTS_HID_FRAME_TYPE_*
+    const UInt8 *data;
+    UInt32 size;        // without the header
+};
+
+/*
+ * Walks the frames inside the root IPTSHIDHeader of a HID data or feature report.
+ *
+ * Frames of type IPTS_HID_FRAME_TYPE_HID are containers and are entered instead of returned, so the caller only
+ * sees heatmap, metadata and report frames in buffer order. Every header is checked against the bounds of its
+ * parent before anything behind it is touched. Headers are read with memcpy, the buffer may be unaligned.
+ */
+class IPTSHIDFrameWalker {
+public:
+    // @root: the root header, @size: bytes readable from @root on
+    IPTSHIDFrameWalker(const UInt8 *root, UInt32 size);
+
+    // @return false once all frames were visited or a malformed header was found
+    bool next(IPTSHIDSubFrame *frame);
+
+    bool isMalformed() { return malformed; }
+
+private:
+    const UInt8 *base;
+    UInt32 limit[IPTS_HID_FRAME_MAX_DEPTH];
+    UInt32 offset;
+    UInt32 depth {0};
+    bool malformed {false};
+};
+
+#endif /* IPTSHIDFrameWalker_hpp */
@@ -55,6 +55,9 @@ struct PACKED IPTSHIDReport {
     } report;
 };
 
+// Maximum number of reports accepted by a single kMethodSendHIDReports call
+#define IPTS_HID_REPORT_BATCH_MAX   64
+
 struct PACKED IPTSMetadataSize {
     UInt32 rows;
     UInt32 columns;
@@ -96,11 +99,189 @@ struct PACKED IPTSDeviceInfo {
     IPTSDeviceMetaData meta_data;
 };
 
+#define IPTS_FRAME_RING_SIZE    8
+
+/*
+ * Layout of the memory returned by IntelPreciseTouchStylusUserClient::clientMemoryForType.
+ *
+ * An IPTSFrameRing header is followed, at data_offset, by IPTS_FRAME_RING_SIZE slots
+ * of slot_size bytes each. head and tail are free running counters written by the driver only,
+ * a frame index maps to slot (index % IPTS_FRAME_RING_SIZE).
+ * The driver fills the slot at head and then advances head, frames in [tail, head) belong to the daemon.
+ * kMethodReceiveInput hands out the frames one by one in order, they are released back to the driver
+ * when the daemon calls kMethodToggleProcessingStatus with 0, so several frames can be in flight at once.
+ * A frame kMethodReceiveInput has not handed out yet may be replaced in its slot by a newer frame of the same
+ * IPTSFrameClass under IPTSDeliveryLatest, so the slots are not necessarily in sequence order.
+ * A primary registered with kMethodRegisterInputNotification is notified of one frame at a time instead, the next
+ * notification is sent once it released the frame with kMethodToggleProcessingStatus 0. Frames arriving meanwhile
+ * wait in the ring, where IPTSDeliveryLatest keeps only the newest of each class.
+ *
+ * With IPTSOptionZeroCopyInput enabled, HID frames are not copied into the slot. Instead buffer names
+ * the receive buffer holding the frame (mapped with kIPTSMemoryTypeRxBuffer + buffer) and offset is where
+ * the frame starts inside it. The receive buffer stays untouched by the ME until the frame is released, unless the
+ * ME resets. The driver then sets the sequence of every such slot to IPTS_FRAME_SEQUENCE_INVALID before handing the
+ * buffers back, so the primary has to check the sequence again after reading a zero copy frame as well.
+ *
+ * Only the primary client owns frames, observers read the same ring through their own cursor and may see a frame
+ * recycled under them. The driver sets the sequence of a slot to IPTS_FRAME_SEQUENCE_INVALID before its data
+ * or the receive buffer behind it is reused, so an observer has to read the sequence of the slot again after
+ * reading the frame and drop the frame if it changed.
+ * A frame that replaces one an observer has already passed is never seen by that observer, nor are frames
+ * overwritten before it got to them. kMethodReceiveInput reports how many frames an observer missed since its last
+ * frame in the upper 32 bits of the sequence scalar, see IPTS_FRAME_MISSED.
+ */
+#define IPTS_FRAME_IN_SLOT      0xFFFFFFFF
+#define IPTS_FRAME_SEQUENCE_INVALID     0
+#define IPTS_FRAME_SEQUENCE_REPLAY      0x80000000  // set on frames fed in with kMethodReplayTrace
+#define IPTS_FRAME_MISSED(sequence)     ((UInt32)((sequence) >> 32))    // always 0 for the primary client
+
+struct PACKED IPTSFrameRingSlot {
+    UInt32 sequence;
+    UInt32 size;
+    UInt32 buffer;
+    UInt32 offset;
+};
+
+enum IPTSFrameClass {
+    IPTSFrameClassTouch,        // carries a heatmap or raw sensor data
+    IPTSFrameClassStylus,       // only carries pen reports, stylus samples or the DFT windows they are made from
+    IPTSFrameClassNum,
+};
+
+enum IPTSDeliveryPolicy {
+    IPTSDeliveryFIFO,           // every frame is queued, new frames are dropped while the ring is full
+    IPTSDeliveryLatest,         // a frame still waiting for the daemon is replaced by a newer one of its class
+};
+
+struct PACKED IPTSFrameRing {
+    UInt32 head;
+    UInt32 tail;
+    UInt32 slot_size;
+    UInt32 data_offset;
+    IPTSFrameRingSlot slots[IPTS_FRAME_RING_SIZE];
+};
+
+#define IPTS_FRAME_RING_SLOT_DATA(ring, slot) ((UInt8 *)(ring) + (ring)->data_offset + (slot) * (ring)->slot_size)
+
+/*
+ * Latency of every frame is split into stages and accumulated into log2 buckets,
+ * bucket i counts the samples in [2^i, 2^(i+1)) microseconds, bucket 0 also takes everything below 1us.
+ */
+#define IPTS_LATENCY_BUCKET_NUM     24
+
+enum IPTSLatencyStage {
+    IPTSLatencyStageHandoff,    // doorbell detection -> daemon wakeup
+    IPTSLatencyStageDaemon,     // daemon wakeup -> HID report returned
+    IPTSLatencyStageDispatch,   // HID report returned -> handed to the HID stack
+    IPTSLatencyStageTotal,      // doorbell detection -> handed to the HID stack
+    IPTSLatencyStageHostOwned,  // doorbell detection -> receive buffer given back to the ME
+    IPTSLatencyStageWake,       // touch that woke the sensor -> handed to the HID stack, less the usual total
+    IPTSLatencyStageStall,      // last sign of the stalled daemon -> daemon caught up or went away
+    IPTSLatencyStageNum,
+};
+
+struct PACKED IPTSLatencyHistogram {
+    UInt64 count;
+    UInt64 total_us;
+    UInt64 max_us;
+    UInt32 buckets[IPTS_LATENCY_BUCKET_NUM];
+};
+
+struct PACKED IPTSLatencyStatistics {
+    IPTSLatencyHistogram stages[IPTSLatencyStageNum];
+};
+
+/*
+ * Every IPTSDataHeader seen while polling can be recorded into a trace,
+ * each record is followed by size bytes of payload and padded to 8 bytes.
+ * Drained traces can be fed back unchanged to kMethodReplayTrace.
+ */
+struct PACKED IPTSTraceRecord {
+    UInt64 timestamp;   // uptime in ns when the doorbell was seen
+    UInt32 doorbell;
+    UInt32 size;
+    UInt8  type;
+    UInt8  buffer;
+    UInt16 reserved;
+    UInt32 reserved2;
+};
+
+#define IPTS_TRACE_RECORD_SIZE(size) ((sizeof(IPTSTraceRecord) + (size) + 7) & ~7UL)
+
+/*
+ * Connection type passed to IOServiceOpen. A single primary client, the multitouch daemon, may be attached.
+ * It is the only one allowed to submit HID reports, set options and drain traces. Any number of observers up to
+ * IPTS_INPUT_CLIENT_NUM may read frames alongside it, they never hold frames back and are skipped ahead when they
+ * fall a full ring behind.
+ */
+enum {
+    kIPTSClientTypePrimary      = 0,
+    kIPTSClientTypeObserver     = 1,
+};
+
+enum {
+    kIPTSMemoryTypeFrameRing    = 0,
+    kIPTSMemoryTypeRxBuffer     = 1,    // + receive buffer index, read only
+};
+
+/*
+ * Every frame taken from the doorbell gets the next sequence number. The same number is handed to the daemon
+ * through the frame ring and comes back with kMethodSendHIDReports, so each stage can tell which frame it is at.
+ * Every place that loses frames or reports counts them separately.
+ * Replayed frames are numbered on their own with IPTS_FRAME_SEQUENCE_REPLAY set and count as replayed_frames
+ * instead of frames. They are left out of the sequences, the delivered and reported frames and the latency
+ * statistics, the loss counters include them.
+ */
+struct PACKED IPTSPipelineStatistics {
+    UInt32 doorbell_sequence;       // last frame taken from the doorbell
+    UInt32 delivered_sequence;      // last frame handed to the daemon
+    UInt32 reported_sequence;       // last frame the daemon returned reports for
+    UInt32 dispatched_sequence;     // last frame whose reports reached the HID stack
+    UInt64 frames;                  // frames taken from the doorbell
+    UInt64 delivered_frames;        // frames handed to the daemon
+    UInt64 reported_frames;         // frames the daemon returned reports for
+    UInt64 doorbell_drops;          // overwritten by the ME before they were polled
+    UInt64 coalesced_frames;        // not handed to the daemon, a newer frame was already waiting
+    UInt64 ring_drops;              // not handed to the daemon, the frame ring was full
+    UInt64 malformed_frames;
+    UInt64 rejected_reports;        // reports from the daemon with an unknown report id
+    UInt64 touch_overflows;         // touch reports dropped from a full report queue
+    UInt64 stylus_overflows;        // stylus reports dropped from a full report queue
+    UInt64 trace_drops;
+    UInt64 superseded_frames[IPTSFrameClassNum];    // replaced by a newer frame before the daemon took them
+    UInt64 dropped_frames[IPTSFrameClassNum];       // ring_drops by frame class
+    UInt64 daemon_stalls;           // times the driver fell back to single touch for a stalled daemon
+    UInt64 observer_overruns;       // frames observers missed, overwritten or replaced after they passed the slot
+    UInt64 replayed_frames;
+    UInt64 notification_failures;   // frame notifications that could not be sent, the frames stay queued
+};
+
+enum IPTSOption {
+    IPTSOptionZeroCopyInput,
+    IPTSOptionRecordTrace,
+    IPTSOptionDecodeStylus,     // pen reports are built by the driver, the daemon only needs to handle touch and
+                                // skips stylus reports in the frames that still reach it for their other reports
+    IPTSOptionTouchDelivery,    // IPTSDeliveryPolicy of IPTSFrameClassTouch, IPTSDeliveryLatest by default
+    IPTSOptionStylusDelivery,   // IPTSDeliveryPolicy of IPTSFrameClassStylus, IPTSDeliveryFIFO by default
+};
+
 enum {
     kMethodGetDeviceInfo,
-    kMethodReceiveInput,
-    kMethodSendHIDReport,
+    kMethodReceiveInput,            // outputs slot, size, sequence and buffer of the next frame, the sequence
+                                    // carries the frames an observer missed, see IPTS_FRAME_MISSED
+    kMethodSendHIDReport,           // primary only, like every method that feeds the HID stack or changes the driver
     kMethodToggleProcessingStatus,
+    kMethodSetOption,               // inputs IPTSOption and its value
+    kMethodSendHIDReports,          // inputs an array of IPTSHIDReport and optionally the sequence of their frame,
+                                    // outputs how many were accepted
+    kMethodRegisterInputNotification,   // async, inputs 1 to register and 0 to unregister,
+                                        // each completion carries the same values as kMethodReceiveInput
+    kMethodGetLatencyStatistics,    // outputs IPTSLatencyStatistics
+    kMethodReadTrace,               // outputs whole IPTSTraceRecords and the number of bytes written
+    kMethodReplayTrace,             // inputs 1 to keep recorded timing or 0 for maximum speed and the records,
+                                    // outputs how many records were replayed, pauses are cut to 1s and records
+                                    // have to be in time order to keep the timing
+    kMethodGetStatistics,           // outputs IPTSPipelineStatistics
     
     kNumberOfMethods
 };
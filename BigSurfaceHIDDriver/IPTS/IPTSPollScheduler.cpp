@@ -0,0 +1,97 @@
+//
+//  IPTSPollScheduler.cpp
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#include "IPTSPollScheduler.hpp"
+
+UInt64 IPTSPollScheduler::getStep() {
+    UInt64 step = frame_period / 16000;
+    return step < IPTS_MIN_POLL_INTERVAL ? IPTS_MIN_POLL_INTERVAL : step;
+}
+
+void IPTSPollScheduler::start(UInt64 now) {
+    busy = false;
+    last_poll = now;
+    last_frame = now;
+}
+
+bool IPTSPollScheduler::update(UInt64 now, UInt32 frames) {
+    bool idle = false;
+    if (frames > 0) {
+        // The newest frame arrived somewhere between the previous poll and now
+        UInt64 window = now - last_poll;
+        UInt64 arrival = last_poll + window / 2;
+        UInt64 sample = 0;
+        // Until the period is known the busy polls are the narrowest windows there are
+        UInt64 precise = frame_period ? getStep() * 1000 : IPTS_BUSY_TIMEOUT * 1000000ULL;
+        if (busy && window <= precise) {
+            // Narrow enough to measure the period between two such frames directly. The busy polls are still
+            // coarse, so the first measurement spans a few frames.
+            UInt32 count = precise_frames + frames;
+            if (!precise_frame || frame_period || count >= IPTS_PROBE_FRAMES) {
+                if (precise_frame)
+                    sample = (arrival - precise_frame) / count;
+                precise_frame = arrival;
+                precise_frames = 0;
+            } else {
+                precise_frames = count;
+            }
+        } else {
+            precise_frames += frames;
+            if (busy && frame_period) {
+                // Stay on the phase we have learned as long as it is consistent with the window, a frame that
+                // is already there before it was due means the period is shorter than we think
+                UInt64 predicted = last_frame + frames * frame_period;
+                arrival = predicted < last_poll ? last_poll : predicted;
+                if (predicted > now) {
+                    arrival = now;
+                    sample = (now - last_frame) / frames;
+                }
+            }
+        }
+        if (sample >= IPTS_MIN_FRAME_PERIOD && sample <= IPTS_MAX_FRAME_PERIOD)
+            frame_period = frame_period ? (frame_period * 7 + sample) / 8 : sample;
+        last_frame = arrival;
+        busy = true;
+    } else if (busy) {
+        empty_wakeups++;
+        if (now - last_frame > IPTS_IDLE_THRESHOLD) {
+            busy = false;
+            precise_frame = 0;
+            idle = true;
+        }
+    }
+    last_poll = now;
+    return idle;
+}
+
+UInt32 IPTSPollScheduler::nextPoll(UInt64 now, bool dozing) {
+    if (!busy) {
+        // a dozing sensor scans slowly as well, polling fast would only waste wakeups
+        return (dozing ? IPTS_DOZE_TIMEOUT : IPTS_IDLE_TIMEOUT) * 1000;
+    }
+    if (!frame_period)
+        return IPTS_BUSY_TIMEOUT * 1000;
+
+    if (now - last_frame > 4 * frame_period) {
+        // the sensor has stopped streaming (e.g. finger lifted), wait for it at a relaxed rate
+        return IPTS_ACTIVE_TIMEOUT * 1000;
+    }
+
+    // Wake up one step after the next frame is due so that a frame on time is found by the first poll, a late
+    // one is chased in small steps, which also narrows down its arrival enough to measure the period
+    UInt64 step = getStep();
+    UInt64 target = last_frame + frame_period + step * 1000;
+    if (precise_frames >= IPTS_PROBE_FRAMES) {
+        // Frames found by the first poll tell nothing about the period, every now and then look a step early
+        // to find out whether the period is shorter than we think
+        target -= 2 * step * 1000;
+    }
+    if (target > now + IPTS_MIN_POLL_INTERVAL * 1000)
+        return static_cast<UInt32>((target - now) / 1000);
+    return static_cast<UInt32>(step);
+}
@@ -0,0 +1,71 @@
+//
+//  IPTSPollScheduler.hpp
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#ifndef IPTSPollScheduler_hpp
+#define IPTSPollScheduler_hpp
+
+#include "IPTSPortableTypes.h"
+
+#define IPTS_BUSY_TIMEOUT       5           // ms
+#define IPTS_ACTIVE_TIMEOUT     10          // ms
+#define IPTS_IDLE_TIMEOUT       50          // ms
+#define IPTS_DOZE_TIMEOUT       100         // ms
+
+#define IPTS_MIN_POLL_INTERVAL  500         // us
+#define IPTS_MIN_FRAME_PERIOD   2000000     // ns, 500Hz
+#define IPTS_MAX_FRAME_PERIOD   50000000    // ns, 20Hz
+#define IPTS_IDLE_THRESHOLD     1500000000ULL // ns, fall back to idle polling after 1.5s without frames
+#define IPTS_PROBE_FRAMES       8           // frames between two polls that are armed early to re-measure the period
+
+/*
+ * Decides when the doorbell is polled next. The frame period of the sensor is learned from frames that were found
+ * shortly after the previous poll, the next poll is armed just after the next frame is due and polling relaxes
+ * once frames stop.
+ * Kept free of IOKit so it can be driven by a simulated doorbell on other hosts.
+ */
+class IPTSPollScheduler {
+public:
+    // Forget the activity so far, e.g. when the device has just become ready at @now
+    void start(UInt64 now);
+
+    // The doorbell restarted at @now, frames before it must not count towards the period
+    void resync(UInt64 now) { last_poll = now; }
+
+    /*
+     * Feed the result of the poll at @now that found @frames new buffers
+     *
+     * @return true when the sensor has just gone idle
+     */
+    bool update(UInt64 now, UInt32 frames);
+
+    // @return us until the next poll, call after update
+    UInt32 nextPoll(UInt64 now, bool dozing);
+
+    bool isBusy() { return busy; }
+
+    // Estimated arrival of the newest frame
+    UInt64 getLastFrame() { return last_frame; }
+
+    UInt64 getFramePeriod() { return frame_period; }
+
+    UInt64 getEmptyWakeups() { return empty_wakeups; }
+
+private:
+    // us between the polls that chase a late frame, a frame found by one of them has a known arrival
+    UInt64 getStep();
+
+    bool busy {false};
+    UInt64 last_poll {0};
+    UInt64 last_frame {0};
+    UInt64 frame_period {0};
+    UInt64 precise_frame {0};
+    UInt32 precise_frames {0};
+    UInt64 empty_wakeups {0};
+};
+
+#endif /* IPTSPollScheduler_hpp */
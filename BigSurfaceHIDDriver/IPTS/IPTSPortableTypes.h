@@ -0,0 +1,34 @@
+//
+//  IPTSPortableTypes.h
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#ifndef IPTSPortableTypes_h
+#define IPTSPortableTypes_h
+
+// Lets the frame processing code build without IOKit, so it can be fed recorded frames on other hosts
+#if defined(KERNEL) || defined(__APPLE__)
+#include <IOKit/IOTypes.h>
+#else
+#include <stdint.h>
+typedef uint8_t     UInt8;
+typedef uint16_t    UInt16;
+typedef uint32_t    UInt32;
+typedef uint64_t    UInt64;
+typedef int16_t     SInt16;
+typedef int32_t     SInt32;
+typedef int64_t     SInt64;
+#endif
+
+// Orders the writes to memory shared with user space
+#ifdef KERNEL
+#include <libkern/OSAtomic.h>
+#define IPTS_MEMORY_BARRIER()   OSMemoryBarrier()
+#else
+#define IPTS_MEMORY_BARRIER()   __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+#endif /* IPTSPortableTypes_h */
@@ -10,6 +10,7 @@
 #define IPTSProtocol_h
 
 #include "IPTSKenerlUserShared.h"
+#include "IPTSHIDFrameWalker.hpp"
 
 /*
  * Queries the device for vendor specific information.
@@ -166,6 +167,12 @@ enum IPTSCommandStatus {
  */
 #define IPTS_TX_BUFFER IPTS_BUFFER_NUM
 
+/*
+ * How often a buffer is given back again while quiescing when the ME rejects its FEEDBACK as outstanding, every
+ * buffer has a budget of its own.
+ */
+#define IPTS_QUIESCE_RETRIES 16
+
 struct PACKED IPTSCommand {
     UInt32 code;
     UInt8  payload[320];
@@ -418,13 +425,6 @@ struct PACKED IPTSDataHeader {
 };
 
 
-#define IPTS_HID_FRAME_TYPE_HID         0x0
-#define IPTS_HID_FRAME_TYPE_HEATMAP     0x1
-#define IPTS_HID_FRAME_TYPE_METADATA    0x2
-#define IPTS_HID_FRAME_TYPE_RAW         0xEE    // Made-up type for passing raw IPTS data in a HID report.
-#define IPTS_HID_FRAME_TYPE_REPORTS     0xFF
-
-
 struct PACKED IPTSHIDHeader {
     UInt32 size;
     UInt8  reserved1;
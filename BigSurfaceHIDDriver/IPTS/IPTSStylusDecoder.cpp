@@ -0,0 +1,188 @@
+//
+//  IPTSStylusDecoder.cpp
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#include <string.h>
+
+#include "IPTSStylusDecoder.hpp"
+
+// sin of 0 - 90 degrees in Q15
+static const SInt16 sin_table[91] = {
+    0, 572, 1144, 1715, 2286, 2856, 3425, 3993, 4560, 5126,
+    5690, 6252, 6813, 7371, 7927, 8481, 9032, 9580, 10126, 10668,
+    11207, 11743, 12275, 12803, 13328, 13848, 14364, 14876, 15383, 15886,
+    16383, 16876, 17364, 17846, 18323, 18794, 19260, 19720, 20173, 20621,
+    21062, 21497, 21925, 22347, 22762, 23170, 23571, 23964, 24351, 24730,
+    25101, 25465, 25821, 26169, 26509, 26841, 27165, 27481, 27788, 28087,
+    28377, 28659, 28932, 29196, 29451, 29697, 29934, 30162, 30381, 30591,
+    30791, 30982, 31163, 31335, 31498, 31650, 31794, 31927, 32051, 32165,
+    32269, 32364, 32448, 32523, 32587, 32642, 32687, 32722, 32747, 32762,
+    32767,
+};
+
+// atan(2^-i) in centidegrees
+static const SInt32 atan_table[14] = {4500, 2657, 1404, 713, 358, 179, 90, 45, 22, 11, 6, 3, 1, 1};
+
+SInt32 IPTSStylusDecoder::sin(SInt32 angle) {
+    angle %= 36000;
+    if (angle < 0)
+        angle += 36000;
+
+    SInt32 sign = 1;
+    if (angle >= 18000) {
+        angle -= 18000;
+        sign = -1;
+    }
+    if (angle > 9000)
+        angle = 18000 - angle;
+
+    SInt32 index = angle / 100;
+    SInt32 frac = angle % 100;
+    SInt32 value = sin_table[index];
+    if (frac)
+        value += (sin_table[index + 1] - value) * frac / 100;
+    return sign * value;
+}
+
+SInt32 IPTSStylusDecoder::atan2(SInt32 y, SInt32 x) {
+    if (x == 0 && y == 0)
+        return 0;
+
+    SInt32 angle = 0;
+    if (x < 0) {
+        // rotate by -90 degrees so the vector lies in the first quadrant
+        SInt32 temp = x;
+        x = y;
+        y = -temp;
+        angle = 9000;
+    }
+
+    for (int i = 0; i < 14; i++) {
+        SInt32 nx, ny;
+        if (y > 0) {
+            nx = x + (y >> i);
+            ny = y - (x >> i);
+            angle += atan_table[i];
+        } else {
+            nx = x - (y >> i);
+            ny = y + (x >> i);
+            angle -= atan_table[i];
+        }
+        x = nx;
+        y = ny;
+    }
+    // the rounding of the table can step a few centidegrees past either axis
+    return angle < 0 ? 0 : (angle > 18000 ? 18000 : angle);
+}
+
+void IPTSStylusDecoder::computeTilt(UInt32 altitude, UInt32 azimuth, UInt16 *x_tilt, UInt16 *y_tilt) {
+    if (altitude == 0) {
+        *x_tilt = IPTS_STYLUS_TILT_CENTER;
+        *y_tilt = IPTS_STYLUS_TILT_CENTER;
+        return;
+    }
+
+    SInt32 sin_alt = sin(altitude);
+    SInt32 cos_alt = sin(altitude + 9000);
+    SInt32 sin_azm = sin(azimuth);
+    SInt32 cos_azm = sin(azimuth + 9000);
+
+    // tilt towards x is the angle between the pen and the screen normal projected onto the x/z plane
+    SInt32 atan_x = atan2(cos_alt, (sin_alt * cos_azm) >> 15);
+    SInt32 atan_y = atan2(cos_alt, (sin_alt * sin_azm) >> 15);
+
+    SInt32 tilt_x = 2 * IPTS_STYLUS_TILT_CENTER - atan_x;
+    SInt32 tilt_y = atan_y;
+    *x_tilt = tilt_x < 0 ? 0 : (tilt_x > 2 * IPTS_STYLUS_TILT_CENTER ? 2 * IPTS_STYLUS_TILT_CENTER : tilt_x);
+    *y_tilt = tilt_y < 0 ? 0 : (tilt_y > 2 * IPTS_STYLUS_TILT_CENTER ? 2 * IPTS_STYLUS_TILT_CENTER : tilt_y);
+}
+
+UInt32 IPTSStylusDecoder::scan(const UInt8 *reports, UInt32 size) {
+    UInt32 found = 0;
+    UInt32 offset = 0;
+
+    while (offset + sizeof(IPTSReportHeader) <= size) {
+        IPTSReportHeader report;
+        memcpy(&report, reports + offset, sizeof(IPTSReportHeader));
+        offset += sizeof(IPTSReportHeader);
+        if (report.size > size - offset)
+            return found | IPTS_REPORTS_OTHER;
+        offset += report.size;
+
+        if (report.type == IPTS_REPORT_TYPE_STYLUS_V1 || report.type == IPTS_REPORT_TYPE_STYLUS_V2)
+            found |= IPTS_REPORTS_STYLUS;
+        else if (report.type == IPTS_REPORT_TYPE_HEATMAP)
+            found |= IPTS_REPORTS_HEATMAP;
+        else
+            found |= IPTS_REPORTS_OTHER;
+    }
+    return offset == size ? found : found | IPTS_REPORTS_OTHER;
+}
+
+UInt32 IPTSStylusDecoder::decode(const UInt8 *reports, UInt32 size, UInt16 scan_time, IPTSStylusSample *samples, UInt32 max_samples) {
+    UInt32 num = 0;
+    UInt32 offset = 0;
+
+    while (offset + sizeof(IPTSReportHeader) <= size && num < max_samples) {
+        IPTSReportHeader report;
+        memcpy(&report, reports + offset, sizeof(IPTSReportHeader));
+        offset += sizeof(IPTSReportHeader);
+        if (report.size > size - offset)
+            break;
+
+        const UInt8 *data = reports + offset;
+        offset += report.size;
+
+        UInt32 element_size;
+        if (report.type == IPTS_REPORT_TYPE_STYLUS_V1)
+            element_size = sizeof(IPTSStylusDataV1);
+        else if (report.type == IPTS_REPORT_TYPE_STYLUS_V2)
+            element_size = sizeof(IPTSStylusDataV2);
+        else
+            continue;
+
+        if (report.size < sizeof(IPTSStylusReportHeader))
+            continue;
+        IPTSStylusReportHeader header;
+        memcpy(&header, data, sizeof(IPTSStylusReportHeader));
+        UInt32 elements = (report.size - sizeof(IPTSStylusReportHeader)) / element_size;
+        if (header.elements < elements)
+            elements = header.elements;
+        data += sizeof(IPTSStylusReportHeader);
+
+        for (UInt32 i = 0; i < elements && num < max_samples; i++, data += element_size) {
+            IPTSStylusSample *sample = &samples[num++];
+            if (report.type == IPTS_REPORT_TYPE_STYLUS_V1) {
+                IPTSStylusDataV1 v1;
+                memcpy(&v1, data, sizeof(IPTSStylusDataV1));
+                sample->mode = v1.mode;
+                sample->x = v1.x;
+                sample->y = v1.y;
+                sample->pressure = v1.pressure * 4;
+                sample->x_tilt = IPTS_STYLUS_TILT_CENTER;
+                sample->y_tilt = IPTS_STYLUS_TILT_CENTER;
+                sample->scan_time = scan_time;
+            } else {
+                IPTSStylusDataV2 v2;
+                memcpy(&v2, data, sizeof(IPTSStylusDataV2));
+                sample->mode = v2.mode;
+                sample->x = v2.x;
+                sample->y = v2.y;
+                sample->pressure = v2.pressure;
+                computeTilt(v2.altitude, v2.azimuth, &sample->x_tilt, &sample->y_tilt);
+                sample->scan_time = v2.timestamp;
+            }
+            if (sample->x > IPTS_STYLUS_MAX_X)
+                sample->x = IPTS_STYLUS_MAX_X;
+            if (sample->y > IPTS_STYLUS_MAX_Y)
+                sample->y = IPTS_STYLUS_MAX_Y;
+            if (sample->pressure > IPTS_STYLUS_MAX_PRESSURE)
+                sample->pressure = IPTS_STYLUS_MAX_PRESSURE;
+        }
+    }
+    return num;
+}
@@ -0,0 +1,103 @@
+//
+//  IPTSStylusDecoder.hpp
+//  SurfaceTouchScreen
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#ifndef IPTSStylusDecoder_hpp
+#define IPTSStylusDecoder_hpp
+
+#include "IPTSPortableTypes.h"
+
+#define IPTS_REPORT_TYPE_HEATMAP        0x25
+#define IPTS_REPORT_TYPE_STYLUS_V1      0x10
+#define IPTS_REPORT_TYPE_STYLUS_V2      0x60
+
+// What IPTSStylusDecoder::scan found in a reports frame
+#define IPTS_REPORTS_STYLUS             (1 << 0)    // stylus reports decode turns into samples
+#define IPTS_REPORTS_HEATMAP            (1 << 1)    // legacy touch heatmap reports
+#define IPTS_REPORTS_OTHER              (1 << 2)    // anything else, e.g. the DFT windows of MPP 2 pens, or a cut short report
+
+#define IPTS_STYLUS_MODE_PROXIMITY      (1 << 0)
+#define IPTS_STYLUS_MODE_TOUCH          (1 << 1)
+#define IPTS_STYLUS_MODE_BUTTON         (1 << 2)
+#define IPTS_STYLUS_MODE_RUBBER         (1 << 3)
+
+#define IPTS_STYLUS_MAX_X               9600
+#define IPTS_STYLUS_MAX_Y               7200
+#define IPTS_STYLUS_MAX_PRESSURE        4096
+#define IPTS_STYLUS_TILT_CENTER         9000    // logical tilt 0 - 18000 is -90 - 90 degrees
+
+struct __attribute__((packed)) IPTSReportHeader {
+    UInt8  type;
+    UInt8  flags;
+    UInt16 size;
+};
+
+struct __attribute__((packed)) IPTSStylusReportHeader {
+    UInt8  elements;
+    UInt8  reserved[3];
+    UInt32 serial;
+};
+
+struct __attribute__((packed)) IPTSStylusDataV1 {
+    UInt8  reserved[4];
+    UInt8  mode;
+    UInt16 x;
+    UInt16 y;
+    UInt16 pressure;    // 0 - 1024
+    UInt8  reserved2;
+};
+
+struct __attribute__((packed)) IPTSStylusDataV2 {
+    UInt16 timestamp;
+    UInt16 mode;
+    UInt16 x;
+    UInt16 y;
+    UInt16 pressure;
+    UInt16 altitude;    // centidegrees from the screen normal, 0 if unknown
+    UInt16 azimuth;     // centidegrees
+    UInt16 reserved;
+};
+
+// One pen sample in the ranges of the stylus report descriptor
+struct IPTSStylusSample {
+    UInt8  mode;        // IPTS_STYLUS_MODE_*
+    UInt16 x;
+    UInt16 y;
+    UInt16 pressure;
+    UInt16 x_tilt;
+    UInt16 y_tilt;
+    UInt16 scan_time;
+};
+
+/*
+ * Decodes the stylus reports of an IPTS_HID_FRAME_TYPE_REPORTS frame without floating point.
+ * Tilt is derived from altitude and azimuth with table based sine and a CORDIC arctangent.
+ */
+class IPTSStylusDecoder {
+public:
+    /*
+     * @reports: payload of the reports frame, a sequence of IPTSReportHeader + data
+     * @scan_time: used for v1 samples that carry no timestamp of their own
+     *
+     * @return number of samples written to @samples
+     */
+    static UInt32 decode(const UInt8 *reports, UInt32 size, UInt16 scan_time, IPTSStylusSample *samples, UInt32 max_samples);
+
+    // @return IPTS_REPORTS_* of the reports in the payload of a reports frame, only what decode skips needs the daemon
+    static UInt32 scan(const UInt8 *reports, UInt32 size);
+
+    // Converts altitude and azimuth in centidegrees to logical x/y tilt
+    static void computeTilt(UInt32 altitude, UInt32 azimuth, UInt16 *x_tilt, UInt16 *y_tilt);
+
+    // sin of an angle in centidegrees, Q15
+    static SInt32 sin(SInt32 angle);
+
+    // atan2 in centidegrees for y >= 0, 0 - 18000
+    static SInt32 atan2(SInt32 y, SInt32 x);
+};
+
+#endif /* IPTSStylusDecoder_hpp */
@@ -9,9 +9,10 @@
 #include "IntelPreciseTouchStylusDriver.hpp"
 #include "SurfaceTouchScreenDevice.hpp"
 
-#define IPTS_BUSY_TIMEOUT       5
-#define IPTS_ACTIVE_TIMEOUT     10
-#define IPTS_IDLE_TIMEOUT       50
+#define IPTS_QUIESCE_RESET      (1 << IPTS_TX_BUFFER)   // soft reset still to be sent after the flush
+
+#define IPTS_TRACE_BUFFER_SIZE  (1 << 20)   // must be a power of 2
+#define IPTS_REPLAY_MAX_GAP     1000        // ms, longer pauses between replayed records are cut short
 
 #define super IOService
 OSDefineMetaClassAndStructors(IntelPreciseTouchStylusDriver, IOService)
@@ -31,12 +32,43 @@ bool IntelPreciseTouchStylusDriver::start(IOService *provider) {
     if (!super::start(provider))
         return false;
     
+    OSBoolean *drain = OSDynamicCast(OSBoolean, getProperty("DrainDoorbell"));
+    OSBoolean *coalesce = OSDynamicCast(OSBoolean, getProperty("CoalesceTouchFrames"));
+    doorbell.setOptions(!drain || drain->isTrue(), !coalesce || coalesce->isTrue());
+    doorbell.setActions(this, OSMemberFunctionCast(IPTSDoorbell::ClassifyAction, this, &IntelPreciseTouchStylusDriver::isDaemonFrame),
+                        OSMemberFunctionCast(IPTSDoorbell::HandleAction, this, &IntelPreciseTouchStylusDriver::handleBuffer),
+                        OSMemberFunctionCast(IPTSDoorbell::RefillAction, this, &IntelPreciseTouchStylusDriver::refillBuffers));
+    OSBoolean *keep_dma = OSDynamicCast(OSBoolean, getProperty("KeepDMAMemory"));
+    if (keep_dma)
+        keep_dma_memory = keep_dma->isTrue();
+    OSBoolean *cacheable = OSDynamicCast(OSBoolean, getProperty("CacheableFrameRing"));
+    if (cacheable)
+        cacheable_ring = cacheable->isTrue();
+    OSNumber *stall = OSDynamicCast(OSNumber, getProperty("DaemonStallTimeout"));
+    if (stall)
+        stall_timeout = stall->unsigned32BitValue();
+    OSNumber *doze = OSDynamicCast(OSNumber, getProperty("DozeTimeout"));
+    if (doze)
+        doze_timeout = doze->unsigned32BitValue();
+    OSBoolean *detection = OSDynamicCast(OSBoolean, getProperty("InDriverContactDetection"));
+    if (detection && detection->isTrue()) {
+        contact_detector = new IPTSContactDetector;
+        if (!contact_detector)
+            LOG("Failed to allocate contact detector");
+    }
+    
     work_loop = IOWorkLoop::workLoop();
     if (!work_loop) {
         LOG("Failed to create work loop");
         return false;
     }
     
+    stop_lock = IOLockAlloc();
+    if (!stop_lock) {
+        LOG("Failed to allocate stop lock");
+        goto exit;
+    }
+    
     command_gate = IOCommandGate::commandGate(this);
     if (!command_gate) {
         LOG("Failed to create command gate");
@@ -46,6 +78,7 @@ bool IntelPreciseTouchStylusDriver::start(IOService *provider) {
     
     wait_input = OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::waitInputGated);
     handle_report = OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::handleHIDReportGated);
+    toggle_processing = OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::toggleProcessingGated);
     report_interrupt = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &IntelPreciseTouchStylusDriver::handleInterruptReport));
     if (!report_interrupt) {
         LOG("Failed to create report interrupt!");
@@ -58,6 +91,12 @@ bool IntelPreciseTouchStylusDriver::start(IOService *provider) {
         goto exit;
     }
     work_loop->addEventSource(status_interrupt);
+    feature_interrupt = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &IntelPreciseTouchStylusDriver::handleInterruptFeature));
+    if (!feature_interrupt) {
+        LOG("Failed to create feature interrupt!");
+        goto exit;
+    }
+    work_loop->addEventSource(feature_interrupt);
     
     timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &IntelPreciseTouchStylusDriver::pollTouchData));
     if (!timer) {
@@ -101,15 +140,21 @@ exit:
 }
 
 void IntelPreciseTouchStylusDriver::stop(IOService *provider) {
+    UInt64 start = getUptimeNS();
     stopDevice();
     // Wait at most 500ms for device to stop
-    for (int i = 0; i < 20; i++) {
-        if (state == IPTSDeviceStateStopped)
-            break;
-        IOSleep(25);
-    }
+    if (!waitForStop(500))
+        LOG("Timeout waiting for device to stop");
+    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::abortFeatureRequestsGated));
+    DBG_LOG("Device stopped in %llu us", (getUptimeNS() - start) / 1000);
     PMstop();
     releaseResources();
+    // no MEI message or event source can reach the buffers any more, but the ME still writes into them as long as
+    // it was never told to forget them, better lose the pages than let it scribble over memory handed out again
+    if (mem_window_set)
+        LOG("Memory window was not cleared, leaking %u bytes of DMA buffers", dma_slab ? static_cast<UInt32>(dma_slab->getLength()) : 0);
+    else
+        freeDMAResources();
     super::stop(provider);
 }
 
@@ -118,20 +163,19 @@ IOReturn IntelPreciseTouchStylusDriver::setPowerState(unsigned long whichState,
         return kIOReturnInvalid;
     if (whichState == 0) {
         if (awake) {
+            UInt64 start = getUptimeNS();
             awake = false;
             stopDevice();
             // Wait at most 500ms for device to stop
-            for (int i = 0; i < 20; i++) {
-                if (state == IPTSDeviceStateStopped)
-                    break;
-                IOSleep(25);
-            }
-            current_doorbell = 0;
-            DBG_LOG("Going to sleep");
+            if (!waitForStop(500))
+                LOG("Timeout waiting for device to stop");
+            command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::abortFeatureRequestsGated));
+            doorbell.resync(0);
+            DBG_LOG("Going to sleep, device stopped in %llu us", (getUptimeNS() - start) / 1000);
         }
     } else {
         if (!awake) {
-            command_gate->commandWakeup(&wait);
+            command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::notifyOfflineGated));
             IOReturn ret = kIOReturnSuccess;
             for (int i = 0; i < 3; i++) {
                 IOSleep(100);
@@ -162,6 +206,11 @@ void IntelPreciseTouchStylusDriver::releaseResources() {
         work_loop->removeEventSource(report_interrupt);
         OSSafeReleaseNULL(report_interrupt);
     }
+    if (feature_interrupt) {
+        feature_interrupt->disable();
+        work_loop->removeEventSource(feature_interrupt);
+        OSSafeReleaseNULL(feature_interrupt);
+    }
     if (command_gate) {
         command_gate->disable();
         work_loop->removeEventSource(command_gate);
@@ -169,6 +218,21 @@ void IntelPreciseTouchStylusDriver::releaseResources() {
     }
     OSSafeReleaseNULL(work_loop);
     
+    if (stop_lock) {
+        IOLockFree(stop_lock);
+        stop_lock = nullptr;
+    }
+    
+    if (contact_detector) {
+        delete contact_detector;
+        contact_detector = nullptr;
+    }
+    
+    if (trace_buffer) {
+        IOFree(trace_buffer, IPTS_TRACE_BUFFER_SIZE);
+        trace_buffer = nullptr;
+    }
+    
     if (touch_screen) {
         touch_screen->stop(this);
         touch_screen->detach(this);
@@ -176,12 +240,32 @@ void IntelPreciseTouchStylusDriver::releaseResources() {
     }
 }
 
-IOBufferMemoryDescriptor *IntelPreciseTouchStylusDriver::getReceiveBuffer() {
-    if (input_buffer) {
+IOReturn IntelPreciseTouchStylusDriver::getReceiveBufferGated(IOBufferMemoryDescriptor **buffer) {
+    *buffer = input_buffer;
+    if (input_buffer)
         input_buffer->retain();
-        return input_buffer;
-    } else
-        return nullptr;
+    return kIOReturnSuccess;
+}
+
+IOBufferMemoryDescriptor *IntelPreciseTouchStylusDriver::getReceiveBuffer() {
+    IOBufferMemoryDescriptor *buffer = nullptr;
+    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::getReceiveBufferGated), &buffer);
+    return buffer;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::getRxBufferGated(UInt32 *index, IOMemoryDescriptor **buffer) {
+    *buffer = nullptr;
+    if (*index >= IPTS_BUFFER_NUM || !rx_buffer[*index].vaddr)
+        return kIOReturnSuccess;
+    *buffer = rx_buffer[*index].buffer;
+    (*buffer)->retain();
+    return kIOReturnSuccess;
+}
+
+IOMemoryDescriptor *IntelPreciseTouchStylusDriver::getRxBuffer(UInt32 index) {
+    IOMemoryDescriptor *buffer = nullptr;
+    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::getRxBufferGated), &index, &buffer);
+    return buffer;
 }
 
 IOReturn IntelPreciseTouchStylusDriver::getDeviceInfo(IPTSDeviceInfo *info) {
@@ -190,56 +274,413 @@ IOReturn IntelPreciseTouchStylusDriver::getDeviceInfo(IPTSDeviceInfo *info) {
     info->max_contacts = touch_screen->max_contacts;
     
     if (touch_screen->version > 1) {    // newer devices
+        IOReturn ret = command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::copyMetadataGated), &info->meta_data);
+        if (ret != kIOReturnNotReady)
+            return ret;
+        // not prefetched yet, the response is cached on its way through handleData
         UInt8 buffer[IPTS_DEVICE_METADATA_REPORT_SIZE+1] = {0};
-        IOReturn ret = sendGetFeatureRequest(IPTS_DEVICE_METADATA_REPORT_ID, buffer, sizeof(buffer));
+        ret = sendGetFeatureRequest(IPTS_DEVICE_METADATA_REPORT_ID, buffer, sizeof(buffer));
         if (ret != kIOReturnSuccess) {
             LOG("Failed to get device metadata");
             return ret;
         }
-        IPTSHIDHeader *header = reinterpret_cast<IPTSHIDHeader *>(buffer+1);
-        if (header->type != IPTS_HID_FRAME_TYPE_HID) {
-            LOG("Unexpected response type for metadata report");
-            return kIOReturnInvalid;
-        }
-        IPTSHIDHeader *frame = reinterpret_cast<IPTSHIDHeader *>(header->data);
-        if (frame->type != IPTS_HID_FRAME_TYPE_METADATA) {
-            LOG("Unexpected frame type for metadata report");
-            return kIOReturnInvalid;
-        }
-        UInt16 size = sizeof(info->meta_data);
-        if (frame->size - sizeof(frame) < size) {
-            DBG_LOG("Warning, metadata size mismatch, need %hu received %lu", size, frame->size - sizeof(frame));
-            size = frame->size - sizeof(frame);
-        }
-        memcpy(&info->meta_data, frame->data, size);
-        return kIOReturnSuccess;
+        ret = command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::copyMetadataGated), &info->meta_data);
+        return ret == kIOReturnNotReady ? kIOReturnInvalid : ret;
     }
     info->meta_data.size.rows = -1; // to indicate that this device does not support metadata feature
     return kIOReturnSuccess;
 }
 
-IOReturn IntelPreciseTouchStylusDriver::waitInputGated(UInt64 *size) {
-    IOReturn ret = command_gate->commandSleep(&wait);
+IPTSInputClient *IntelPreciseTouchStylusDriver::findInputClient(OSObject *target) {
+    for (UInt32 i = 0; i < IPTS_INPUT_CLIENT_NUM; i++) {
+        if (input_clients[i].target == target)
+            return &input_clients[i];
+    }
+    return nullptr;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::attachClientGated(OSObject *target, bool *primary) {
+    if (*primary && frame_queue.hasPrimary())
+        return kIOReturnExclusiveAccess;
+    IPTSInputClient *client = findInputClient(nullptr);
+    if (!client || !frame_queue.attach(*primary, &client->cursor))
+        return kIOReturnNoResources;
+    
+    client->target = target;
+    client->handler = nullptr;
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::attachClient(OSObject *target, bool primary) {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::attachClientGated), target, &primary);
+}
+
+IOReturn IntelPreciseTouchStylusDriver::detachClientGated(OSObject *target) {
+    IPTSInputClient *client = findInputClient(target);
+    if (!client)
+        return kIOReturnSuccess;
     
-    if (ret != THREAD_AWAKENED)
-        return kIOReturnError;
+    if (frame_queue.isPrimary(client->cursor))
+        daemon_processing = false;
+    // whatever the daemon still held goes back to the ME
+    refillBuffers(frame_queue.detach(client->cursor));
+    memset(client, 0, sizeof(IPTSInputClient));
+    // a thread of the client may still be waiting for input
+    command_gate->commandWakeup(&wait);
+    return kIOReturnSuccess;
+}
+
+void IntelPreciseTouchStylusDriver::detachClient(OSObject *target) {
+    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::detachClientGated), target);
+}
+
+bool IntelPreciseTouchStylusDriver::peekFrame(IPTSInputClient *client, UInt64 *frame) {
+    if (!awake || !frame_queue.getRing()) {
+        frame[0] = 0;
+        frame[1] = -1;
+        frame[2] = 0;
+        frame[3] = IPTS_FRAME_IN_SLOT;
+        return false;
+    }
+    frame_queue.peek(client->cursor, frame);
+    return true;
+}
+
+void IntelPreciseTouchStylusDriver::consumeFrame(IPTSInputClient *client, UInt64 *frame) {
+    if (frame_queue.isPrimary(client->cursor)) {
+        delivered_time = frame_queue.getFrameTime(static_cast<UInt32>(frame[0]));
+        delivered_sequence = static_cast<UInt32>(frame[2]);
+        if (!(delivered_sequence & IPTS_FRAME_SEQUENCE_REPLAY)) {
+            wakeup_time = getUptimeNS();
+            recordLatency(IPTSLatencyStageHandoff, wakeup_time - delivered_time);
+            delivered_frames++;
+        }
+    }
+    frame_queue.consume(client->cursor);
+}
+
+void IntelPreciseTouchStylusDriver::deliverFrame(IPTSInputClient *client, UInt64 *frame) {
+    if (peekFrame(client, frame))
+        consumeFrame(client, frame);
+}
+
+bool IntelPreciseTouchStylusDriver::notifyFrame(IPTSInputClient *client) {
+    UInt64 frame[4];
+    bool queued = peekFrame(client, frame);
+    if (client->handler(client->target, frame) != kIOReturnSuccess) {
+        // the frame stays queued, it goes out with the next notification or kMethodReceiveInput
+        notification_failures++;
+        return false;
+    }
+    if (queued)
+        consumeFrame(client, frame);
+    return queued;
+}
+
+void IntelPreciseTouchStylusDriver::notifyFrames(IPTSInputClient *client) {
+    // also catches up on frames whose notification failed before
+    while (frame_queue.canNotify(client->cursor)) {
+        if (!notifyFrame(client))
+            break;
+    }
+}
+
+void IntelPreciseTouchStylusDriver::requestMetadata() {
+    // nobody waits for it, the report is cached on its way through handleData
+    IPTSFeatureRequest request;
+    memset(&request, 0, sizeof(IPTSFeatureRequest));
+    request.type = IPTSFeedbackDataTypeGetFeatures;
+    request.report_id = IPTS_DEVICE_METADATA_REPORT_ID;
+    request.size = IPTS_DEVICE_METADATA_REPORT_SIZE+1;
     
-    if (!awake)
-        *size = -1;
-    else {
-        *size = input_size;
-        daemon_handled = true;
+    if (submitFeatureRequestGated(&request) != kIOReturnSuccess)
+        LOG("Failed to request device metadata");
+}
+
+void IntelPreciseTouchStylusDriver::cacheMetadata(const UInt8 *report, UInt32 size) {
+    // [report id][root header][metadata frame]
+    IPTSHIDFrameWalker walker(report+1, size-1);
+    IPTSHIDSubFrame frame;
+    while (walker.next(&frame)) {
+        if (frame.type == IPTS_HID_FRAME_TYPE_METADATA) {
+            storeMetadata(frame.data, frame.size);
+            return;
+        }
+    }
+    LOG("Unexpected frame layout for metadata report");
+}
+
+void IntelPreciseTouchStylusDriver::storeMetadata(const UInt8 *data, UInt32 len) {
+    IPTSDeviceMetaData parsed;
+    memset(&parsed, 0, sizeof(IPTSDeviceMetaData));
+    if (len < sizeof(IPTSDeviceMetaData))
+        DBG_LOG("Warning, metadata size mismatch, need %lu received %u", sizeof(IPTSDeviceMetaData), len);
+    memcpy(&parsed, data, len < sizeof(IPTSDeviceMetaData) ? len : sizeof(IPTSDeviceMetaData));
+    if (!parsed.size.rows || !parsed.size.columns || !parsed.size.width || !parsed.size.height) {
+        LOG("Invalid device metadata, heatmap %ux%u", parsed.size.rows, parsed.size.columns);
+        return;
     }
+    // some devices repeat the metadata inside their touch frames
+    if (metadata_valid && !memcmp(&metadata, &parsed, sizeof(IPTSDeviceMetaData)))
+        return;
+    
+    memcpy(&metadata, &parsed, sizeof(IPTSDeviceMetaData));
+    metadata_valid = true;
+    // lets a restarted daemon pick the metadata up without asking the device again
+    setProperty("DeviceMetadata", &metadata, sizeof(IPTSDeviceMetaData));
+    DBG_LOG("Device metadata cached, heatmap %ux%u", metadata.size.rows, metadata.size.columns);
+    
+    if (contact_detector)
+        configureDetector();
+}
+
+IOReturn IntelPreciseTouchStylusDriver::copyMetadataGated(IPTSDeviceMetaData *meta) {
+    if (!metadata_valid)
+        return kIOReturnNotReady;
+    memcpy(meta, &metadata, sizeof(IPTSDeviceMetaData));
     return kIOReturnSuccess;
 }
 
-IOReturn IntelPreciseTouchStylusDriver::waitInput(UInt64 *size) {
-    if (!daemon_handled) {
-        *size = input_size;
-        daemon_handled = true;
+IOReturn IntelPreciseTouchStylusDriver::invalidateMetadataGated() {
+    if (!metadata_valid)
         return kIOReturnSuccess;
-    } else
-        return command_gate->runAction(wait_input, size);
+    metadata_valid = false;
+    removeProperty("DeviceMetadata");
+    DBG_LOG("Device metadata invalidated");
+    return kIOReturnSuccess;
+}
+
+void IntelPreciseTouchStylusDriver::configureDetector() {
+    UInt32 transform[6];
+    memcpy(transform, &metadata.transform, sizeof(transform));
+    if (!contact_detector->configure(metadata.size.rows, metadata.size.columns, transform))
+        LOG("Unsupported heatmap size %ux%u", metadata.size.rows, metadata.size.columns);
+    else
+        DBG_LOG("Contact detection configured for %ux%u heatmaps", metadata.size.rows, metadata.size.columns);
+}
+
+bool IntelPreciseTouchStylusDriver::splitFrame(const UInt8 *frame, UInt32 size, IPTSFrameClass *frame_class) {
+    bool stylus = decode_stylus || (!daemonActive() && contact_detector);
+    bool detect = !daemonActive() && contact_detector && contact_detector->isConfigured();
+    bool daemon = false;
+    // only a frame left with nothing but pen reports for the daemon counts as stylus
+    *frame_class = IPTSFrameClassStylus;
+    if (size < 3) {
+        *frame_class = IPTSFrameClassTouch;
+        return true;
+    }
+    
+    // [report id][timestamp][root header][frame header][frame data]...
+    UInt16 scan_time;
+    memcpy(&scan_time, frame+1, sizeof(UInt16));
+    IPTSHIDFrameWalker walker(frame+3, size-3);
+    IPTSHIDSubFrame sub;
+    while (walker.next(&sub)) {
+        switch (sub.type) {
+            case IPTS_HID_FRAME_TYPE_REPORTS: {
+                // the driver only takes the pen reports it can decode, anything else in the frame is for the daemon
+                UInt32 reports = IPTSStylusDecoder::scan(sub.data, sub.size);
+                if (stylus && (reports & IPTS_REPORTS_STYLUS))
+                    decodeStylus(sub.data, sub.size, scan_time);
+                if (!stylus || (reports & ~IPTS_REPORTS_STYLUS))
+                    daemon = true;
+                if (reports & IPTS_REPORTS_HEATMAP)
+                    *frame_class = IPTSFrameClassTouch;
+                break;
+            }
+            case IPTS_HID_FRAME_TYPE_HEATMAP:
+                if (!detect || !detectContacts(sub.data, sub.size)) {
+                    daemon = true;
+                    *frame_class = IPTSFrameClassTouch;
+                }
+                break;
+            case IPTS_HID_FRAME_TYPE_METADATA:
+                storeMetadata(sub.data, sub.size);
+                break;
+            default:
+                daemon = true;
+                *frame_class = IPTSFrameClassTouch;
+                break;
+        }
+    }
+    if (walker.isMalformed()) {
+        // leave it to the daemon, it may know better
+        malformed_frames++;
+        daemon = true;
+        *frame_class = IPTSFrameClassTouch;
+    }
+    return daemon;
+}
+
+bool IntelPreciseTouchStylusDriver::classifyFrame(const UInt8 *frame, UInt32 size, IPTSFrameClass *frame_class) {
+    // the same split as splitFrame, without decoding anything
+    bool stylus = decode_stylus || (!daemonActive() && contact_detector);
+    bool detect = !daemonActive() && contact_detector && contact_detector->isConfigured();
+    bool daemon = false;
+    *frame_class = IPTSFrameClassStylus;
+    if (size < 3) {
+        *frame_class = IPTSFrameClassTouch;
+        return true;
+    }
+    
+    IPTSHIDFrameWalker walker(frame+3, size-3);
+    IPTSHIDSubFrame sub;
+    while (walker.next(&sub)) {
+        switch (sub.type) {
+            case IPTS_HID_FRAME_TYPE_REPORTS: {
+                UInt32 reports = IPTSStylusDecoder::scan(sub.data, sub.size);
+                if (!stylus || (reports & ~IPTS_REPORTS_STYLUS))
+                    daemon = true;
+                if (reports & IPTS_REPORTS_HEATMAP)
+                    *frame_class = IPTSFrameClassTouch;
+                break;
+            }
+            case IPTS_HID_FRAME_TYPE_HEATMAP:
+                if (!detect || !contact_detector->findHeatmap(sub.data, sub.size)) {
+                    daemon = true;
+                    *frame_class = IPTSFrameClassTouch;
+                }
+                break;
+            case IPTS_HID_FRAME_TYPE_METADATA:
+                break;
+            default:
+                daemon = true;
+                *frame_class = IPTSFrameClassTouch;
+                break;
+        }
+    }
+    if (walker.isMalformed()) {
+        daemon = true;
+        *frame_class = IPTSFrameClassTouch;
+    }
+    return daemon;
+}
+
+bool IntelPreciseTouchStylusDriver::detectContacts(const UInt8 *data, UInt32 len) {
+    const UInt8 *heatmap = contact_detector->findHeatmap(data, len);
+    if (!heatmap)
+        return false;
+    
+    IPTSContact contacts[IPTS_CONTACT_MAX_NUM];
+    UInt32 num = contact_detector->process(heatmap, contacts, IPTS_CONTACT_MAX_NUM);
+    
+    IPTSHIDReport report;
+    memset(&report, 0, sizeof(IPTSHIDReport));
+    report.report_id = IPTS_TOUCH_REPORT_ID;
+    IPTSTouchHIDReport *touch = &report.report.touch;
+    UInt32 ids = 0;
+    UInt8 fingers = 0;
+    for (UInt32 i = 0; i < num && fingers < IPTS_TOUCH_SCREEN_FINGER_CNT; i++) {
+        if (contacts[i].palm)
+            continue;
+        touch->fingers[fingers].touch = 1;
+        touch->fingers[fingers].contact_id = contacts[i].id;
+        touch->fingers[fingers].x = contacts[i].x;
+        touch->fingers[fingers].y = contacts[i].y;
+        ids |= 1 << contacts[i].id;
+        fingers++;
+    }
+    // tell the HID stack about lifted fingers once, those that do not fit in this report go out with the next
+    UInt32 lifted = (detected_ids | lifted_ids) & ~ids;
+    while (lifted && fingers < IPTS_TOUCH_SCREEN_FINGER_CNT) {
+        touch->fingers[fingers].contact_id = __builtin_ctz(lifted);
+        lifted &= lifted - 1;
+        fingers++;
+    }
+    detected_ids = ids;
+    lifted_ids = lifted;
+    
+    if (fingers) {
+        touch->contact_num = fingers;
+        enqueueReport(&report, getHIDReportSize(IPTS_TOUCH_REPORT_ID), poll_time, current_sequence);
+        report_interrupt->interruptOccurred(nullptr, this, 0);
+    }
+    return true;
+}
+
+void IntelPreciseTouchStylusDriver::decodeStylus(const UInt8 *reports, UInt32 len, UInt16 scan_time) {
+    IPTSStylusSample samples[IPTS_REPORT_QUEUE_SIZE / 2];
+    UInt32 num = IPTSStylusDecoder::decode(reports, len, scan_time, samples, IPTS_REPORT_QUEUE_SIZE / 2);
+    if (!num)
+        return;
+    
+    IPTSHIDReport report;
+    memset(&report, 0, sizeof(IPTSHIDReport));
+    report.report_id = IPTS_STYLUS_REPORT_ID;
+    IPTSStylusHIDReport *stylus = &report.report.stylus;
+    for (UInt32 i = 0; i < num; i++) {
+        bool rubber = samples[i].mode & IPTS_STYLUS_MODE_RUBBER;
+        bool touch = samples[i].mode & IPTS_STYLUS_MODE_TOUCH;
+        stylus->in_range = (samples[i].mode & IPTS_STYLUS_MODE_PROXIMITY) != 0;
+        stylus->touch = touch && !rubber;
+        stylus->side_button = (samples[i].mode & IPTS_STYLUS_MODE_BUTTON) != 0;
+        stylus->inverted = rubber;
+        stylus->eraser = touch && rubber;
+        stylus->x = samples[i].x;
+        stylus->y = samples[i].y;
+        stylus->tip_pressure = samples[i].pressure;
+        stylus->x_tilt = samples[i].x_tilt;
+        stylus->y_tilt = samples[i].y_tilt;
+        stylus->scan_time = samples[i].scan_time;
+        enqueueReport(&report, getHIDReportSize(IPTS_STYLUS_REPORT_ID), poll_time, current_sequence);
+    }
+    report_interrupt->interruptOccurred(nullptr, this, 0);
+}
+
+IOReturn IntelPreciseTouchStylusDriver::waitInputGated(OSObject *target, UInt64 *output) {
+    IPTSInputClient *client = findInputClient(target);
+    if (!client)
+        return kIOReturnNotOpen;
+    if (frame_queue.isPrimary(client->cursor))
+        noteDaemonProgress();
+    while (awake && frame_queue.getRing() && !frame_queue.hasFrame(client->cursor)) {
+        if (command_gate->commandSleep(&wait) != THREAD_AWAKENED)
+            return kIOReturnError;
+        if (client->target != target)
+            return kIOReturnNotOpen;
+    }
+    deliverFrame(client, output);
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::waitInput(OSObject *target, UInt64 *output) {
+    return command_gate->runAction(wait_input, target, output);
+}
+
+IOReturn IntelPreciseTouchStylusDriver::registerInputHandlerGated(OSObject *target, InputHandler handler) {
+    IPTSInputClient *client = findInputClient(target);
+    if (!client)
+        return kIOReturnNotOpen;
+    client->handler = handler;
+    
+    // hand over what was queued before the handler showed up
+    notifyFrames(client);
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::registerInputHandler(OSObject *target, InputHandler handler) {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::registerInputHandlerGated), target, reinterpret_cast<void *>(handler));
+}
+
+IOReturn IntelPreciseTouchStylusDriver::unregisterInputHandlerGated(OSObject *target) {
+    IPTSInputClient *client = findInputClient(target);
+    if (client)
+        client->handler = nullptr;
+    return kIOReturnSuccess;
+}
+
+void IntelPreciseTouchStylusDriver::unregisterInputHandler(OSObject *target) {
+    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::unregisterInputHandlerGated), target);
+}
+
+IOReturn IntelPreciseTouchStylusDriver::notifyOfflineGated() {
+    command_gate->commandWakeup(&wait);
+    for (UInt32 i = 0; i < IPTS_INPUT_CLIENT_NUM; i++) {
+        IPTSInputClient *client = &input_clients[i];
+        if (client->target && client->handler)
+            notifyFrame(client);
+    }
+    return kIOReturnSuccess;
 }
 
 void IntelPreciseTouchStylusDriver::enterMultitouch() {
@@ -254,134 +695,749 @@ void IntelPreciseTouchStylusDriver::exitMultitouch() {
     status_interrupt->interruptOccurred(nullptr, this, 0);
 }
 
+void IntelPreciseTouchStylusDriver::releaseFrames() {
+    // every frame handed to the daemon so far has been consumed, give back the receive buffers they pinned
+    refillBuffers(frame_queue.release());
+}
+
+IOReturn IntelPreciseTouchStylusDriver::toggleProcessingGated(bool *processing) {
+    daemon_processing = *processing;
+    if (!daemon_processing && frame_queue.getRing()) {
+        releaseFrames();
+        noteDaemonProgress();
+        // a daemon taking notifications gets the next frame now that it is done with the last one
+        for (UInt32 i = 0; i < IPTS_INPUT_CLIENT_NUM; i++) {
+            IPTSInputClient *client = &input_clients[i];
+            if (client->target && client->handler && frame_queue.isPrimary(client->cursor))
+                notifyFrames(client);
+        }
+    }
+    return kIOReturnSuccess;
+}
+
 void IntelPreciseTouchStylusDriver::processingStarted() {
-    daemon_processing = true;
+    bool processing = true;
+    command_gate->runAction(toggle_processing, &processing);
 }
 
 void IntelPreciseTouchStylusDriver::processingEnded() {
-    daemon_processing = false;
+    bool processing = false;
+    command_gate->runAction(toggle_processing, &processing);
 }
 
-void IntelPreciseTouchStylusDriver::handleInterruptReport(IOInterruptEventSource *sender, int count) {
-    if (sent)
+IOReturn IntelPreciseTouchStylusDriver::setOptionGated(UInt32 *option, UInt64 *value) {
+    switch (*option) {
+        case IPTSOptionZeroCopyInput:
+            zero_copy = *value != 0;
+            DBG_LOG("Zero copy input %s", zero_copy ? "enabled" : "disabled");
+            break;
+        case IPTSOptionRecordTrace:
+            if (*value && !trace_buffer) {
+                trace_buffer = reinterpret_cast<UInt8 *>(IOMalloc(IPTS_TRACE_BUFFER_SIZE));
+                if (!trace_buffer)
+                    return kIOReturnNoMemory;
+                trace_head = trace_tail = 0;
+                trace_drops = 0;
+            } else if (!*value && trace_buffer) {
+                if (trace_drops)
+                    LOG("%llu records did not fit into the trace", trace_drops);
+                IOFree(trace_buffer, IPTS_TRACE_BUFFER_SIZE);
+                trace_buffer = nullptr;
+            }
+            DBG_LOG("Trace recording %s", trace_buffer ? "enabled" : "disabled");
+            break;
+        case IPTSOptionDecodeStylus:
+            decode_stylus = *value != 0;
+            DBG_LOG("In-driver stylus decoding %s", decode_stylus ? "enabled" : "disabled");
+            break;
+        case IPTSOptionTouchDelivery:
+        case IPTSOptionStylusDelivery: {
+            if (*value != IPTSDeliveryFIFO && *value != IPTSDeliveryLatest)
+                return kIOReturnBadArgument;
+            IPTSFrameClass frame_class = *option == IPTSOptionTouchDelivery ? IPTSFrameClassTouch : IPTSFrameClassStylus;
+            frame_queue.setPolicy(frame_class, static_cast<IPTSDeliveryPolicy>(*value));
+            DBG_LOG("%s frames delivered %s", frame_class == IPTSFrameClassTouch ? "Touch" : "Stylus", *value == IPTSDeliveryLatest ? "latest wins" : "in order");
+            break;
+        }
+        default:
+            return kIOReturnBadArgument;
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::setOption(UInt32 option, UInt64 value) {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::setOptionGated), &option, &value);
+}
+
+void IntelPreciseTouchStylusDriver::enqueueReport(const IPTSHIDReport *report, UInt32 size, UInt64 frame, UInt32 sequence) {
+    // Producers and the consumer all run on the work loop, so the queue needs no further locking
+    if (report_head - report_tail == IPTS_REPORT_QUEUE_SIZE) {
+        // make room by dropping the oldest touch report, stylus transitions are kept as long as possible
+        UInt32 victim = report_tail;
+        for (UInt32 i = report_tail; i != report_head; i++) {
+            if (report_queue[i % IPTS_REPORT_QUEUE_SIZE].report.report_id == IPTS_TOUCH_REPORT_ID) {
+                victim = i;
+                break;
+            }
+        }
+        if (report_queue[victim % IPTS_REPORT_QUEUE_SIZE].report.report_id == IPTS_TOUCH_REPORT_ID)
+            touch_overflows++;
+        else
+            stylus_overflows++;
+        for (UInt32 i = victim; i != report_tail; i--)
+            report_queue[i % IPTS_REPORT_QUEUE_SIZE] = report_queue[(i - 1) % IPTS_REPORT_QUEUE_SIZE];
+        report_tail++;
+    }
+    
+    IPTSQueuedReport *entry = &report_queue[report_head % IPTS_REPORT_QUEUE_SIZE];
+    entry->frame_time = frame;
+    entry->sequence = sequence;
+    entry->queue_time = getUptimeNS();
+    entry->size = size;
+    memcpy(&entry->report, report, size);
+    report_head++;
+}
+
+void IntelPreciseTouchStylusDriver::flushReports() {
+    while (report_tail != report_head) {
+        IPTSQueuedReport *entry = &report_queue[report_tail % IPTS_REPORT_QUEUE_SIZE];
+        report_to_send->setLength(entry->size);
+        report_to_send->writeBytes(0, &entry->report, entry->size);
+        report_tail++;
+        touch_screen->handleReport(report_to_send);
+        if (entry->sequence & IPTS_FRAME_SEQUENCE_REPLAY)
+            continue;
+        dispatched_sequence = entry->sequence;
+        
+        UInt64 now = getUptimeNS();
+        recordLatency(IPTSLatencyStageDispatch, now - entry->queue_time);
+        if (!entry->frame_time)
+            continue;
+        UInt64 total = now - entry->frame_time;
+        recordLatency(IPTSLatencyStageTotal, total);
+        if (wake_time && entry->sequence - wake_sequence < IPTS_FRAME_SEQUENCE_REPLAY) {
+            // the first report from the touch that woke the sensor (or a newer one if it was coalesced), only
+            // what it waited on top of a touch on the awake sensor is down to dozing
+            UInt64 woken = now - wake_time;
+            recordLatency(IPTSLatencyStageWake, woken > awake_latency ? woken - awake_latency : 0);
+            wake_time = 0;
+        } else if (!dozing && !wake_time) {
+            awake_latency = awake_latency ? (awake_latency * 15 + total) / 16 : total;
+        }
+    }
+}
+
+IOReturn IntelPreciseTouchStylusDriver::getLatencyStatisticsGated(IPTSLatencyStatistics *stats) {
+    memcpy(stats, &latency, sizeof(IPTSLatencyStatistics));
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::getLatencyStatistics(IPTSLatencyStatistics *stats) {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::getLatencyStatisticsGated), stats);
+}
+
+IOReturn IntelPreciseTouchStylusDriver::getStatisticsGated(IPTSPipelineStatistics *stats) {
+    memset(stats, 0, sizeof(IPTSPipelineStatistics));
+    stats->doorbell_sequence = doorbell.getSequence();
+    stats->delivered_sequence = delivered_sequence;
+    stats->reported_sequence = reported_sequence;
+    stats->dispatched_sequence = dispatched_sequence;
+    stats->frames = doorbell.getFrames();
+    stats->delivered_frames = delivered_frames;
+    stats->reported_frames = reported_frames;
+    stats->doorbell_drops = doorbell.getDrops();
+    stats->coalesced_frames = coalesced_frames;
+    stats->ring_drops = frame_queue.getRingDrops();
+    stats->malformed_frames = malformed_frames;
+    stats->rejected_reports = rejected_reports;
+    stats->touch_overflows = touch_overflows;
+    stats->stylus_overflows = stylus_overflows;
+    stats->trace_drops = trace_drops;
+    for (UInt32 c = 0; c < IPTSFrameClassNum; c++) {
+        stats->superseded_frames[c] = frame_queue.getSuperseded(static_cast<IPTSFrameClass>(c));
+        stats->dropped_frames[c] = frame_queue.getDropped(static_cast<IPTSFrameClass>(c));
+    }
+    stats->daemon_stalls = daemon_stalls;
+    stats->observer_overruns = frame_queue.getObserverOverruns();
+    stats->replayed_frames = replayed_frames;
+    stats->notification_failures = notification_failures;
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::getStatistics(IPTSPipelineStatistics *stats) {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::getStatisticsGated), stats);
+}
+
+void IntelPreciseTouchStylusDriver::writeTrace(const void *data, UInt32 len) {
+    UInt32 offset = trace_head % IPTS_TRACE_BUFFER_SIZE;
+    UInt32 first = IPTS_TRACE_BUFFER_SIZE - offset;
+    if (first > len)
+        first = len;
+    memcpy(trace_buffer + offset, data, first);
+    memcpy(trace_buffer, reinterpret_cast<const UInt8 *>(data) + first, len - first);
+    trace_head += len;
+}
+
+void IntelPreciseTouchStylusDriver::peekTrace(void *data, UInt32 len) {
+    UInt32 offset = trace_tail % IPTS_TRACE_BUFFER_SIZE;
+    UInt32 first = IPTS_TRACE_BUFFER_SIZE - offset;
+    if (first > len)
+        first = len;
+    memcpy(data, trace_buffer + offset, first);
+    memcpy(reinterpret_cast<UInt8 *>(data) + first, trace_buffer, len - first);
+}
+
+void IntelPreciseTouchStylusDriver::recordTrace(IPTSDataHeader *header, UInt32 buffer) {
+    static const UInt8 padding[8] = {0};
+    UInt32 total = IPTS_TRACE_RECORD_SIZE(header->size);
+    if (total > IPTS_TRACE_BUFFER_SIZE - (trace_head - trace_tail)) {
+        // keep what is already recorded, the reader has to catch up
+        trace_drops++;
         return;
+    }
+    
+    IPTSTraceRecord record;
+    memset(&record, 0, sizeof(IPTSTraceRecord));
+    record.timestamp = poll_time;
+    record.doorbell = doorbell.getCurrent();
+    record.size = header->size;
+    record.type = header->type;
+    record.buffer = buffer;
+    writeTrace(&record, sizeof(IPTSTraceRecord));
+    writeTrace(header->data, header->size);
+    writeTrace(padding, total - sizeof(IPTSTraceRecord) - header->size);
+}
+
+IOReturn IntelPreciseTouchStylusDriver::readTraceGated(IOMemoryDescriptor *output, UInt64 *written) {
+    if (!trace_buffer)
+        return kIOReturnNotReady;
+    
+    UInt64 capacity = output->getLength();
+    *written = 0;
+    while (trace_tail != trace_head) {
+        UInt32 offset = trace_tail % IPTS_TRACE_BUFFER_SIZE;
+        // the buffer is no multiple of the record size, so the record itself may wrap as well
+        IPTSTraceRecord record;
+        peekTrace(&record, sizeof(IPTSTraceRecord));
+        UInt32 total = IPTS_TRACE_RECORD_SIZE(record.size);
+        if (*written + total > capacity)
+            break;
+        UInt32 first = IPTS_TRACE_BUFFER_SIZE - offset;
+        if (first > total)
+            first = total;
+        output->writeBytes(*written, trace_buffer + offset, first);
+        if (first < total)
+            output->writeBytes(*written + first, trace_buffer, total - first);
+        *written += total;
+        trace_tail += total;
+    }
+    
+    if (*written == 0 && trace_tail != trace_head)
+        return kIOReturnNoSpace;
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::readTrace(IOMemoryDescriptor *output, UInt64 *written) {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::readTraceGated), output, written);
+}
+
+IOReturn IntelPreciseTouchStylusDriver::replayDataGated(IPTSDataHeader *header) {
+    if (state != IPTSDeviceStateStarted || !frame_queue.getRing())
+        return kIOReturnNotReady;
+    
+    // keep the replay apart from the live counters, its frames are told apart by their sequence
+    poll_time = getUptimeNS();
+    replay_sequence++;
+    current_sequence = IPTS_FRAME_SEQUENCE_REPLAY | (replay_sequence & ~IPTS_FRAME_SEQUENCE_REPLAY);
+    replayed_frames++;
+    handleData(header, IPTS_FRAME_IN_SLOT, true);
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::replayTrace(IOMemoryDescriptor *input, bool realtime, UInt64 *replayed) {
+    IOCommandGate::Action replay_data = OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::replayDataGated);
+    IOReturn ret = kIOReturnSuccess;
+    UInt64 length = input->getLength();
+    UInt64 offset = 0;
+    UInt64 last_record = 0;
+    UInt64 elapsed = 0;
+    AbsoluteTime start, deadline;
+    IPTSTraceRecord record;
+    
+    // a replayed frame can never be larger than what the ME is able to deliver
+    UInt32 max_size = rx_buffer[0].len;
+    if (max_size <= sizeof(IPTSDataHeader))
+        return kIOReturnNotReady;
+    IPTSDataHeader *header = reinterpret_cast<IPTSDataHeader *>(IOMalloc(max_size));
+    if (!header)
+        return kIOReturnNoMemory;
     
-    touch_screen->handleReport(report_to_send);
-    sent = true;
+    *replayed = 0;
+    clock_get_uptime(&start);
+    while (offset + sizeof(IPTSTraceRecord) <= length) {
+        input->readBytes(offset, &record, sizeof(IPTSTraceRecord));
+        // the driver never records empty data, handleData expects at least a report id
+        if (record.size == 0 || record.size > max_size - sizeof(IPTSDataHeader) ||
+            offset + sizeof(IPTSTraceRecord) + record.size > length) {
+            ret = kIOReturnBadArgument;
+            break;
+        }
+        memset(header, 0, sizeof(IPTSDataHeader));
+        header->type = static_cast<IPTSDataType>(record.type);
+        header->size = record.size;
+        header->buffer = record.buffer;
+        input->readBytes(offset + sizeof(IPTSTraceRecord), header->data, record.size);
+        offset += IPTS_TRACE_RECORD_SIZE(record.size);
+        
+        // feature responses belong to requests of the recording session
+        if (record.type != IPTSDataTypeFrame && record.type != IPTSDataTypeHID)
+            continue;
+        
+        if (realtime) {
+            if (*replayed > 0 && record.timestamp < last_record) {
+                // not a recorded trace, there is no timing to keep
+                ret = kIOReturnBadArgument;
+                break;
+            }
+            // a pause in the recording must not keep the caller blocked for as long
+            UInt64 gap = *replayed > 0 ? record.timestamp - last_record : 0;
+            elapsed += gap < IPTS_REPLAY_MAX_GAP * 1000000ULL ? gap : IPTS_REPLAY_MAX_GAP * 1000000ULL;
+            last_record = record.timestamp;
+            nanoseconds_to_absolutetime(elapsed, &deadline);
+            clock_delay_until(start + deadline);
+        }
+        ret = command_gate->runAction(replay_data, header);
+        if (ret != kIOReturnSuccess)
+            break;
+        (*replayed)++;
+    }
+    
+    IOFree(header, max_size);
+    return ret;
+}
+
+void IntelPreciseTouchStylusDriver::handleInterruptReport(IOInterruptEventSource *sender, int count) {
+    flushReports();
 }
 
 void IntelPreciseTouchStylusDriver::handleInterruptStatus(IOInterruptEventSource *sender, int count) {
-    sendSetFeatureReport(IPTS_DEVICE_MODE_REPORT_ID, multitouch);
+    // the in-driver contact detection needs heatmaps even when no daemon is around
+    sendSetFeatureReport(IPTS_DEVICE_MODE_REPORT_ID, daemonActive() || contact_detector);
+    if (!metadata_valid && touch_screen->version > 1)
+        requestMetadata();          // queued behind the mode report
 }
 
-IOReturn IntelPreciseTouchStylusDriver::handleHIDReportGated(IPTSHIDReport *report) {
-    UInt32 report_size = 0;
-    switch (report->report_id) {
+UInt32 IntelPreciseTouchStylusDriver::getHIDReportSize(UInt8 report_id) {
+    switch (report_id) {
         case IPTS_TOUCH_REPORT_ID:
-            report_size = sizeof(IPTSTouchHIDReport)+1;
-            break;
+            return sizeof(IPTSTouchHIDReport)+1;
         case IPTS_STYLUS_REPORT_ID:
-            report_size = sizeof(IPTSStylusHIDReport)+1;
-            break;
+            return sizeof(IPTSStylusHIDReport)+1;
         default:
-            DBG_LOG("Unknown report received! report id: 0x%x", report->report_id);
-            return kIOReturnInvalid;
+            DBG_LOG("Unknown report received! report id: 0x%x", report_id);
+            return 0;
+    }
+}
+
+IOReturn IntelPreciseTouchStylusDriver::handleHIDReportGated(IPTSHIDReport *report) {
+    UInt32 report_size = getHIDReportSize(report->report_id);
+    if (!report_size)
+        return kIOReturnInvalid;
+    
+    if (wakeup_time) {
+        recordLatency(IPTSLatencyStageDaemon, getUptimeNS() - wakeup_time);
+        wakeup_time = 0;
     }
-    report_to_send->setLength(report_size);
-    report_to_send->writeBytes(0, report, report_size);
-    sent = false;
+    noteReported(delivered_sequence);
+    enqueueReport(report, report_size, delivered_time, delivered_sequence);
     report_interrupt->interruptOccurred(nullptr, this, 0);
     return kIOReturnSuccess;
 }
 
+void IntelPreciseTouchStylusDriver::noteReported(UInt32 sequence) {
+    noteDaemonProgress();
+    if (sequence == reported_sequence || (sequence & IPTS_FRAME_SEQUENCE_REPLAY))
+        return;
+    reported_sequence = sequence;
+    reported_frames++;
+}
+
 void IntelPreciseTouchStylusDriver::handleHIDReport(const IPTSHIDReport *report) {
     command_gate->runAction(handle_report, const_cast<IPTSHIDReport *>(report));
 }
 
-void IntelPreciseTouchStylusDriver::pollTouchData(IOTimerEventSource *sender) {
-    UInt32 doorbell;
-    memcpy(&doorbell, doorbell_buffer.vaddr, sizeof(UInt32));
+IOReturn IntelPreciseTouchStylusDriver::handleHIDReportsGated(IPTSHIDReport *reports, UInt32 *count, UInt32 *sequence, UInt64 *accepted) {
+    if (wakeup_time) {
+        recordLatency(IPTSLatencyStageDaemon, getUptimeNS() - wakeup_time);
+        wakeup_time = 0;
+    }
+    // older daemons do not pass the sequence, their reports belong to the frame handed out last
+    UInt32 frame = *sequence ? *sequence : delivered_sequence;
+    noteReported(frame);
     
-    if (doorbell == current_doorbell) {
-        if (!busy) {
-            timer->setTimeoutMS(IPTS_IDLE_TIMEOUT);
-            return;
-        }
-        AbsoluteTime cur_time;
-        UInt64 nsecs;
-        clock_get_uptime(&cur_time);
-        SUB_ABSOLUTETIME(&cur_time, &last_activate);
-        absolutetime_to_nanoseconds(cur_time, &nsecs);
-        if (nsecs < 500000000) // < 500ms
-            timer->setTimeoutMS(IPTS_BUSY_TIMEOUT);
-        else if (nsecs < 1500000000) // < 1.5s
-            timer->setTimeoutMS(IPTS_ACTIVE_TIMEOUT);
-        else {
-            busy = false;
-            timer->setTimeoutMS(IPTS_IDLE_TIMEOUT);
+    // stop at the first malformed report, the caller learns where from the accepted count
+    *accepted = 0;
+    for (UInt32 i = 0; i < *count; i++) {
+        UInt32 report_size = getHIDReportSize(reports[i].report_id);
+        if (!report_size)
+            break;
+        // we are on the work loop already, so a full queue can be drained in place instead of losing reports
+        if (report_head - report_tail == IPTS_REPORT_QUEUE_SIZE)
+            flushReports();
+        enqueueReport(reports+i, report_size, delivered_time, frame);
+        (*accepted)++;
+    }
+    rejected_reports += *count - *accepted;
+    if (*accepted)
+        report_interrupt->interruptOccurred(nullptr, this, 0);
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::handleHIDReports(const IPTSHIDReport *reports, UInt32 count, UInt32 sequence, UInt64 *accepted) {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::handleHIDReportsGated), const_cast<IPTSHIDReport *>(reports), &count, &sequence, accepted);
+}
+
+bool IntelPreciseTouchStylusDriver::isDaemonFrame(UInt32 buffer, IPTSFrameClass *frame_class) {
+    IPTSDataHeader *header = reinterpret_cast<IPTSDataHeader *>(rx_buffer[buffer].vaddr);
+    *frame_class = IPTSFrameClassTouch;
+    if (header->size == 0 || header->size > rx_buffer[buffer].len - sizeof(IPTSDataHeader))
+        return false;
+    if (header->type == IPTSDataTypeFrame)
+        return true;
+    if (header->type != IPTSDataTypeHID || header->data[0] == IPTS_SINGLETOUCH_REPORT_ID || !IPTS_HID_REPORT_IS_TOUCH(header->data[0]))
+        return false;
+    return classifyFrame(header->data, header->size, frame_class);
+}
+
+bool IntelPreciseTouchStylusDriver::handleBuffer(UInt32 buffer, UInt32 sequence, bool deliver) {
+    IPTSDataHeader *header = reinterpret_cast<IPTSDataHeader *>(rx_buffer[buffer].vaddr);
+    owned_time[buffer] = poll_time;
+    current_sequence = sequence;
+    if (header->size == 0)
+        return true;
+    if (header->size > rx_buffer[buffer].len - sizeof(IPTSDataHeader)) {
+        // the size comes from the ME, nothing past the end of its buffer is ours to copy
+        malformed_frames++;
+        return true;
+    }
+    
+    if (trace_buffer)
+        recordTrace(header, buffer);
+    
+    return handleData(header, buffer, deliver);
+}
+
+bool IntelPreciseTouchStylusDriver::handleData(IPTSDataHeader *header, UInt32 buffer, bool deliver) {
+    IPTSFrameClass frame_class = IPTSFrameClassTouch;
+    if (!deliver && header->type == IPTSDataTypeFrame && frame_queue.getPolicy(IPTSFrameClassTouch) == IPTSDeliveryLatest) {
+        // a newer frame for the daemon is already waiting in a later buffer
+        coalesced_frames++;
+        return true;
+    }
+    
+    switch (header->type) {
+        case IPTSDataTypeFrame: {
+            if (header->size > frame_queue.getSlotSize() - 10) {
+                malformed_frames++;
+                break;
+            }
+            // fake a hid report
+            UInt8 *temp = acquireFrameSlot(IPTSFrameClassTouch);
+            if (temp) {
+                memset(temp, 0, 3);
+                IPTSHIDHeader *h = reinterpret_cast<IPTSHIDHeader *>(temp+3);
+                h->type = IPTS_HID_FRAME_TYPE_RAW;
+                h->size = header->size + sizeof(IPTSHIDHeader);
+                memcpy(temp+10, header->data, header->size);
+                publishFrame(10 + header->size);
+            }
+            break;
         }
-    } else if (doorbell < current_doorbell) {  // MEI device has been reset
-        DBG_LOG("MEI device has reset! Flushing buffers...");
-        for (int i = 0; i < IPTS_BUFFER_NUM; i++)
-            refillBuffer(i, false);     // non blocking feedback
-        current_doorbell = doorbell;
-        timer->setTimeoutMS(IPTS_BUSY_TIMEOUT);
-    } else {
-        UInt32 buffer = current_doorbell % IPTS_BUFFER_NUM;
-        IPTSDataHeader *header = reinterpret_cast<IPTSDataHeader *>(rx_buffer[buffer].vaddr);
-        if (header->size != 0) {
-            switch (header->type) {
-                case IPTSDataTypeFrame:
-                    // fake a hid report
-                    if (!daemon_processing) {
-                        UInt8 *temp = reinterpret_cast<UInt8 *>(input_buffer->getBytesNoCopy());
-                        IPTSHIDHeader *h = reinterpret_cast<IPTSHIDHeader *>(temp+3);
-                        h->type = IPTS_HID_FRAME_TYPE_RAW;
-                        h->size = header->size + sizeof(IPTSHIDHeader);
-                        input_buffer->writeBytes(10, header->data, header->size);
-                        input_size = 10 + header->size;
-                        daemon_handled = false;
-                        command_gate->commandWakeup(&wait);
-                    }
+        case IPTSDataTypeHID:
+            if (header->data[0] == IPTS_SINGLETOUCH_REPORT_ID) {
+                // directly handle the single touch report
+                IPTSHIDReport report;
+                UInt32 report_size = sizeof(IPTSTouchHIDReport)+1;
+                memset(&report, 0, sizeof(report));
+                memcpy(&report, header->data, header->size < report_size ? header->size : report_size);
+                report.report.touch.contact_num = report.report.touch.fingers[0].touch;
+                enqueueReport(&report, report_size, poll_time, current_sequence);
+                report_interrupt->interruptOccurred(nullptr, this, 0);
+            } else if (IPTS_HID_REPORT_IS_TOUCH(header->data[0])) {
+                // pen input, heatmaps the driver can handle itself and metadata never reach the daemon
+                if (!splitFrame(header->data, header->size, &frame_class))
                     break;
-                case IPTSDataTypeHID:
-                    if (header->data[0] == IPTS_SINGLETOUCH_REPORT_ID) {
-                        // directly handle the single touch report
-                        report_to_send->setLength(sizeof(IPTSTouchHIDReport)+1);
-                        IPTSHIDReport *buffer = reinterpret_cast<IPTSHIDReport *>(report_to_send->getBytesNoCopy());
-                        memset(buffer, 0, report_to_send->getLength());
-                        report_to_send->writeBytes(0, header->data, header->size);
-                        buffer->report.touch.contact_num = buffer->report.touch.fingers[0].touch;
-                        sent = false;
-                        report_interrupt->interruptOccurred(nullptr, this, 0);
-                    } else if (IPTS_HID_REPORT_IS_TOUCH(header->data[0])) {
-                        // call userspace daemon to process multitouch heatmap & stylus data
-                        if (!daemon_processing) {    // if the userspace daemon has finished processing
-                            input_buffer->writeBytes(0, header->data, header->size);
-                            input_size = header->size;
-                            daemon_handled = false;
-                            command_gate->commandWakeup(&wait);
-                        }
-                    }
+                if (!deliver && frame_queue.getPolicy(frame_class) == IPTSDeliveryLatest) {
+                    // a newer frame for the daemon is already waiting in a later buffer
+                    coalesced_frames++;
                     break;
-                case IPTSDataTypeGetFeatures:
-                    feature_report = header->data;
-                    command_gate->commandWakeup(&get_feature);
+                }
+                if (header->size > frame_queue.getSlotSize()) {
+                    malformed_frames++;
                     break;
-                default:
-                    DBG_LOG("Got data with type %d", header->type);
+                }
+                // call userspace daemon to process multitouch heatmap & stylus data
+                UInt8 *temp = acquireFrameSlot(frame_class);
+                if (!temp)
                     break;
+                if (zero_copy && frame_queue.hasPrimary() && buffer < IPTS_BUFFER_NUM) {
+                    // let the daemon read the frame in place, the buffer is refilled once it is released
+                    publishFrame(header->size, buffer, sizeof(IPTSDataHeader));
+                    return false;
+                }
+                memcpy(temp, header->data, header->size);
+                publishFrame(header->size);
             }
-        }
-        
-        if (refillBuffer(buffer, false) != kIOReturnSuccess)
-            LOG("Failed to send feedback buffer");
-        
-        current_doorbell++;
-        busy = true;
-        clock_get_uptime(&last_activate);
+            break;
+        case IPTSDataTypeGetFeatures:
+            if (header->data[0] == IPTS_DEVICE_METADATA_REPORT_ID)
+                cacheMetadata(header->data, header->size);
+            matchFeatureReport(header->data, header->size);
+            break;
+        default:
+            DBG_LOG("Got data with type %d", header->type);
+            break;
+    }
+    return true;
+}
+
+UInt8 *IntelPreciseTouchStylusDriver::acquireFrameSlot(IPTSFrameClass frame_class) {
+    UInt32 released;
+    UInt8 *slot = frame_queue.acquire(frame_class, &released);
+    // a superseded frame was never handed to the daemon, so its receive buffer can go back to the ME right away
+    refillBuffers(released);
+    return slot;
+}
+
+void IntelPreciseTouchStylusDriver::publishFrame(UInt32 size, UInt32 buffer, UInt32 offset) {
+    UInt32 released;
+    bool appended = frame_queue.publish(size, current_sequence, poll_time, buffer, offset, &released);
+    refillBuffers(released);
+    if (!appended)
+        return;
+    
+    for (UInt32 i = 0; i < IPTS_INPUT_CLIENT_NUM; i++) {
+        IPTSInputClient *client = &input_clients[i];
+        if (client->target && client->handler)
+            notifyFrames(client);
+    }
+    command_gate->commandWakeup(&wait);
+}
+
+UInt64 IntelPreciseTouchStylusDriver::getUptimeNS() {
+    AbsoluteTime cur_time;
+    UInt64 nsecs;
+    clock_get_uptime(&cur_time);
+    absolutetime_to_nanoseconds(cur_time, &nsecs);
+    return nsecs;
+}
+
+void IntelPreciseTouchStylusDriver::scheduleNextPoll(UInt64 now, UInt32 frames) {
+    if (poll_scheduler.update(now, frames))
+        publishStatistics();
+    if (frames > 0 && dozing) {
+        // first touch while dozing, bring the sensor back to its full scan rate
+        dozing = false;
+        // flushReports times its report from when the touch most likely landed, not from this poll
+        wake_time = poll_scheduler.getLastFrame();
+        wake_sequence = current_sequence;
+        if (sendSensorCommand(IPTSFeedbackCommandTypeGotoSensing) != kIOReturnSuccess)
+            LOG("Failed to wake up the sensor");
+    }
+    
+    if (!poll_scheduler.isBusy() && doze_timeout && !dozing && now - poll_scheduler.getLastFrame() > doze_timeout * 1000000ULL &&
+        sendSensorCommand(IPTSFeedbackCommandTypeGotoDoze) == kIOReturnSuccess) {
+        dozing = true;
+        doze_entries++;
+    }
+    timer->setTimeoutUS(poll_scheduler.nextPoll(now, dozing));
+}
+
+void IntelPreciseTouchStylusDriver::checkDaemonStall(UInt64 now) {
+    if (daemon_stalled) {
+        if (!multitouch)    // the daemon went away without catching up
+            endDaemonStall(now);
+        return;
+    }
+    if (!multitouch || !stall_timeout || frame_queue.isEmpty())
+        return;
+    
+    // the daemon owes us frames, count from its last sign of life or from when the oldest of them was published
+    UInt64 since = frame_queue.getOldestTime();
+    if (daemon_progress > since)
+        since = daemon_progress;
+    if (now - since < stall_timeout * 1000000ULL)
+        return;
+    
+    LOG("Multitouch daemon stalled for %llu ms, falling back to single touch", (now - since) / 1000000);
+    daemon_stalled = true;
+    stall_start = since;
+    daemon_stalls++;
+    status_interrupt->interruptOccurred(nullptr, this, 0);
+}
+
+void IntelPreciseTouchStylusDriver::noteDaemonProgress() {
+    daemon_progress = getUptimeNS();
+    // switch back once the daemon has taken every frame that was queued while it was stuck
+    if (daemon_stalled && frame_queue.getRing() && frame_queue.isDrained())
+        endDaemonStall(daemon_progress);
+}
+
+void IntelPreciseTouchStylusDriver::endDaemonStall(UInt64 now) {
+    recordLatency(IPTSLatencyStageStall, now - stall_start);
+    DBG_LOG("Multitouch daemon recovered after %llu ms", (now - stall_start) / 1000000);
+    daemon_stalled = false;
+    status_interrupt->interruptOccurred(nullptr, this, 0);
+}
+
+void IntelPreciseTouchStylusDriver::pollTouchData(IOTimerEventSource *sender) {
+    UInt32 value;
+    memcpy(&value, doorbell_buffer.vaddr, sizeof(UInt32));
+    UInt64 now = getUptimeNS();
+    poll_time = now;
+    
+    if (feedback_retry)
+        retryFeedback();
+    if (feature_pending)
+        expireFeatureRequests(now);
+    checkDaemonStall(now);
+    
+    UInt32 pending = doorbell.drain(value);
+    if (pending == IPTS_DOORBELL_RESET) {  // MEI device has been reset
+        DBG_LOG("MEI device has reset! Flushing buffers...");
+        feedback_outstanding = 0;
+        feedback_retry = 0;
+        frame_queue.resetBuffers();     // before the ME may write to the buffers again
+        for (int i = 0; i < IPTS_BUFFER_NUM; i++)
+            refillBuffer(i, false);     // non blocking feedback
+        if (contact_detector)
+            contact_detector->reset();
+        invalidateMetadataGated();
+        abortFeatureRequestsGated();
+        dozing = false;     // the sensor is back to sensing after a reset
+        wake_time = 0;
+        poll_scheduler.resync(now);
         timer->setTimeoutMS(IPTS_BUSY_TIMEOUT);
+        return;
+    }
+    scheduleNextPoll(now, pending);
+}
+
+void IntelPreciseTouchStylusDriver::publishStatistics() {
+    OSDictionary *stats = OSDictionary::withCapacity(16);
+    if (!stats)
+        return;
+    
+    OSNumber *value = OSNumber::withNumber(doorbell.getWakeups(), 64);
+    stats->setObject("Wakeups", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(doorbell.getFrames(), 64);
+    stats->setObject("DrainedBuffers", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(doorbell.getMaxDrained(), 32);
+    stats->setObject("MaxDrainedPerWakeup", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(coalesced_frames, 64);
+    stats->setObject("CoalescedFrames", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(frame_queue.getRingDrops(), 64);
+    stats->setObject("RingDrops", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(frame_queue.getSuperseded(IPTSFrameClassTouch) + frame_queue.getSuperseded(IPTSFrameClassStylus), 64);
+    stats->setObject("SupersededFrames", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(touch_overflows, 64);
+    stats->setObject("TouchReportOverflows", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(stylus_overflows, 64);
+    stats->setObject("StylusReportOverflows", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(poll_scheduler.getEmptyWakeups(), 64);
+    stats->setObject("EmptyWakeups", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(poll_scheduler.getFramePeriod() / 1000, 32);
+    stats->setObject("FramePeriodUS", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(feedback_retries, 64);
+    stats->setObject("FeedbackRetries", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(doze_entries, 64);
+    stats->setObject("DozeEntries", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(daemon_stalls, 64);
+    stats->setObject("DaemonStalls", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(malformed_frames, 64);
+    stats->setObject("MalformedFrames", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(doorbell.getDrops(), 64);
+    stats->setObject("DoorbellDrops", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(rejected_reports, 64);
+    stats->setObject("RejectedReports", value);
+    OSSafeReleaseNULL(value);
+    
+    setProperty("PollStatistics", stats);
+    OSSafeReleaseNULL(stats);
+    
+    publishLatency();
+}
+
+void IntelPreciseTouchStylusDriver::recordLatency(IPTSLatencyStage stage, UInt64 nsecs) {
+    IPTSLatencyHistogram *histogram = &latency.stages[stage];
+    UInt64 usecs = nsecs / 1000;
+    UInt32 bucket = usecs > 1 ? 63 - __builtin_clzll(usecs) : 0;
+    if (bucket >= IPTS_LATENCY_BUCKET_NUM)
+        bucket = IPTS_LATENCY_BUCKET_NUM - 1;
+    
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->total_us += usecs;
+    if (usecs > histogram->max_us)
+        histogram->max_us = usecs;
+}
+
+UInt64 IntelPreciseTouchStylusDriver::getLatencyPercentile(IPTSLatencyStage stage, UInt32 percent) {
+    IPTSLatencyHistogram *histogram = &latency.stages[stage];
+    UInt64 target = (histogram->count * percent + 99) / 100;
+    UInt64 seen = 0;
+    for (UInt32 i = 0; i < IPTS_LATENCY_BUCKET_NUM; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= target && seen > 0)
+            return 2ULL << i;   // upper bound of the bucket
+    }
+    return 0;
+}
+
+void IntelPreciseTouchStylusDriver::publishLatency() {
+    static const char *stage_names[IPTSLatencyStageNum] = {"Handoff", "Daemon", "Dispatch", "Total", "HostOwned", "Wake", "Stall"};
+    OSDictionary *stats = OSDictionary::withCapacity(IPTSLatencyStageNum);
+    if (!stats)
+        return;
+    
+    for (int i = 0; i < IPTSLatencyStageNum; i++) {
+        IPTSLatencyStage stage = static_cast<IPTSLatencyStage>(i);
+        OSDictionary *entry = OSDictionary::withCapacity(4);
+        if (!entry)
+            break;
+        OSNumber *value = OSNumber::withNumber(latency.stages[i].count, 64);
+        entry->setObject("Count", value);
+        OSSafeReleaseNULL(value);
+        value = OSNumber::withNumber(getLatencyPercentile(stage, 50), 64);
+        entry->setObject("P50US", value);
+        OSSafeReleaseNULL(value);
+        value = OSNumber::withNumber(getLatencyPercentile(stage, 99), 64);
+        entry->setObject("P99US", value);
+        OSSafeReleaseNULL(value);
+        value = OSNumber::withNumber(latency.stages[i].max_us, 64);
+        entry->setObject("MaxUS", value);
+        OSSafeReleaseNULL(value);
+        stats->setObject(stage_names[i], entry);
+        OSSafeReleaseNULL(entry);
     }
+    
+    setProperty("LatencyStatistics", stats);
+    OSSafeReleaseNULL(stats);
 }
 
 IOReturn IntelPreciseTouchStylusDriver::sendIPTSCommand(UInt32 code, UInt8 *data, UInt16 data_len, bool blocking) {
@@ -409,62 +1465,238 @@ IOReturn IntelPreciseTouchStylusDriver::sendFeedback(UInt32 buffer, bool blockin
     return sendIPTSCommand(IPTS_CMD_FEEDBACK, reinterpret_cast<UInt8 *>(&cmd), sizeof(IPTSFeedbackCommand), blocking);
 }
 
-IOReturn IntelPreciseTouchStylusDriver::getFeatureRequestGated(UInt8* report_id, UInt16* size) {
-    feature_report = nullptr;
-    memset(tx_buffer.vaddr, 0, tx_buffer.len);
+IOReturn IntelPreciseTouchStylusDriver::submitFeatureRequestGated(IPTSFeatureRequest *request) {
+    if (state != IPTSDeviceStateStarted || !tx_buffer.vaddr)
+        return kIOReturnNotReady;
+    
+    UInt32 index = 0;
+    while (index < IPTS_FEATURE_REQUEST_NUM && feature_requests[index].state != IPTSFeatureRequestFree)
+        index++;
+    if (index == IPTS_FEATURE_REQUEST_NUM)
+        return kIOReturnNoResources;
+    
+    if (request->target)
+        request->target->retain();
+    feature_requests[index] = *request;
+    feature_requests[index].state = IPTSFeatureRequestQueued;
+    feature_requests[index].order = feature_order++;
+    feature_pending++;
+    sendNextFeatureRequest();
+    return kIOReturnSuccess;
+}
+
+void IntelPreciseTouchStylusDriver::sendNextFeatureRequest() {
+    while (!tx_busy) {
+        // oldest queued request whose report id is not already being asked for
+        UInt32 busy_ids[IPTS_FEATURE_REQUEST_NUM];
+        UInt32 busy_num = 0;
+        for (UInt32 i = 0; i < IPTS_FEATURE_REQUEST_NUM; i++) {
+            if (feature_requests[i].type == IPTSFeedbackDataTypeGetFeatures &&
+                (feature_requests[i].state == IPTSFeatureRequestSent || feature_requests[i].state == IPTSFeatureRequestWaiting))
+                busy_ids[busy_num++] = feature_requests[i].report_id;
+        }
+        IPTSFeatureRequest *next = nullptr;
+        for (UInt32 i = 0; i < IPTS_FEATURE_REQUEST_NUM; i++) {
+            IPTSFeatureRequest *request = &feature_requests[i];
+            if (request->state != IPTSFeatureRequestQueued || (next && static_cast<SInt32>(request->order - next->order) > 0))
+                continue;
+            bool blocked = false;
+            for (UInt32 j = 0; j < busy_num; j++)
+                blocked |= busy_ids[j] == request->report_id;
+            if (!blocked)
+                next = request;
+        }
+        if (!next)
+            return;
+        
+        memset(tx_buffer.vaddr, 0, tx_buffer.len);
+        IPTSFeedbackHeader *feedback = reinterpret_cast<IPTSFeedbackHeader *>(tx_buffer.vaddr);
+        feedback->cmd_type = next->command;
+        feedback->data_type = next->type;
+        feedback->buffer = IPTS_TX_BUFFER;
+        if (next->command != IPTSFeedbackCommandTypeNone) {
+            feedback->size = 0;
+        } else if (next->type == IPTSFeedbackDataTypeSetFeatures) {
+            feedback->size = 2;
+            feedback->payload[0] = next->report_id;
+            feedback->payload[1] = next->value;
+        } else {
+            feedback->size = next->size;
+            feedback->payload[0] = next->report_id;
+        }
+        
+        IOReturn ret = sendFeedback(IPTS_TX_BUFFER, false);
+        if (ret != kIOReturnSuccess) {
+            LOG("Failed to send tx request, command %d report 0x%x", next->command, next->report_id);
+            finishFeatureRequest(static_cast<UInt32>(next - feature_requests), ret, nullptr, 0);
+            continue;
+        }
+        UInt64 now = getUptimeNS();
+        next->state = IPTSFeatureRequestSent;
+        next->deadline = now + IPTS_FEATURE_TIMEOUT * 1000000ULL;
+        tx_deadline = next->deadline;
+        tx_busy = true;
+    }
+}
+
+void IntelPreciseTouchStylusDriver::finishFeatureRequest(UInt32 index, IOReturn status, const UInt8 *report, UInt16 size) {
+    IPTSFeatureRequest request = feature_requests[index];
+    // free the slot first, the handler may well ask for the next report
+    feature_requests[index].state = IPTSFeatureRequestFree;
+    feature_pending--;
+    
+    if (request.handler) {
+        request.handler(request.target, request.context, status, report, size);
+    } else if (request.context) {
+        IPTSFeatureWait *waiter = reinterpret_cast<IPTSFeatureWait *>(request.context);
+        if (report && status == kIOReturnSuccess)
+            memcpy(waiter->report, report, size < waiter->size ? size : waiter->size);
+        waiter->status = status;
+        command_gate->commandWakeup(waiter);
+    }
+    OSSafeReleaseNULL(request.target);
+}
+
+void IntelPreciseTouchStylusDriver::matchFeatureReport(const UInt8 *report, UInt16 size) {
+    // the report can come back before the ME has confirmed the tx buffer, and it answers queued requests for the same id as well
+    bool matched = false;
+    for (UInt32 i = 0; i < IPTS_FEATURE_REQUEST_NUM; i++) {
+        IPTSFeatureRequest *request = &feature_requests[i];
+        if (request->state == IPTSFeatureRequestFree || request->type != IPTSFeedbackDataTypeGetFeatures ||
+            request->report_id != report[0])
+            continue;
+        finishFeatureRequest(i, kIOReturnSuccess, report, size);
+        matched = true;
+    }
+    if (matched)
+        sendNextFeatureRequest();
+    else
+        DBG_LOG("Unexpected feature report 0x%x", report[0]);
+}
+
+void IntelPreciseTouchStylusDriver::expireFeatureRequests(UInt64 now) {
+    for (UInt32 i = 0; i < IPTS_FEATURE_REQUEST_NUM; i++) {
+        IPTSFeatureRequest *request = &feature_requests[i];
+        if ((request->state == IPTSFeatureRequestSent || request->state == IPTSFeatureRequestWaiting) && now >= request->deadline) {
+            LOG("Timeout waiting for feature report 0x%x", request->report_id);
+            finishFeatureRequest(i, kIOReturnTimeout, nullptr, 0);
+        }
+    }
+    if (tx_busy && now >= tx_deadline)
+        tx_busy = false;    // the ME never confirmed the tx buffer, do not let the queue stall behind it
+    sendNextFeatureRequest();
+}
+
+IOReturn IntelPreciseTouchStylusDriver::abortFeatureRequestsGated() {
+    for (UInt32 i = 0; i < IPTS_FEATURE_REQUEST_NUM; i++) {
+        if (feature_requests[i].state != IPTSFeatureRequestFree)
+            finishFeatureRequest(i, kIOReturnAborted, nullptr, 0);
+    }
+    tx_busy = false;
+    tx_events = 0;
+    return kIOReturnSuccess;
+}
+
+void IntelPreciseTouchStylusDriver::handleInterruptFeature(IOInterruptEventSource *sender, int count) {
+    UInt32 events = OSBitAndAtomic(0, &tx_events);
+    if (!tx_busy)
+        return;
+    
+    if (events & IPTS_TX_REJECTED) {
+        // the tx buffer still holds the request
+        OSIncrementAtomic64(&feedback_retries);
+        if (sendFeedback(IPTS_TX_BUFFER, false) == kIOReturnSuccess)
+            return;
+        events |= IPTS_TX_ACKED;
+        for (UInt32 i = 0; i < IPTS_FEATURE_REQUEST_NUM; i++) {
+            if (feature_requests[i].state == IPTSFeatureRequestSent)
+                finishFeatureRequest(i, kIOReturnIOError, nullptr, 0);
+        }
+    }
+    if (!(events & IPTS_TX_ACKED))
+        return;
     
-    IPTSFeedbackHeader *feedback = reinterpret_cast<IPTSFeedbackHeader *>(tx_buffer.vaddr);
-    feedback->cmd_type = IPTSFeedbackCommandTypeNone;
-    feedback->data_type = IPTSFeedbackDataTypeGetFeatures;
-    feedback->buffer = IPTS_TX_BUFFER;
-    feedback->size = *size;
-    feedback->payload[0] = *report_id;
+    tx_busy = false;
+    for (UInt32 i = 0; i < IPTS_FEATURE_REQUEST_NUM; i++) {
+        IPTSFeatureRequest *request = &feature_requests[i];
+        if (request->state != IPTSFeatureRequestSent)
+            continue;
+        if (request->type != IPTSFeedbackDataTypeGetFeatures)
+            finishFeatureRequest(i, kIOReturnSuccess, nullptr, 0);
+        else
+            request->state = IPTSFeatureRequestWaiting;
+    }
+    sendNextFeatureRequest();
+}
 
-    IOReturn ret = sendFeedback(IPTS_TX_BUFFER, false);
+IOReturn IntelPreciseTouchStylusDriver::getFeatureRequestGated(UInt8 *report_id, IPTSFeatureWait *waiter) {
+    IPTSFeatureRequest request;
+    memset(&request, 0, sizeof(IPTSFeatureRequest));
+    request.type = IPTSFeedbackDataTypeGetFeatures;
+    request.report_id = *report_id;
+    request.size = waiter->size;
+    request.context = waiter;
+    
+    IOReturn ret = submitFeatureRequestGated(&request);
     if (ret != kIOReturnSuccess) {
         LOG("Failed to send get feature request");
         return ret;
     }
     
     AbsoluteTime abstime, deadline;
-    nanoseconds_to_absolutetime(500 * 1000000, &abstime);   // 500ms
+    nanoseconds_to_absolutetime(IPTS_FEATURE_TIMEOUT * 1000000ULL, &abstime);
     clock_absolutetime_interval_to_deadline(abstime, &deadline);
-    ret = command_gate->commandSleep(&get_feature, deadline, THREAD_INTERRUPTIBLE);
-    if (ret == THREAD_TIMED_OUT) {
+    while (waiter->status == kIOReturnNotReady) {
+        if (command_gate->commandSleep(waiter, deadline, THREAD_INTERRUPTIBLE) == THREAD_AWAKENED)
+            continue;
+        // the poll timer may not be running, so the request is dropped here
         LOG("Timeout waiting for response");
-        return kIOReturnTimeout;
+        for (UInt32 i = 0; i < IPTS_FEATURE_REQUEST_NUM; i++) {
+            if (feature_requests[i].state != IPTSFeatureRequestFree && feature_requests[i].context == waiter)
+                finishFeatureRequest(i, kIOReturnTimeout, nullptr, 0);
+        }
+        expireFeatureRequests(getUptimeNS());
+        if (waiter->status == kIOReturnNotReady)
+            waiter->status = kIOReturnTimeout;
     }
-    
-    if (!feature_report)
-        return kIOReturnInvalid;
-    
-    return kIOReturnSuccess;
+    return waiter->status;
 }
 
 IOReturn IntelPreciseTouchStylusDriver::sendGetFeatureRequest(UInt8 report_id, UInt8 *report, UInt16 size) {
-    IOReturn ret = command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::getFeatureRequestGated), &report_id, &size);
-    if (ret != kIOReturnSuccess)
-        return ret;
-    
-    memcpy(report, feature_report, size);
-    
-    return kIOReturnSuccess;
+    IPTSFeatureWait waiter = {kIOReturnNotReady, report, size};
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::getFeatureRequestGated), &report_id, &waiter);
 }
 
-IOReturn IntelPreciseTouchStylusDriver::sendSetFeatureReport(UInt8 report_id, UInt8 value) {
-    IPTSFeedbackHeader *feedback;
-    memset(tx_buffer.vaddr, 0, tx_buffer.len);
+IOReturn IntelPreciseTouchStylusDriver::requestFeatureReport(UInt8 report_id, UInt16 size, OSObject *target, FeatureHandler handler, void *context) {
+    if (!handler)
+        return kIOReturnBadArgument;
     
-    feedback = reinterpret_cast<IPTSFeedbackHeader *>(tx_buffer.vaddr);
+    IPTSFeatureRequest request;
+    memset(&request, 0, sizeof(IPTSFeatureRequest));
+    request.type = IPTSFeedbackDataTypeGetFeatures;
+    request.report_id = report_id;
+    request.size = size;
+    request.target = target;
+    request.handler = handler;
+    request.context = context;
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::submitFeatureRequestGated), &request);
+}
 
-    feedback->cmd_type = IPTSFeedbackCommandTypeNone;
-    feedback->data_type = IPTSFeedbackDataTypeSetFeatures;
-    feedback->buffer = IPTS_TX_BUFFER;
-    feedback->size = 2;
-    feedback->payload[0] = report_id;
-    feedback->payload[1] = value;
+IOReturn IntelPreciseTouchStylusDriver::sendSetFeatureReport(UInt8 report_id, UInt8 value) {
+    IPTSFeatureRequest request;
+    memset(&request, 0, sizeof(IPTSFeatureRequest));
+    request.type = IPTSFeedbackDataTypeSetFeatures;
+    request.report_id = report_id;
+    request.value = value;
+    return submitFeatureRequestGated(&request);
+}
 
-    return sendFeedback(IPTS_TX_BUFFER);
+IOReturn IntelPreciseTouchStylusDriver::sendSensorCommand(IPTSFeedbackCommandType command) {
+    IPTSFeatureRequest request;
+    memset(&request, 0, sizeof(IPTSFeatureRequest));
+    request.command = command;
+    request.type = IPTSFeedbackDataTypeVendor;
+    return submitFeatureRequestGated(&request);
 }
 
 IOReturn IntelPreciseTouchStylusDriver::refillBuffer(UInt32 buffer, bool blocking) {
@@ -472,7 +1704,82 @@ IOReturn IntelPreciseTouchStylusDriver::refillBuffer(UInt32 buffer, bool blockin
 //    IPTSFeedbackHeader *header = reinterpret_cast<IPTSFeedbackHeader *>(feedback_buffer[buffer].vaddr);
 //    header->buffer = buffer;
     
-    return sendFeedback(buffer, blocking);
+    UInt32 mask = 1 << buffer;
+    if (owned_time[buffer]) {
+        recordLatency(IPTSLatencyStageHostOwned, getUptimeNS() - owned_time[buffer]);
+        owned_time[buffer] = 0;
+    }
+    
+    if (OSBitOrAtomic(mask, &feedback_outstanding) & mask) {
+        // the previous feedback is still in flight, send it once more when that one completes
+        OSBitOrAtomic(mask, &feedback_retry);
+        return kIOReturnSuccess;
+    }
+    
+    IOReturn ret = sendFeedback(buffer, blocking);
+    if (ret != kIOReturnSuccess)
+        OSBitAndAtomic(~mask, &feedback_outstanding);
+    return ret;
+}
+
+void IntelPreciseTouchStylusDriver::refillBuffers(UInt32 mask) {
+    for (UInt32 i = 0; i < IPTS_BUFFER_NUM; i++) {
+        if ((mask & (1 << i)) && refillBuffer(i, false) != kIOReturnSuccess)
+            LOG("Failed to send feedback buffer");
+    }
+}
+
+void IntelPreciseTouchStylusDriver::completeFeedback(UInt32 buffer, bool rejected) {
+    if (buffer >= IPTS_BUFFER_NUM) {
+        retryFeedback();
+        return;
+    }
+    
+    UInt32 mask = 1 << buffer;
+    if (rejected)
+        OSBitOrAtomic(mask, &feedback_retry);
+    OSBitAndAtomic(~mask, &feedback_outstanding);
+    
+    // the ME just finished a feedback, so it has room for one we had to hold back
+    if (!rejected)
+        retryFeedback();
+}
+
+void IntelPreciseTouchStylusDriver::retryFeedback() {
+    UInt32 retry = feedback_retry & ~feedback_outstanding;
+    if (!retry)
+        return;
+    
+    UInt32 buffer = __builtin_ctz(retry);
+    UInt32 mask = 1 << buffer;
+    if (!(OSBitAndAtomic(~mask, &feedback_retry) & mask))
+        return;     // somebody else is already retrying it
+    if (OSBitOrAtomic(mask, &feedback_outstanding) & mask) {
+        OSBitOrAtomic(mask, &feedback_retry);
+        return;
+    }
+    
+    OSIncrementAtomic64(&feedback_retries);
+    if (sendFeedback(buffer, false) != kIOReturnSuccess) {
+        OSBitAndAtomic(~mask, &feedback_outstanding);
+        OSBitOrAtomic(mask, &feedback_retry);
+    }
+}
+
+void IntelPreciseTouchStylusDriver::retryQuiesceFeedback(UInt32 buffer) {
+    // the poll timer is off while stopping, so nothing else would give the buffer back again
+    if (buffer <= IPTS_TX_BUFFER && quiesce_retries[buffer]++ < IPTS_QUIESCE_RETRIES) {
+        OSIncrementAtomic64(&feedback_retries);
+        if (sendFeedback(buffer, false) == kIOReturnSuccess)
+            return;
+    }
+    
+    // the flush can not finish, stop without it instead of leaving waitForStop hanging
+    LOG("Failed to flush buffer %u", buffer);
+    if (buffer < IPTS_BUFFER_NUM)
+        OSBitAndAtomic(~(1 << buffer), &feedback_outstanding);
+    quiesce_pending = 0;
+    setStopped();
 }
 
 IOReturn IntelPreciseTouchStylusDriver::startDevice() {
@@ -494,20 +1801,91 @@ void IntelPreciseTouchStylusDriver::stopDevice() {
         timer->cancelTimeout();
         timer->disable();
     }
-       
-    if (sendFeedback(0) == kIOReturnNoDevice)
-        state = IPTSDeviceStateStopped;
+    
+    // stop the data flow first, the buffers are flushed once the ME confirms
+    IPTSQuiesceIOCommand quiesce;
+    memset(&quiesce, 0, sizeof(quiesce));
+    IOReturn ret = sendIPTSCommand(IPTS_CMD_QUIESCE_IO, reinterpret_cast<UInt8 *>(&quiesce), sizeof(quiesce));
+    if (ret != kIOReturnSuccess) {
+        // no response is coming to start the flush, waitForStop must not hang on it
+        LOG("Failed to send quiesce IO: 0x%x", ret);
+        setStopped();
+    }
+}
+
+bool IntelPreciseTouchStylusDriver::waitForStop(UInt32 timeout_ms) {
+    AbsoluteTime deadline;
+    clock_interval_to_deadline(timeout_ms, kMillisecondScale, &deadline);
+    
+    IOLockLock(stop_lock);
+    while (state != IPTSDeviceStateStopped) {
+        if (IOLockSleepDeadline(stop_lock, &state, deadline, THREAD_UNINT) == THREAD_TIMED_OUT)
+            break;
+    }
+    bool stopped = state == IPTSDeviceStateStopped;
+    IOLockUnlock(stop_lock);
+    return stopped;
+}
+
+void IntelPreciseTouchStylusDriver::setStopped() {
+    IOLockLock(stop_lock);
+    state = IPTSDeviceStateStopped;
+    IOLockWakeup(stop_lock, &state, false);
+    IOLockUnlock(stop_lock);
+}
+
+IOReturn IntelPreciseTouchStylusDriver::flushBuffers() {
+    // hand every buffer back at once instead of one per response, the ME queues or rejects the rest
+    quiesce_pending = ((1 << IPTS_BUFFER_NUM) - 1) | IPTS_QUIESCE_RESET;
+    memset(quiesce_retries, 0, sizeof(quiesce_retries));
+    for (UInt32 i = 0; i < IPTS_BUFFER_NUM; i++) {
+        UInt32 mask = 1 << i;
+        if (OSBitOrAtomic(mask, &feedback_outstanding) & mask)
+            continue;   // already on its way, its response counts as well
+        IOReturn ret = sendFeedback(i, false);
+        if (ret != kIOReturnSuccess) {
+            OSBitAndAtomic(~mask, &feedback_outstanding);
+            return ret;
+        }
+    }
+    return kIOReturnSuccess;
 }
 
 void IntelPreciseTouchStylusDriver::restartDevice() {
     if (restart)
         return;
     restart = true;
+    // the sensor was reset, its metadata has to be read again before heatmaps are trusted
+    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::invalidateMetadataGated));
     stopDevice();
 }
 
 void IntelPreciseTouchStylusDriver::handleMessage(SurfaceManagementEngineClient *sender, UInt8 *msg, UInt16 msg_len) {    
     IPTSResponse *rsp = reinterpret_cast<IPTSResponse *>(msg);
+    if (rsp->code == IPTS_RSP_QUIESCE_IO && state == IPTSDeviceStateStopping) {
+        // older firmwares may not know the command, the flush below stops them as well
+        if (rsp->status != IPTSCommandSuccess)
+            DBG_LOG("Quiesce IO returned %d", rsp->status);
+        if (flushBuffers() != kIOReturnSuccess) {
+            LOG("Failed to flush buffers");
+            setStopped();
+        }
+        return;
+    }
+    if (rsp->code == IPTS_RSP_FEEDBACK && rsp->status == IPTSCommandRequestOutstanding &&
+        (state == IPTSDeviceStateStarted || state == IPTSDeviceStateStopping)) {
+        // the ME is still busy with an earlier feedback, the buffer has to be given back again later
+        IPTSFeedbackResponse feedback;
+        memcpy(&feedback, rsp->payload, sizeof(feedback));
+        if (feedback.buffer == IPTS_TX_BUFFER && state == IPTSDeviceStateStarted) {
+            OSBitOrAtomic(IPTS_TX_REJECTED, &tx_events);
+            feature_interrupt->interruptOccurred(nullptr, this, 0);
+        } else if (state == IPTSDeviceStateStopping)
+            retryQuiesceFeedback(feedback.buffer);
+        else
+            completeFeedback(feedback.buffer, true);
+        return;
+    }
     if (isResponseError(rsp))
         return;
     
@@ -516,12 +1894,19 @@ void IntelPreciseTouchStylusDriver::handleMessage(SurfaceManagementEngineClient
         case IPTS_RSP_GET_DEVICE_INFO: {
             IPTSGetDeviceInfoResponse device_info;
             memcpy(&device_info, rsp->payload, sizeof(device_info));
+            // metadata cached before sleep stays valid as long as the sensor is the same
+            if (touch_screen->vendor_id != device_info.vendor_id || touch_screen->device_id != device_info.device_id ||
+                touch_screen->version != device_info.intf_eds)
+                command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::invalidateMetadataGated));
             touch_screen->vendor_id = device_info.vendor_id;
             touch_screen->device_id = device_info.device_id;
             touch_screen->version = device_info.intf_eds;
             touch_screen->max_contacts = device_info.max_contacts;
             
-            if (allocateDMAResources(device_info.data_size, device_info.feedback_size) != kIOReturnSuccess) {
+            // clients and the poll timer look at the buffers from inside the gate
+            UInt32 data_size = device_info.data_size;
+            UInt32 feedback_size = device_info.feedback_size;
+            if (command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::allocateDMAResourcesGated), &data_size, &feedback_size) != kIOReturnSuccess) {
                 LOG("Failed to allocate resources");
                 ret = kIOReturnNoMemory;
                 break;
@@ -583,6 +1968,8 @@ void IntelPreciseTouchStylusDriver::handleMessage(SurfaceManagementEngineClient
             set_mem.workqueue_size = IPTS_WORKQUEUE_SIZE;
             set_mem.workqueue_item_size = IPTS_WORKQUEUE_ITEM_SIZE;
 
+            // the ME may take the addresses even if the command fails, only CLEAR_MEM_WINDOW makes it forget them
+            mem_window_set = true;
             ret = sendIPTSCommand(IPTS_CMD_SET_MEM_WINDOW, reinterpret_cast<UInt8 *>(&set_mem), sizeof(set_mem));
             break;
         }
@@ -603,8 +1990,13 @@ void IntelPreciseTouchStylusDriver::handleMessage(SurfaceManagementEngineClient
             
             LOG("IPTS Device is ready");
             state = IPTSDeviceStateStarted;
+            if (contact_detector)
+                status_interrupt->interruptOccurred(nullptr, this, 0);
             
             if (mode == IPTSModeDoorbell) {
+                dozing = false;
+                wake_time = 0;
+                poll_scheduler.start(getUptimeNS());    // gives the sensor a full doze timeout after starting
                 timer->enable();
                 timer->setTimeoutMS(IPTS_IDLE_TIMEOUT);
             }
@@ -619,14 +2011,26 @@ void IntelPreciseTouchStylusDriver::handleMessage(SurfaceManagementEngineClient
             }
             break;
         case IPTS_RSP_FEEDBACK: {
-            if (state != IPTSDeviceStateStopping)
-                break;
-            
             IPTSFeedbackResponse feedback;
             memcpy(&feedback, rsp->payload, sizeof(feedback));
-            if (feedback.buffer < IPTS_BUFFER_NUM - 1) {
-                ret = refillBuffer(feedback.buffer + 1);
-            } else if (feedback.buffer == IPTS_BUFFER_NUM - 1) {
+            if (state != IPTSDeviceStateStopping) {
+                if (state == IPTSDeviceStateStarted) {
+                    completeFeedback(feedback.buffer, false);
+                    if (feedback.buffer == IPTS_TX_BUFFER) {
+                        // the next feature request may use the tx buffer now
+                        OSBitOrAtomic(IPTS_TX_ACKED, &tx_events);
+                        feature_interrupt->interruptOccurred(nullptr, this, 0);
+                    }
+                }
+                break;
+            }
+            
+            if (feedback.buffer < IPTS_BUFFER_NUM) {
+                UInt32 mask = 1 << feedback.buffer;
+                completeFeedback(feedback.buffer, false);
+                if (OSBitAndAtomic(~mask, &quiesce_pending) != (mask | IPTS_QUIESCE_RESET))
+                    break;  // still waiting for other buffers
+                
                 IPTSFeedbackHeader *header;
                 memset(tx_buffer.vaddr, 0, tx_buffer.len);
                 
@@ -634,13 +2038,17 @@ void IntelPreciseTouchStylusDriver::handleMessage(SurfaceManagementEngineClient
                 header->cmd_type = IPTSFeedbackCommandTypeSoftReset;
                 header->buffer = IPTS_TX_BUFFER;
                 ret = sendFeedback(IPTS_TX_BUFFER);
-            } else
+            } else if (quiesce_pending == IPTS_QUIESCE_RESET) {
+                quiesce_pending = 0;
                 ret = sendIPTSCommand(IPTS_CMD_CLEAR_MEM_WINDOW, nullptr, 0);
+            }
             break;
         }
         case IPTS_RSP_CLEAR_MEM_WINDOW:
-            freeDMAResources();
-            state = IPTSDeviceStateStopped;
+            mem_window_set = false;
+            if (!keep_dma_memory)
+                command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IntelPreciseTouchStylusDriver::freeDMAResourcesGated));
+            setStopped();
             if (restart)
                 ret = startDevice();
             break;
@@ -682,60 +2090,112 @@ bool IntelPreciseTouchStylusDriver::isResponseError(IPTSResponse *rsp) {
     return true;
 }
 
-IOReturn IntelPreciseTouchStylusDriver::allocateDMAMemory(IPTSBufferInfo *info, UInt32 size) {
-    IOBufferMemoryDescriptor *buf = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryKernelUserShared | kIOMapInhibitCache, size, DMA_BIT_MASK(64));
-    if (!buf)
+void IntelPreciseTouchStylusDriver::reserveDMAMemory(IPTSBufferInfo *info, UInt32 size, UInt32 alignment, UInt32 *slab_size) {
+    info->offset = (*slab_size + alignment - 1) & ~(alignment - 1);
+    info->len = size;
+    *slab_size = info->offset + size;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::mapDMAMemory(IPTSBufferInfo *info, bool shared) {
+    info->vaddr = reinterpret_cast<UInt8 *>(dma_slab->getBytesNoCopy()) + info->offset;
+    info->paddr = dma_slab_paddr + info->offset;
+    if (!shared)
+        return kIOReturnSuccess;
+    
+    info->buffer = IOSubMemoryDescriptor::withSubRange(dma_slab, info->offset, info->len, kIODirectionInOut);
+    return info->buffer ? kIOReturnSuccess : kIOReturnNoMemory;
+}
+
+IOReturn IntelPreciseTouchStylusDriver::allocateDMASlab(UInt32 size) {
+    dma_slab = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryKernelUserShared | kIOMapInhibitCache, size, DMA_BIT_MASK(64));
+    if (!dma_slab)
         return kIOReturnNoMemory;
-    buf->prepare();
+    dma_slab->prepare();
+    memset(dma_slab->getBytesNoCopy(), 0, size);
     
-    IODMACommand *cmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, 0, IODMACommand::kMapped, 0, 4);
-    if (!cmd) {
-        buf->complete();
-        OSSafeReleaseNULL(buf);
+    dma_cmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, 0, IODMACommand::kMapped, 0, 4);
+    if (!dma_cmd)
         return kIOReturnNoMemory;
-    }
-    cmd->setMemoryDescriptor(buf);
-
+    dma_cmd->setMemoryDescriptor(dma_slab);
+    
+    // the sub buffers are handed to the ME as base + offset, so the whole slab has to be one segment
     IODMACommand::Segment64 seg;
     UInt64 offset = 0;
     UInt32 seg_num = 1;
-    if (cmd->gen64IOVMSegments(&offset, &seg, &seg_num) != kIOReturnSuccess) {
-        OSSafeReleaseNULL(cmd);
-        buf->complete();
-        OSSafeReleaseNULL(buf);
-        return kIOReturnNoMemory;
+    if (dma_cmd->gen64IOVMSegments(&offset, &seg, &seg_num) != kIOReturnSuccess || seg.fLength < size) {
+        LOG("DMA slab is not contiguous");
+        return kIOReturnNoResources;
     }
-    info->paddr = seg.fIOVMAddr;
-    info->vaddr = buf->getBytesNoCopy();
-    info->len = size;
-    info->buffer = buf;
-    info->dma_cmd = cmd;
-
+    dma_slab_paddr = seg.fIOVMAddr;
+    
     return kIOReturnSuccess;
 }
 
 IOReturn IntelPreciseTouchStylusDriver::allocateDMAResources(UInt32 dbuff_size, UInt32 fbuff_size)
 {
-    for (int i = 0; i < IPTS_BUFFER_NUM; i++) {
-        if (allocateDMAMemory(rx_buffer+i, dbuff_size) != kIOReturnSuccess)
-            goto release_resources;
+    UInt32 slot_size = (dbuff_size + 63) & ~63;
+    UInt32 data_offset = (sizeof(IPTSFrameRing) + 63) & ~63;
+    UInt32 slab_size = 0;
+    
+    if (frame_queue.getRing()) {
+        // buffers kept from the last power cycle can be handed to the ME again if it still wants the same sizes
+        if (dbuff_size == dma_data_size && fbuff_size == dma_feedback_size) {
+            DBG_LOG("Reusing DMA buffers");
+            memset(doorbell_buffer.vaddr, 0, doorbell_buffer.len);
+            memset(workqueue_buffer.vaddr, 0, workqueue_buffer.len);
+            goto init_ring;
+        }
+        DBG_LOG("Buffer sizes changed, reallocating DMA buffers");
+        if (mem_window_set) {
+            // the ME was never told to forget the old buffers, keep them alive for good like stop does
+            LOG("Memory window was not cleared, leaking %u bytes of DMA buffers", static_cast<UInt32>(dma_slab->getLength()));
+            dma_slab->retain();
+        }
+        freeDMAResources();
     }
-
+    
+    // receive buffers are mapped into user space one by one, so they must not share a page with anything else
+    for (int i = 0; i < IPTS_BUFFER_NUM; i++)
+        reserveDMAMemory(rx_buffer+i, dbuff_size, PAGE_SIZE, &slab_size);
+    slab_size = (slab_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    for (int i = 0; i < IPTS_BUFFER_NUM; i++)
+        reserveDMAMemory(feedback_buffer+i, fbuff_size, 64, &slab_size);
+    reserveDMAMemory(&doorbell_buffer, sizeof(UInt32), 64, &slab_size);
+    reserveDMAMemory(&workqueue_buffer, sizeof(UInt32), 64, &slab_size);
+    reserveDMAMemory(&tx_buffer, fbuff_size, 64, &slab_size);
+    reserveDMAMemory(&report_desc_buffer, dbuff_size + 8, 64, &slab_size);
+    
+    if (allocateDMASlab(slab_size) != kIOReturnSuccess)
+        goto release_resources;
+    
     for (int i = 0; i < IPTS_BUFFER_NUM; i++) {
-        if (allocateDMAMemory(feedback_buffer+i, fbuff_size) != kIOReturnSuccess)
+        if (mapDMAMemory(rx_buffer+i, true) != kIOReturnSuccess)
             goto release_resources;
+        mapDMAMemory(feedback_buffer+i);
     }
-
-    if (allocateDMAMemory(&doorbell_buffer, sizeof(UInt32)) != kIOReturnSuccess ||
-        allocateDMAMemory(&workqueue_buffer, sizeof(UInt32)) != kIOReturnSuccess ||
-        allocateDMAMemory(&tx_buffer, fbuff_size) != kIOReturnSuccess ||
-        allocateDMAMemory(&report_desc_buffer, dbuff_size + 8) != kIOReturnSuccess)
-        goto release_resources;
+    mapDMAMemory(&doorbell_buffer);
+    mapDMAMemory(&workqueue_buffer);
+    mapDMAMemory(&tx_buffer);
+    mapDMAMemory(&report_desc_buffer);
     
-    input_buffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryKernelUserShared | kIOMapInhibitCache, dbuff_size, DMA_BIT_MASK(64));
+    // the frame ring is never touched by the ME, only the daemon scanning whole heatmaps out of it
+    // benefits from a cached mapping, publishFrame orders the slot against the head with a barrier
+    if (cacheable_ring)
+        input_buffer = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared, data_offset + IPTS_FRAME_RING_SIZE * slot_size, PAGE_SIZE);
+    else
+        input_buffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryKernelUserShared | kIOMapInhibitCache, data_offset + IPTS_FRAME_RING_SIZE * slot_size, DMA_BIT_MASK(64));
     if (!input_buffer)
         goto release_resources;
     input_buffer->prepare();
+    dma_data_size = dbuff_size;
+    dma_feedback_size = fbuff_size;
+    
+init_ring:
+    frame_queue.reset(reinterpret_cast<IPTSFrameRing *>(input_buffer->getBytesNoCopy()), slot_size, data_offset);
+    feedback_outstanding = 0;
+    feedback_retry = 0;
+    quiesce_pending = 0;
+    memset(owned_time, 0, sizeof(owned_time));
 
     return kIOReturnSuccess;
 release_resources:
@@ -743,44 +2203,43 @@ release_resources:
     return kIOReturnNoMemory;
 }
 
-void IntelPreciseTouchStylusDriver::freeDMAMemory(IPTSBufferInfo *info, bool keep_ref) {
-    info->dma_cmd->clearMemoryDescriptor();
-    OSSafeReleaseNULL(info->dma_cmd);
-    info->buffer->complete();
-    if (keep_ref)
-        info->buffer->release();    // maybe still hold by client, so needed when client wants to release them
-    else
-        OSSafeReleaseNULL(info->buffer);
-    info->vaddr = nullptr;
-    info->paddr = 0;
+IOReturn IntelPreciseTouchStylusDriver::allocateDMAResourcesGated(UInt32 *dbuff_size, UInt32 *fbuff_size) {
+    return allocateDMAResources(*dbuff_size, *fbuff_size);
 }
 
 void IntelPreciseTouchStylusDriver::freeDMAResources()
 {
-    IPTSBufferInfo *buffers = rx_buffer;
+    // clients may still hold the receive buffers, their sub descriptors keep the slab alive until unmapped
     for (int i = 0; i < IPTS_BUFFER_NUM; i++) {
-        if (!buffers[i].vaddr)
-            continue;
-        freeDMAMemory(buffers+i, true);
+        OSSafeReleaseNULL(rx_buffer[i].buffer);
+        memset(rx_buffer+i, 0, sizeof(IPTSBufferInfo));
+        memset(feedback_buffer+i, 0, sizeof(IPTSBufferInfo));
     }
-    buffers = feedback_buffer;
-    for (int i = 0; i < IPTS_BUFFER_NUM; i++) {
-        if (!buffers[i].vaddr)
-            continue;
-        freeDMAMemory(buffers+i);
+    memset(&doorbell_buffer, 0, sizeof(IPTSBufferInfo));
+    memset(&workqueue_buffer, 0, sizeof(IPTSBufferInfo));
+    memset(&tx_buffer, 0, sizeof(IPTSBufferInfo));
+    memset(&report_desc_buffer, 0, sizeof(IPTSBufferInfo));
+    
+    if (dma_cmd) {
+        dma_cmd->clearMemoryDescriptor();
+        OSSafeReleaseNULL(dma_cmd);
     }
-
-    if (doorbell_buffer.vaddr)
-        freeDMAMemory(&doorbell_buffer);
-    if (workqueue_buffer.vaddr)
-        freeDMAMemory(&workqueue_buffer);
-    if (tx_buffer.vaddr)
-        freeDMAMemory(&tx_buffer);
-    if (report_desc_buffer.vaddr)
-        freeDMAMemory(&report_desc_buffer);
+    if (dma_slab) {
+        dma_slab->complete();
+        OSSafeReleaseNULL(dma_slab);
+    }
+    dma_slab_paddr = 0;
     
+    frame_queue.reset(nullptr, 0, 0);
+    dma_data_size = 0;
+    dma_feedback_size = 0;
     if (input_buffer) {
         input_buffer->complete();
         OSSafeReleaseNULL(input_buffer);
     }
 }
+
+IOReturn IntelPreciseTouchStylusDriver::freeDMAResourcesGated() {
+    freeDMAResources();
+    return kIOReturnSuccess;
+}
@@ -9,8 +9,16 @@
 #ifndef IntelPreciseTouchStylusDriver_hpp
 #define IntelPreciseTouchStylusDriver_hpp
 
+#include <libkern/OSAtomic.h>
+#include <IOKit/IOSubMemoryDescriptor.h>
+
 #include "../../../../BigSurface/BigSurface/SurfaceManagementEngine/SurfaceManagementEngineClient.hpp"
 #include "IPTSProtocol.h"
+#include "IPTSContactDetector.hpp"
+#include "IPTSStylusDecoder.hpp"
+#include "IPTSPollScheduler.hpp"
+#include "IPTSFrameQueue.hpp"
+#include "IPTSDoorbell.hpp"
 
 enum IPTSDeviceState {
     IPTSDeviceStateStarting,
@@ -19,12 +27,72 @@ enum IPTSDeviceState {
     IPTSDeviceStateStopped,
 };
 
+#define IPTS_REPORT_QUEUE_SIZE  32
+
+struct IPTSQueuedReport {
+    UInt64 frame_time;
+    UInt32 sequence;
+    UInt64 queue_time;
+    UInt32 size;
+    IPTSHIDReport report;
+};
+
+#define IPTS_FEATURE_REQUEST_NUM    4
+#define IPTS_FEATURE_TIMEOUT        500     // ms
+
+#define IPTS_TX_ACKED               (1 << 0)
+#define IPTS_TX_REJECTED            (1 << 1)
+
+enum IPTSFeatureRequestState {
+    IPTSFeatureRequestFree,
+    IPTSFeatureRequestQueued,       // waiting for the tx buffer
+    IPTSFeatureRequestSent,         // in the tx buffer
+    IPTSFeatureRequestWaiting,      // the ME took the tx buffer, waiting for the report
+};
+
+typedef void (*FeatureHandler)(OSObject *target, void *context, IOReturn status, const UInt8 *report, UInt16 size);
+
+/*
+ * GET_FEATURE and SET_FEATURE requests and sensor commands share the single tx buffer, so they are queued and
+ * sent one at a time. A get request only holds the tx buffer until the ME has taken it, the report is matched
+ * by its id later.
+ */
+struct IPTSFeatureRequest {
+    IPTSFeatureRequestState state;
+    IPTSFeedbackCommandType command;
+    IPTSFeedbackDataType type;
+    UInt8  report_id;
+    UInt8  value;       // set features only
+    UInt16 size;        // get features only
+    UInt32 order;
+    UInt64 deadline;
+    OSObject *target;
+    FeatureHandler handler;
+    void *context;      // an IPTSFeatureWait when there is no handler
+};
+
+struct IPTSFeatureWait {
+    IOReturn status;
+    UInt8 *report;
+    UInt16 size;
+};
+
+// @return kIOReturnSuccess once @frame was passed on to the client
+typedef IOReturn (*InputHandler)(OSObject *target, UInt64 *frame);
+
+struct IPTSInputClient {
+    OSObject *target;       // nullptr while the entry is free
+    InputHandler handler;   // set while the client is notified of frames instead of waiting for them
+    UInt32 cursor;          // of the client in the frame queue
+};
+
+// A view onto the DMA slab, buffer is only created for receive buffers shared with user space
 struct IPTSBufferInfo {
-    IOBufferMemoryDescriptor* buffer;
-    IODMACommand* dma_cmd;
+    IOMemoryDescriptor* buffer;
     void*  vaddr;
-    UInt16 len;
-    IOPhysicalAddress paddr;
+    UInt32 offset;
+    UInt32 len;
+    UInt64 paddr;
 };
 
 class SurfaceTouchScreenDevice;
@@ -42,19 +110,38 @@ public:
     IOReturn setPowerState(unsigned long whichState, IOService *whatDevice) override;
     
     IOBufferMemoryDescriptor *getReceiveBuffer();
+    IOMemoryDescriptor *getRxBuffer(UInt32 index);
     
     IOReturn getDeviceInfo(IPTSDeviceInfo *info);
     
-    IOReturn waitInput(UInt64 *size);
+    // @handler is called on the work loop once the report arrived or the request failed, @report is only valid during the call
+    IOReturn requestFeatureReport(UInt8 report_id, UInt16 size, OSObject *target, FeatureHandler handler, void *context);
+    
+    IOReturn attachClient(OSObject *target, bool primary);
+    void detachClient(OSObject *target);
+    
+    IOReturn waitInput(OSObject *target, UInt64 *output);
+    
+    IOReturn registerInputHandler(OSObject *target, InputHandler handler);
+    void unregisterInputHandler(OSObject *target);
     
     void enterMultitouch();
     void exitMultitouch();
     
     void handleHIDReport(const IPTSHIDReport *report);
+    IOReturn handleHIDReports(const IPTSHIDReport *reports, UInt32 count, UInt32 sequence, UInt64 *accepted);
     
     void processingStarted();
     void processingEnded();
     
+    IOReturn setOption(UInt32 option, UInt64 value);
+    
+    IOReturn getLatencyStatistics(IPTSLatencyStatistics *stats);
+    IOReturn getStatistics(IPTSPipelineStatistics *stats);
+    
+    IOReturn readTrace(IOMemoryDescriptor *output, UInt64 *written);
+    IOReturn replayTrace(IOMemoryDescriptor *input, bool realtime, UInt64 *replayed);
+    
 private:
     SurfaceManagementEngineClient*  api {nullptr};
     
@@ -62,35 +149,98 @@ private:
     IOCommandGate*              command_gate {nullptr};
     IOCommandGate::Action       wait_input {nullptr};
     IOCommandGate::Action       handle_report {nullptr};
+    IOCommandGate::Action       toggle_processing {nullptr};
     IOInterruptEventSource*     report_interrupt {nullptr};
     IOInterruptEventSource*     status_interrupt {nullptr};
+    IOInterruptEventSource*     feature_interrupt {nullptr};
     IOTimerEventSource*         timer {nullptr};
+    IOLock*                     stop_lock {nullptr};
 
     SurfaceTouchScreenDevice*   touch_screen {nullptr};
     bool touch_screen_started   {false};
     
     IPTSDeviceState state {IPTSDeviceStateStopped};
     bool awake {true};
-    bool busy {false};
     bool restart {false};
     
-    UInt32 current_doorbell {0};
-    AbsoluteTime last_activate;
+    IPTSDoorbell doorbell;
+    IPTSPollScheduler poll_scheduler;
+    bool keep_dma_memory {false};
+    bool cacheable_ring {false};
+    UInt32 doze_timeout {0};    // ms without frames before the sensor is sent to doze, 0 to never doze
+    bool dozing {false};
+    UInt64 wake_time {0};    // estimated arrival of the touch that woke the sensor, until its report is dispatched
+    UInt32 wake_sequence {IPTS_FRAME_SEQUENCE_INVALID};
+    UInt64 awake_latency {0};   // running average of the total latency while the sensor is awake
+    
+    UInt64 coalesced_frames {0};
+    UInt64 doze_entries {0};
+    UInt64 malformed_frames {0};
+    
+    // FEEDBACK responses arrive outside the work loop, so the masks are only touched atomically
+    volatile UInt32 feedback_outstanding {0};
+    volatile UInt32 feedback_retry {0};
+    volatile SInt64 feedback_retries {0};
+    volatile UInt32 quiesce_pending {0};
+    UInt8 quiesce_retries[IPTS_TX_BUFFER + 1] {};   // per buffer, a slow one must not use up the budget of the rest
+    UInt64 owned_time[IPTS_BUFFER_NUM];
     
     bool wait {false};
-    bool get_feature {false};
-    UInt8 *feature_report {nullptr};
+    
+    IPTSFeatureRequest feature_requests[IPTS_FEATURE_REQUEST_NUM];
+    UInt32 feature_order {0};
+    UInt32 feature_pending {0};
+    bool tx_busy {false};
+    UInt64 tx_deadline {0};
+    volatile UInt32 tx_events {0};
     
     IPTSTouchMode mode {IPTSModeDoorbell};
     bool multitouch {false};
+    UInt32 stall_timeout {0};   // ms the daemon may sit on its frames before falling back to single touch, 0 to wait forever
+    bool daemon_stalled {false};
+    UInt64 daemon_progress {0};
+    UInt64 stall_start {0};
+    UInt64 daemon_stalls {0};
+    
+    IPTSDeviceMetaData metadata;
+    bool metadata_valid {false};
+    
+    IPTSContactDetector *contact_detector {nullptr};
+    UInt32 detected_ids {0};
+    UInt32 lifted_ids {0};      // lift-offs still to be reported
+    bool decode_stylus {false};
     
-    UInt16 input_size {0};
     IOBufferMemoryDescriptor *input_buffer {nullptr};
+    IPTSFrameQueue frame_queue;
+    IPTSInputClient input_clients[IPTS_INPUT_CLIENT_NUM] {};
+    UInt32 replay_sequence {0};
+    UInt32 current_sequence {0};    // of the frame being handled
+    UInt32 delivered_sequence {0};
+    UInt32 reported_sequence {0};
+    UInt32 dispatched_sequence {0};
+    UInt64 replayed_frames {0};
+    UInt64 notification_failures {0};
+    UInt64 delivered_frames {0};
+    UInt64 reported_frames {0};
+    UInt64 rejected_reports {0};
+    UInt64 poll_time {0};
+    UInt64 delivered_time {0};
+    UInt64 wakeup_time {0};
+    IPTSLatencyStatistics latency {};
     bool daemon_processing {false};
-    bool daemon_handled {true};
+    bool zero_copy {false};
+    
+    UInt8 *trace_buffer {nullptr};
+    UInt32 trace_head {0};
+    UInt32 trace_tail {0};
+    UInt64 trace_drops {0};
     
     IOBufferMemoryDescriptor *report_to_send {nullptr};
-    bool sent {true};
+    IPTSQueuedReport report_queue[IPTS_REPORT_QUEUE_SIZE];
+    UInt32 report_head {0};
+    UInt32 report_tail {0};
+    UInt64 touch_overflows {0};
+    UInt64 stylus_overflows {0};
     
     IPTSBufferInfo rx_buffer[IPTS_BUFFER_NUM];
     IPTSBufferInfo feedback_buffer[IPTS_BUFFER_NUM];
@@ -98,13 +248,35 @@ private:
     IPTSBufferInfo workqueue_buffer;
     IPTSBufferInfo tx_buffer;
     IPTSBufferInfo report_desc_buffer;
+    IOBufferMemoryDescriptor *dma_slab {nullptr};
+    IODMACommand *dma_cmd {nullptr};
+    UInt64 dma_slab_paddr {0};
+    UInt32 dma_data_size {0};
+    UInt32 dma_feedback_size {0};
+    bool mem_window_set {false};    // the ME knows the addresses of the buffers and may write into them
     
     void releaseResources();
       
+    UInt64 getUptimeNS();
+    void scheduleNextPoll(UInt64 now, UInt32 frames);
     void pollTouchData(IOTimerEventSource* sender);
+    void checkDaemonStall(UInt64 now);
+    void noteDaemonProgress();
+    void endDaemonStall(UInt64 now);
+    bool daemonActive() { return multitouch && !daemon_stalled; }
+    bool isDaemonFrame(UInt32 buffer, IPTSFrameClass *frame_class);
+    bool handleBuffer(UInt32 buffer, UInt32 sequence, bool deliver);
+    bool handleData(IPTSDataHeader *header, UInt32 buffer, bool deliver);
+    void publishStatistics();
+    void recordLatency(IPTSLatencyStage stage, UInt64 nsecs);
+    UInt64 getLatencyPercentile(IPTSLatencyStage stage, UInt32 percent);
+    void publishLatency();
     
     IOReturn startDevice();
     void stopDevice();
+    bool waitForStop(UInt32 timeout_ms);
+    void setStopped();
+    IOReturn flushBuffers();
     void restartDevice();
     
     IOReturn sendIPTSCommand(UInt32 code, UInt8 *data, UInt16 data_len, bool blocking = true);
@@ -112,22 +284,82 @@ private:
     
     IOReturn sendGetFeatureRequest(UInt8 report_id, UInt8 *report, UInt16 size);
     IOReturn sendSetFeatureReport(UInt8 report_id, UInt8 value);
+    IOReturn sendSensorCommand(IPTSFeedbackCommandType command);
     
     IOReturn refillBuffer(UInt32 buffer, bool blocking = true);
+    void refillBuffers(UInt32 mask);
+    void completeFeedback(UInt32 buffer, bool rejected);
+    void retryFeedback();
+    void retryQuiesceFeedback(UInt32 buffer);
     
-    IOReturn allocateDMAMemory(IPTSBufferInfo *info, UInt32 size);
+    void reserveDMAMemory(IPTSBufferInfo *info, UInt32 size, UInt32 alignment, UInt32 *slab_size);
+    IOReturn mapDMAMemory(IPTSBufferInfo *info, bool shared = false);
+    IOReturn allocateDMASlab(UInt32 size);
     IOReturn allocateDMAResources(UInt32 dbuff_size, UInt32 fbuff_size);
-    void freeDMAMemory(IPTSBufferInfo *info, bool keep_ref = false);
+    IOReturn allocateDMAResourcesGated(UInt32 *dbuff_size, UInt32 *fbuff_size);
     void freeDMAResources();
+    IOReturn freeDMAResourcesGated();
     
     void handleMessage(SurfaceManagementEngineClient *sender, UInt8 *msg, UInt16 msg_len);
     bool isResponseError(IPTSResponse *rsp);
     
-    IOReturn waitInputGated(UInt64 *size);
+    void requestMetadata();
+    void cacheMetadata(const UInt8 *report, UInt32 size);
+    void storeMetadata(const UInt8 *data, UInt32 len);
+    IOReturn copyMetadataGated(IPTSDeviceMetaData *meta);
+    IOReturn invalidateMetadataGated();
+    void configureDetector();
+    bool splitFrame(const UInt8 *frame, UInt32 size, IPTSFrameClass *frame_class);
+    bool classifyFrame(const UInt8 *frame, UInt32 size, IPTSFrameClass *frame_class);
+    bool detectContacts(const UInt8 *data, UInt32 len);
+    void decodeStylus(const UInt8 *reports, UInt32 len, UInt16 scan_time);
+    
+    UInt8 *acquireFrameSlot(IPTSFrameClass frame_class);
+    void publishFrame(UInt32 size, UInt32 buffer = IPTS_FRAME_IN_SLOT, UInt32 offset = 0);
+    void releaseFrames();
+    
+    IOReturn getReceiveBufferGated(IOBufferMemoryDescriptor **buffer);
+    IOReturn getRxBufferGated(UInt32 *index, IOMemoryDescriptor **buffer);
+    IPTSInputClient *findInputClient(OSObject *target);
+    IOReturn attachClientGated(OSObject *target, bool *primary);
+    IOReturn detachClientGated(OSObject *target);
+    // @return false if the device is offline, @frame tells the client so
+    bool peekFrame(IPTSInputClient *client, UInt64 *frame);
+    void consumeFrame(IPTSInputClient *client, UInt64 *frame);
+    void deliverFrame(IPTSInputClient *client, UInt64 *frame);
+    // @return true if the next frame was handed to the input handler of @client
+    bool notifyFrame(IPTSInputClient *client);
+    // Notify @client of the frames waiting for it, the primary of one at a time
+    void notifyFrames(IPTSInputClient *client);
+    IOReturn waitInputGated(OSObject *target, UInt64 *output);
+    IOReturn registerInputHandlerGated(OSObject *target, InputHandler handler);
+    IOReturn unregisterInputHandlerGated(OSObject *target);
+    IOReturn notifyOfflineGated();
+    IOReturn toggleProcessingGated(bool *processing);
+    IOReturn setOptionGated(UInt32 *option, UInt64 *value);
+    IOReturn getLatencyStatisticsGated(IPTSLatencyStatistics *stats);
+    void writeTrace(const void *data, UInt32 len);
+    void peekTrace(void *data, UInt32 len);
+    void recordTrace(IPTSDataHeader *header, UInt32 buffer);
+    IOReturn readTraceGated(IOMemoryDescriptor *output, UInt64 *written);
+    IOReturn replayDataGated(IPTSDataHeader *header);
+    UInt32 getHIDReportSize(UInt8 report_id);
+    void enqueueReport(const IPTSHIDReport *report, UInt32 size, UInt64 frame, UInt32 sequence);
+    void noteReported(UInt32 sequence);
+    void flushReports();
     IOReturn handleHIDReportGated(IPTSHIDReport *report);
-    IOReturn getFeatureRequestGated(UInt8* report_id, UInt16* size);
+    IOReturn handleHIDReportsGated(IPTSHIDReport *reports, UInt32 *count, UInt32 *sequence, UInt64 *accepted);
+    IOReturn getStatisticsGated(IPTSPipelineStatistics *stats);
+    IOReturn getFeatureRequestGated(UInt8 *report_id, IPTSFeatureWait *waiter);
+    IOReturn submitFeatureRequestGated(IPTSFeatureRequest *request);
+    void sendNextFeatureRequest();
+    void finishFeatureRequest(UInt32 index, IOReturn status, const UInt8 *report, UInt16 size);
+    void matchFeatureReport(const UInt8 *report, UInt16 size);
+    void expireFeatureRequests(UInt64 now);
+    IOReturn abortFeatureRequestsGated();
     void handleInterruptReport(IOInterruptEventSource *sender, int count);
     void handleInterruptStatus(IOInterruptEventSource *sender, int count);
+    void handleInterruptFeature(IOInterruptEventSource *sender, int count);
 };
 
 #endif /* IntelPreciseTouchStylusDriver_hpp */
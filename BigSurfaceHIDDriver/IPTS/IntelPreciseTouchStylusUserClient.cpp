@@ -23,7 +23,7 @@ const IOExternalMethodDispatch IntelPreciseTouchStylusUserClient::methods[kNumbe
         .function = (IOExternalMethodAction)&IntelPreciseTouchStylusUserClient::sMethodReceiveInput,
         .checkScalarInputCount = 0,
         .checkStructureInputSize = 0,
-        .checkScalarOutputCount = 1,
+        .checkScalarOutputCount = 4,
         .checkStructureOutputSize = 0,
     },
     [kMethodSendHIDReport] = {
@@ -40,6 +40,55 @@ const IOExternalMethodDispatch IntelPreciseTouchStylusUserClient::methods[kNumbe
         .checkScalarOutputCount = 0,
         .checkStructureOutputSize = 0,
     },
+    [kMethodSetOption] = {
+        .function = (IOExternalMethodAction)&IntelPreciseTouchStylusUserClient::sMethodSetOption,
+        .checkScalarInputCount = 2,
+        .checkStructureInputSize = 0,
+        .checkScalarOutputCount = 0,
+        .checkStructureOutputSize = 0,
+    },
+    [kMethodSendHIDReports] = {
+        .function = (IOExternalMethodAction)&IntelPreciseTouchStylusUserClient::sMethodSendHIDReports,
+        .checkScalarInputCount = kIOUCVariableStructureSize,
+        .checkStructureInputSize = kIOUCVariableStructureSize,
+        .checkScalarOutputCount = 1,
+        .checkStructureOutputSize = 0,
+    },
+    [kMethodRegisterInputNotification] = {
+        .function = (IOExternalMethodAction)&IntelPreciseTouchStylusUserClient::sMethodRegisterInputNotification,
+        .checkScalarInputCount = 1,
+        .checkStructureInputSize = 0,
+        .checkScalarOutputCount = 0,
+        .checkStructureOutputSize = 0,
+    },
+    [kMethodGetLatencyStatistics] = {
+        .function = (IOExternalMethodAction)&IntelPreciseTouchStylusUserClient::sMethodGetLatencyStatistics,
+        .checkScalarInputCount = 0,
+        .checkStructureInputSize = 0,
+        .checkScalarOutputCount = 0,
+        .checkStructureOutputSize = sizeof(IPTSLatencyStatistics),
+    },
+    [kMethodReadTrace] = {
+        .function = (IOExternalMethodAction)&IntelPreciseTouchStylusUserClient::sMethodReadTrace,
+        .checkScalarInputCount = 0,
+        .checkStructureInputSize = 0,
+        .checkScalarOutputCount = 1,
+        .checkStructureOutputSize = kIOUCVariableStructureSize,
+    },
+    [kMethodReplayTrace] = {
+        .function = (IOExternalMethodAction)&IntelPreciseTouchStylusUserClient::sMethodReplayTrace,
+        .checkScalarInputCount = 1,
+        .checkStructureInputSize = kIOUCVariableStructureSize,
+        .checkScalarOutputCount = 1,
+        .checkStructureOutputSize = 0,
+    },
+    [kMethodGetStatistics] = {
+        .function = (IOExternalMethodAction)&IntelPreciseTouchStylusUserClient::sMethodGetStatistics,
+        .checkScalarInputCount = 0,
+        .checkStructureInputSize = 0,
+        .checkScalarOutputCount = 0,
+        .checkStructureOutputSize = sizeof(IPTSPipelineStatistics),
+    },
 };
 
 IOReturn IntelPreciseTouchStylusUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch, OSObject *target, void *reference) {
@@ -52,7 +101,11 @@ IOReturn IntelPreciseTouchStylusUserClient::externalMethod(uint32_t selector, IO
 }
 
 IOReturn IntelPreciseTouchStylusUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) {
-    IOMemoryDescriptor *desc = driver->getReceiveBuffer();
+    IOMemoryDescriptor *desc;
+    if (type >= kIPTSMemoryTypeRxBuffer)
+        desc = driver->getRxBuffer(type - kIPTSMemoryTypeRxBuffer);
+    else
+        desc = driver->getReceiveBuffer();
     if (!desc)
         return kIOReturnError;
     
@@ -64,10 +117,13 @@ IOReturn IntelPreciseTouchStylusUserClient::clientMemoryForType(UInt32 type, IOO
 bool IntelPreciseTouchStylusUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) {
     if (!owningTask)
         return false;
+    if (type != kIPTSClientTypePrimary && type != kIPTSClientTypeObserver)
+        return false;
     if (!super::initWithTask(owningTask, securityToken, type))
         return false;
     
     task = owningTask;
+    primary = type == kIPTSClientTypePrimary;
     return true;
 }
 
@@ -79,11 +135,20 @@ bool IntelPreciseTouchStylusUserClient::start(IOService *provider) {
     if (!driver)
         return false;
     
+    // a second primary client is turned away, so is anyone once every cursor is taken
+    if (driver->attachClient(this, primary) != kIOReturnSuccess)
+        return false;
     return true;
 }
 
 void IntelPreciseTouchStylusUserClient::stop(IOService* provider) {
-    driver->exitMultitouch();
+    if (input_notify) {
+        driver->unregisterInputHandler(this);
+        input_notify = false;
+    }
+    driver->detachClient(this);
+    if (primary)
+        driver->exitMultitouch();
     super::stop(provider);
 }
 
@@ -112,11 +177,11 @@ IOReturn IntelPreciseTouchStylusUserClient::sMethodReceiveInput(OSObject *target
 }
 
 IOReturn IntelPreciseTouchStylusUserClient::receiveInput(void *ref, IOExternalMethodArguments *args) {
-    if (initial) {
+    if (initial && primary) {
         driver->enterMultitouch();
         initial = false;
     }
-    return driver->waitInput(args->scalarOutput);
+    return driver->waitInput(this, args->scalarOutput);
 }
 
 IOReturn IntelPreciseTouchStylusUserClient::sMethodSendHIDReport(OSObject *target, void *ref, IOExternalMethodArguments *args) {
@@ -127,6 +192,8 @@ IOReturn IntelPreciseTouchStylusUserClient::sMethodSendHIDReport(OSObject *targe
 }
 
 IOReturn IntelPreciseTouchStylusUserClient::sendHIDReport(void *ref, IOExternalMethodArguments *args) {
+    if (!primary)
+        return kIOReturnNotPrivileged;
     driver->handleHIDReport(reinterpret_cast<const IPTSHIDReport *>(args->structureInput));
     return kIOReturnSuccess;
 }
@@ -139,9 +206,179 @@ IOReturn IntelPreciseTouchStylusUserClient::sMethodToggleProcessingStatus(OSObje
 }
 
 IOReturn IntelPreciseTouchStylusUserClient::toggleProcessingStatus(void *ref, IOExternalMethodArguments *args) {
+    // observers never hold frames, there is nothing for them to release
+    if (!primary)
+        return kIOReturnSuccess;
     if (args->scalarInput[0])
         driver->processingStarted();
     else
         driver->processingEnded();
     return kIOReturnSuccess;
 }
+
+IOReturn IntelPreciseTouchStylusUserClient::sMethodSetOption(OSObject *target, void *ref, IOExternalMethodArguments *args) {
+    IntelPreciseTouchStylusUserClient *that = OSDynamicCast(IntelPreciseTouchStylusUserClient, target);
+    if (!that)
+        return kIOReturnError;
+    return that->setOption(ref, args);
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::setOption(void *ref, IOExternalMethodArguments *args) {
+    if (!primary)
+        return kIOReturnNotPrivileged;
+    return driver->setOption(static_cast<UInt32>(args->scalarInput[0]), args->scalarInput[1]);
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::sMethodSendHIDReports(OSObject *target, void *ref, IOExternalMethodArguments *args) {
+    IntelPreciseTouchStylusUserClient *that = OSDynamicCast(IntelPreciseTouchStylusUserClient, target);
+    if (!that)
+        return kIOReturnError;
+    return that->sendHIDReports(ref, args);
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::sendHIDReports(void *ref, IOExternalMethodArguments *args) {
+    if (!primary)
+        return kIOReturnNotPrivileged;
+    UInt32 count = args->structureInputSize / sizeof(IPTSHIDReport);
+    if (!args->structureInput || !count || count > IPTS_HID_REPORT_BATCH_MAX || args->structureInputSize % sizeof(IPTSHIDReport))
+        return kIOReturnBadArgument;
+    if (args->scalarInputCount > 1)
+        return kIOReturnBadArgument;
+    UInt32 sequence = args->scalarInputCount ? static_cast<UInt32>(args->scalarInput[0]) : 0;
+    return driver->handleHIDReports(reinterpret_cast<const IPTSHIDReport *>(args->structureInput), count, sequence, args->scalarOutput);
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::handleInput(OSObject *target, UInt64 *frame) {
+    IntelPreciseTouchStylusUserClient *that = OSDynamicCast(IntelPreciseTouchStylusUserClient, target);
+    if (!that || !that->input_notify)
+        return kIOReturnNotReady;
+    return sendAsyncResult64(that->input_ref, kIOReturnSuccess, frame, 4);
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::sMethodRegisterInputNotification(OSObject *target, void *ref, IOExternalMethodArguments *args) {
+    IntelPreciseTouchStylusUserClient *that = OSDynamicCast(IntelPreciseTouchStylusUserClient, target);
+    if (!that)
+        return kIOReturnError;
+    return that->registerInputNotification(ref, args);
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::registerInputNotification(void *ref, IOExternalMethodArguments *args) {
+    if (!args->scalarInput[0]) {
+        if (input_notify) {
+            driver->unregisterInputHandler(this);
+            input_notify = false;
+        }
+        return kIOReturnSuccess;
+    }
+    
+    if (!args->asyncWakePort)
+        return kIOReturnBadArgument;
+    bcopy(args->asyncReference, input_ref, sizeof(OSAsyncReference64));
+    input_notify = true;
+    
+    IOReturn ret = driver->registerInputHandler(this, &IntelPreciseTouchStylusUserClient::handleInput);
+    if (ret != kIOReturnSuccess) {
+        input_notify = false;
+        return ret;
+    }
+    if (initial && primary) {
+        driver->enterMultitouch();
+        initial = false;
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::sMethodGetLatencyStatistics(OSObject *target, void *ref, IOExternalMethodArguments *args) {
+    IntelPreciseTouchStylusUserClient *that = OSDynamicCast(IntelPreciseTouchStylusUserClient, target);
+    if (!that)
+        return kIOReturnError;
+    return that->getLatencyStatistics(ref, args);
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::getLatencyStatistics(void *ref, IOExternalMethodArguments *args) {
+    return driver->getLatencyStatistics(reinterpret_cast<IPTSLatencyStatistics *>(args->structureOutput));
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::sMethodReadTrace(OSObject *target, void *ref, IOExternalMethodArguments *args) {
+    IntelPreciseTouchStylusUserClient *that = OSDynamicCast(IntelPreciseTouchStylusUserClient, target);
+    if (!that)
+        return kIOReturnError;
+    return that->readTrace(ref, args);
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::readTrace(void *ref, IOExternalMethodArguments *args) {
+    IOMemoryDescriptor *output;
+    IOReturn ret;
+    
+    if (!primary)
+        return kIOReturnNotPrivileged;
+    
+    // large reads come in as a descriptor, small ones as a kernel copy of the structure
+    if (args->structureOutputDescriptor) {
+        output = args->structureOutputDescriptor;
+        output->retain();
+    } else {
+        output = IOMemoryDescriptor::withAddress(args->structureOutput, args->structureOutputSize, kIODirectionIn);
+        if (!output)
+            return kIOReturnNoMemory;
+    }
+    
+    ret = output->prepare();
+    if (ret == kIOReturnSuccess) {
+        ret = driver->readTrace(output, args->scalarOutput);
+        output->complete();
+    }
+    OSSafeReleaseNULL(output);
+    
+    if (ret != kIOReturnSuccess)
+        args->scalarOutput[0] = 0;
+    if (args->structureOutputDescriptor)
+        args->structureOutputDescriptorSize = static_cast<UInt32>(args->scalarOutput[0]);
+    else
+        args->structureOutputSize = static_cast<UInt32>(args->scalarOutput[0]);
+    return ret;
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::sMethodReplayTrace(OSObject *target, void *ref, IOExternalMethodArguments *args) {
+    IntelPreciseTouchStylusUserClient *that = OSDynamicCast(IntelPreciseTouchStylusUserClient, target);
+    if (!that)
+        return kIOReturnError;
+    return that->replayTrace(ref, args);
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::replayTrace(void *ref, IOExternalMethodArguments *args) {
+    IOMemoryDescriptor *input;
+    IOReturn ret;
+    
+    if (!primary)
+        return kIOReturnNotPrivileged;
+    
+    if (args->structureInputDescriptor) {
+        input = args->structureInputDescriptor;
+        input->retain();
+    } else if (args->structureInput) {
+        input = IOMemoryDescriptor::withAddress(const_cast<void *>(args->structureInput), args->structureInputSize, kIODirectionOut);
+        if (!input)
+            return kIOReturnNoMemory;
+    } else
+        return kIOReturnBadArgument;
+    
+    ret = input->prepare();
+    if (ret == kIOReturnSuccess) {
+        ret = driver->replayTrace(input, args->scalarInput[0] != 0, args->scalarOutput);
+        input->complete();
+    }
+    OSSafeReleaseNULL(input);
+    return ret;
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::sMethodGetStatistics(OSObject *target, void *ref, IOExternalMethodArguments *args) {
+    IntelPreciseTouchStylusUserClient *that = OSDynamicCast(IntelPreciseTouchStylusUserClient, target);
+    if (!that)
+        return kIOReturnError;
+    return that->getStatistics(ref, args);
+}
+
+IOReturn IntelPreciseTouchStylusUserClient::getStatistics(void *ref, IOExternalMethodArguments *args) {
+    return driver->getStatistics(reinterpret_cast<IPTSPipelineStatistics *>(args->structureOutput));
+}
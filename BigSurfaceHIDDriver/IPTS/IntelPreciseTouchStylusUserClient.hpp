@@ -33,16 +33,35 @@ private:
     IntelPreciseTouchStylusDriver*  driver {nullptr};
     task_t task {nullptr};
     bool initial {true};
+    bool primary {true};
+    OSAsyncReference64 input_ref;
+    bool input_notify {false};
+    
+    static IOReturn handleInput(OSObject *target, UInt64 *frame);
     
     static IOReturn sMethodGetDeviceInfo(OSObject *target, void *ref, IOExternalMethodArguments *args);
     static IOReturn sMethodReceiveInput(OSObject *target, void *ref, IOExternalMethodArguments *args);
     static IOReturn sMethodSendHIDReport(OSObject *target, void *ref, IOExternalMethodArguments *args);
     static IOReturn sMethodToggleProcessingStatus(OSObject *target, void *ref, IOExternalMethodArguments *args);
+    static IOReturn sMethodSetOption(OSObject *target, void *ref, IOExternalMethodArguments *args);
+    static IOReturn sMethodSendHIDReports(OSObject *target, void *ref, IOExternalMethodArguments *args);
+    static IOReturn sMethodRegisterInputNotification(OSObject *target, void *ref, IOExternalMethodArguments *args);
+    static IOReturn sMethodGetLatencyStatistics(OSObject *target, void *ref, IOExternalMethodArguments *args);
+    static IOReturn sMethodReadTrace(OSObject *target, void *ref, IOExternalMethodArguments *args);
+    static IOReturn sMethodReplayTrace(OSObject *target, void *ref, IOExternalMethodArguments *args);
+    static IOReturn sMethodGetStatistics(OSObject *target, void *ref, IOExternalMethodArguments *args);
     
     IOReturn getDeviceInfo(void *ref, IOExternalMethodArguments* args);
     IOReturn receiveInput(void *ref, IOExternalMethodArguments* args);
     IOReturn sendHIDReport(void *ref, IOExternalMethodArguments* args);
     IOReturn toggleProcessingStatus(void *ref, IOExternalMethodArguments* args);
+    IOReturn setOption(void *ref, IOExternalMethodArguments* args);
+    IOReturn sendHIDReports(void *ref, IOExternalMethodArguments* args);
+    IOReturn registerInputNotification(void *ref, IOExternalMethodArguments* args);
+    IOReturn getLatencyStatistics(void *ref, IOExternalMethodArguments* args);
+    IOReturn readTrace(void *ref, IOExternalMethodArguments* args);
+    IOReturn replayTrace(void *ref, IOExternalMethodArguments* args);
+    IOReturn getStatistics(void *ref, IOExternalMethodArguments* args);
 };
 
 #endif /* IntelPreciseTouchStylusUserClient_hpp */
@@ -0,0 +1,347 @@
+//
+//  ContactDetectorTest.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+//  Feeds IPTSContactDetector synthetic heatmaps. The fixtures are drawn here rather than recorded: a finger is a
+//  peak that halves with every cell of manhattan distance, a palm falls off slowly enough to cover its whole
+//  measuring window. Heatmap bytes are inverted like the sensor reports them, 0xFF is no touch.
+//
+
+#include <vector>
+
+#include "IPTSContactDetector.hpp"
+#include "TestFrames.h"
+#include "TestHarness.h"
+
+#define ROWS        44
+#define COLUMNS     64
+
+#define FLOAT_ONE           0x3F800000
+#define FLOAT_MINUS_ONE     0xBF800000
+
+struct TestHeatmap {
+    std::vector<UInt8> signal;
+
+    explicit TestHeatmap(UInt8 background = 0) : signal(ROWS * COLUMNS, background) {}
+
+    void finger(UInt32 row, UInt32 column, UInt8 peak) {
+        for (SInt32 r = 0; r < ROWS; r++) {
+            for (SInt32 c = 0; c < COLUMNS; c++) {
+                UInt32 distance = (r > (SInt32)row ? r - row : row - r) + (c > (SInt32)column ? c - column : column - c);
+                draw(r, c, distance < 8 ? peak >> distance : 0);
+            }
+        }
+    }
+
+    void palm(UInt32 row, UInt32 column, UInt8 peak) {
+        for (SInt32 r = 0; r < ROWS; r++) {
+            for (SInt32 c = 0; c < COLUMNS; c++) {
+                SInt32 distance = (r > (SInt32)row ? r - row : row - r) + (c > (SInt32)column ? c - column : column - c);
+                draw(r, c, peak - 8 * distance > 0 ? peak - 8 * distance : 0);
+            }
+        }
+    }
+
+    std::vector<UInt8> bytes() {
+        std::vector<UInt8> heatmap(signal.size());
+        for (size_t i = 0; i < signal.size(); i++)
+            heatmap[i] = 0xFF - signal[i];
+        return heatmap;
+    }
+
+private:
+    void draw(UInt32 row, UInt32 column, UInt32 value) {
+        UInt8 &cell = signal[row * COLUMNS + column];
+        if (value > cell)
+            cell = value > 0xFF ? 0xFF : value;
+    }
+};
+
+static UInt32 process(IPTSContactDetector *detector, TestHeatmap heatmap, IPTSContact *contacts) {
+    std::vector<UInt8> bytes = heatmap.bytes();
+    return detector->process(bytes.data(), contacts, IPTS_CONTACT_MAX_NUM);
+}
+
+static UInt16 logical(UInt32 cell, UInt32 cells) {
+    return cell * IPTS_CONTACT_LOGICAL_MAX / (cells - 1);
+}
+
+// within a tenth of a cell
+static bool near(UInt16 value, UInt16 expected, UInt32 cells) {
+    UInt32 distance = value > expected ? value - expected : expected - value;
+    return distance * 10 < IPTS_CONTACT_LOGICAL_MAX / (cells - 1);
+}
+
+static void testFloatToFixed() {
+    CHECK_EQ(IPTSContactDetector::floatToFixed(0), 0);
+    CHECK_EQ(IPTSContactDetector::floatToFixed(FLOAT_ONE), 65536);
+    CHECK_EQ(IPTSContactDetector::floatToFixed(0x3F000000), 32768);        // 0.5
+    CHECK_EQ(IPTSContactDetector::floatToFixed(0xC0200000), -163840);      // -2.5
+    CHECK_EQ(IPTSContactDetector::floatToFixed(0x60AD78EC), 0x7FFFFFFF);   // 1e20
+    CHECK_EQ(IPTSContactDetector::floatToFixed(0x2EDBE6FF), 0);            // 1e-10
+}
+
+static void testConfigure() {
+    IPTSContactDetector detector;
+    IPTSContact contacts[IPTS_CONTACT_MAX_NUM];
+    UInt8 heatmap[16] = {0};
+    CHECK(!detector.isConfigured());
+    CHECK_EQ(detector.process(heatmap, contacts, IPTS_CONTACT_MAX_NUM), 0);
+    CHECK(!detector.configure(0, COLUMNS, nullptr));
+    CHECK(!detector.configure(ROWS, 0, nullptr));
+    CHECK(!detector.configure(128, 128, nullptr));
+    CHECK(detector.configure(ROWS, COLUMNS, nullptr));
+    CHECK_EQ(detector.getCells(), ROWS * COLUMNS);
+}
+
+static void testFindHeatmap() {
+    IPTSContactDetector detector;
+    std::vector<UInt8> heatmap = TestHeatmap().bytes();
+    TestFrameBuilder builder;
+    size_t offset = builder.addHeatmap(heatmap);
+    std::vector<UInt8> frame = builder.finish();
+    const UInt8 *data = &frame[offset + IPTS_HID_FRAME_HEADER_SIZE];
+    UInt32 size = static_cast<UInt32>(frame.size() - offset - IPTS_HID_FRAME_HEADER_SIZE);
+
+    // nothing to compare against before the metadata arrived
+    CHECK(!detector.findHeatmap(data, size));
+
+    CHECK(detector.configure(ROWS, COLUMNS, nullptr));
+    CHECK(detector.findHeatmap(data, size) == data + sizeof(IPTSHeatmapHeader));
+    CHECK(!detector.findHeatmap(data, sizeof(IPTSHeatmapHeader) - 1));
+    // cut short, the header still promises the whole heatmap
+    CHECK(!detector.findHeatmap(data, size - 1));
+
+    // a sensor that does not match the metadata
+    CHECK(detector.configure(ROWS, COLUMNS - 1, nullptr));
+    CHECK(!detector.findHeatmap(data, size));
+    CHECK(detector.configure(ROWS - 1, COLUMNS + 1, nullptr));
+    CHECK(!detector.findHeatmap(data, size));
+}
+
+static void testSingleFinger() {
+    IPTSContactDetector detector;
+    IPTSContact contacts[IPTS_CONTACT_MAX_NUM];
+    CHECK(detector.configure(ROWS, COLUMNS, nullptr));
+
+    CHECK_EQ(process(&detector, TestHeatmap(), contacts), 0);
+
+    TestHeatmap heatmap;
+    heatmap.finger(10, 20, 120);
+    CHECK_EQ(process(&detector, heatmap, contacts), 1);
+    CHECK_EQ(contacts[0].x, logical(20, COLUMNS));
+    CHECK_EQ(contacts[0].y, logical(10, ROWS));
+    CHECK_EQ(contacts[0].peak, 120);
+    CHECK_EQ(contacts[0].size, 5);
+    CHECK_EQ(contacts[0].id, 0);
+    CHECK(!contacts[0].palm);
+
+    // two equal cells, the centroid lies between them
+    TestHeatmap between;
+    between.finger(30, 40, 100);
+    between.finger(30, 41, 100);
+    CHECK_EQ(process(&detector, between, contacts), 1);
+    CHECK(contacts[0].x > logical(40, COLUMNS) && contacts[0].x < logical(41, COLUMNS));
+    CHECK_EQ(contacts[0].y, logical(30, ROWS));
+
+    // the window is cut at the edge, the contact stays inside the logical range
+    TestHeatmap corner;
+    corner.finger(ROWS - 1, COLUMNS - 1, 120);
+    CHECK_EQ(process(&detector, corner, contacts), 1);
+    CHECK(contacts[0].x > logical(COLUMNS - 2, COLUMNS) && contacts[0].x <= IPTS_CONTACT_LOGICAL_MAX);
+    CHECK(contacts[0].y > logical(ROWS - 2, ROWS) && contacts[0].y <= IPTS_CONTACT_LOGICAL_MAX);
+
+    // below the threshold
+    TestHeatmap weak;
+    weak.finger(10, 20, detector.threshold - 1);
+    CHECK_EQ(process(&detector, weak, contacts), 0);
+}
+
+static void testPalm() {
+    IPTSContactDetector detector;
+    IPTSContact contacts[IPTS_CONTACT_MAX_NUM];
+    CHECK(detector.configure(ROWS, COLUMNS, nullptr));
+
+    TestHeatmap heatmap;
+    heatmap.palm(20, 30, 200);
+    heatmap.finger(5, 5, 120);
+    CHECK_EQ(process(&detector, heatmap, contacts), 2);
+    CHECK(!contacts[0].palm);
+    CHECK(contacts[1].palm);
+    CHECK(contacts[1].size > detector.palm_size);
+}
+
+static void testBackground() {
+    IPTSContactDetector detector;
+    IPTSContact contacts[IPTS_CONTACT_MAX_NUM];
+    CHECK(detector.configure(ROWS, COLUMNS, nullptr));
+
+    // a background rising in steps below the threshold is followed, never reported
+    UInt32 found = 0;
+    for (UInt8 level = 15; level <= 90; level += 15) {
+        for (int i = 0; i < 64; i++)
+            found += process(&detector, TestHeatmap(level), contacts);
+    }
+    CHECK_EQ(found, 0);
+
+    // a finger on top of it is measured against the background
+    TestHeatmap heatmap(90);
+    heatmap.finger(10, 20, 90 + 100);
+    CHECK_EQ(process(&detector, heatmap, contacts), 1);
+    CHECK(contacts[0].peak >= 99 && contacts[0].peak <= 101);
+    CHECK_EQ(contacts[0].x, logical(20, COLUMNS));
+
+    // a held finger does not become background
+    for (int i = 0; i < 64; i++)
+        CHECK_EQ(process(&detector, heatmap, contacts), 1);
+    CHECK(contacts[0].peak >= 95);
+
+    // something that never lifts, like a drop of water, does after a while
+    UInt32 frames = 64;
+    while (process(&detector, heatmap, contacts) && frames < 10 * (1U << detector.stale_shift))
+        frames++;
+    CHECK(frames > (1U << detector.stale_shift) / 4);
+    CHECK(frames < 4 * (1U << detector.stale_shift));
+    // and the cells below it react to a real touch right away again
+    TestHeatmap pressed(90);
+    pressed.finger(10, 20, 90 + 100 + 60);
+    CHECK_EQ(process(&detector, pressed, contacts), 1);
+
+    // after a reset all of the background is signal again, one plateau
+    detector.reset();
+    CHECK_EQ(process(&detector, TestHeatmap(90), contacts), 1);
+}
+
+static void testTracking() {
+    IPTSContactDetector detector;
+    IPTSContact contacts[IPTS_CONTACT_MAX_NUM];
+    CHECK(detector.configure(ROWS, COLUMNS, nullptr));
+
+    // two fingers moving towards each other keep their ids
+    for (UInt32 step = 0; step < 20; step++) {
+        TestHeatmap heatmap;
+        heatmap.finger(10, 5 + step, 120);
+        heatmap.finger(30, 50 - step, 120);
+        CHECK_EQ(process(&detector, heatmap, contacts), 2);
+        CHECK_EQ(contacts[0].id, 0);
+        CHECK_EQ(contacts[1].id, 1);
+        // the cells it left still have some of it in their background
+        CHECK(near(contacts[0].x, logical(5 + step, COLUMNS), COLUMNS));
+    }
+
+    // the first one jumps further than a contact moves between frames, it is a new contact and its old id was
+    // alive in the last frame
+    TestHeatmap jumped;
+    jumped.finger(40, 2, 120);
+    jumped.finger(30, 31, 120);
+    CHECK_EQ(process(&detector, jumped, contacts), 2);
+    CHECK_EQ(contacts[0].id, 1);
+    CHECK_EQ(contacts[1].id, 2);
+
+    // lifted for a frame, the id is free again
+    TestHeatmap lifted;
+    lifted.finger(30, 31, 120);
+    CHECK_EQ(process(&detector, lifted, contacts), 1);
+    CHECK_EQ(contacts[0].id, 1);
+    lifted.finger(5, 60, 120);
+    CHECK_EQ(process(&detector, lifted, contacts), 2);
+    CHECK_EQ(contacts[0].id, 0);
+    CHECK_EQ(contacts[1].id, 1);
+}
+
+static void testTooManyFingers() {
+    IPTSContactDetector detector;
+    IPTSContact contacts[IPTS_CONTACT_MAX_NUM];
+    CHECK(detector.configure(ROWS, COLUMNS, nullptr));
+
+    TestHeatmap heatmap;
+    UInt8 peak = 40;
+    // 12 fingers from 40 to 150
+    for (UInt32 row = 5; row < 36; row += 12) {
+        for (UInt32 column = 5; column < 50; column += 12, peak += 10)
+            heatmap.finger(row, column, peak);
+    }
+    CHECK_EQ(process(&detector, heatmap, contacts), IPTS_CONTACT_MAX_NUM);
+    // the two weakest are left out
+    for (int i = 0; i < IPTS_CONTACT_MAX_NUM; i++)
+        CHECK(contacts[i].peak >= 60);
+
+    CHECK_EQ(detector.process(heatmap.bytes().data(), contacts, 3), 3);
+}
+
+static void testTransform() {
+    IPTSContactDetector detector;
+    IPTSContact contacts[IPTS_CONTACT_MAX_NUM];
+    TestHeatmap heatmap;
+    heatmap.finger(10, 20, 120);
+
+    // xx, yx, tx, xy, yy, ty
+    UInt32 identity[6] = {FLOAT_ONE, 0, 0, 0, FLOAT_ONE, 0};
+    CHECK(detector.configure(ROWS, COLUMNS, identity));
+    CHECK_EQ(process(&detector, heatmap, contacts), 1);
+    CHECK_EQ(contacts[0].x, logical(20, COLUMNS));
+    CHECK_EQ(contacts[0].y, logical(10, ROWS));
+
+    UInt32 mirrored[6] = {FLOAT_MINUS_ONE, 0, 0, 0, FLOAT_MINUS_ONE, 0};
+    CHECK(detector.configure(ROWS, COLUMNS, mirrored));
+    CHECK_EQ(process(&detector, heatmap, contacts), 1);
+    CHECK_EQ(contacts[0].x, IPTS_CONTACT_LOGICAL_MAX - logical(20, COLUMNS));
+    CHECK_EQ(contacts[0].y, IPTS_CONTACT_LOGICAL_MAX - logical(10, ROWS));
+
+    // rows run along the screen x axis
+    UInt32 rotated[6] = {0, FLOAT_ONE, 0, FLOAT_MINUS_ONE, 0, 0};
+    CHECK(detector.configure(ROWS, COLUMNS, rotated));
+    CHECK_EQ(process(&detector, heatmap, contacts), 1);
+    CHECK_EQ(contacts[0].x, logical(10, ROWS));
+    CHECK_EQ(contacts[0].y, IPTS_CONTACT_LOGICAL_MAX - logical(20, COLUMNS));
+}
+
+// A whole HID frame like splitFrame sees it, walked down to the heatmap
+static void testFrame() {
+    IPTSContactDetector detector;
+    IPTSContact contacts[IPTS_CONTACT_MAX_NUM];
+    CHECK(detector.configure(ROWS, COLUMNS, nullptr));
+
+    TestHeatmap heatmap;
+    heatmap.finger(12, 34, 150);
+    TestFrameBuilder builder;
+    UInt8 metadata[16] = {0};
+    builder.add(IPTS_HID_FRAME_TYPE_METADATA, metadata, sizeof(metadata));
+    size_t container = builder.begin();
+    builder.addHeatmap(heatmap.bytes());
+    builder.end(container);
+    std::vector<UInt8> frame = builder.finish();
+
+    IPTSHIDFrameWalker walker(&frame[3], static_cast<UInt32>(frame.size() - 3));
+    IPTSHIDSubFrame sub;
+    UInt32 found = 0;
+    while (walker.next(&sub)) {
+        if (sub.type != IPTS_HID_FRAME_TYPE_HEATMAP)
+            continue;
+        const UInt8 *data = detector.findHeatmap(sub.data, sub.size);
+        CHECK(data);
+        if (data)
+            found += detector.process(data, contacts, IPTS_CONTACT_MAX_NUM);
+    }
+    CHECK(!walker.isMalformed());
+    CHECK_EQ(found, 1);
+    CHECK_EQ(contacts[0].x, logical(34, COLUMNS));
+    CHECK_EQ(contacts[0].y, logical(12, ROWS));
+}
+
+int main() {
+    testFloatToFixed();
+    testConfigure();
+    testFindHeatmap();
+    testSingleFinger();
+    testPalm();
+    testBackground();
+    testTracking();
+    testTooManyFingers();
+    testTransform();
+    testFrame();
+    return TEST_RESULT();
+}
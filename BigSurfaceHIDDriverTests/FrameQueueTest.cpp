@@ -0,0 +1,521 @@
+//
+//  FrameQueueTest.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+//  Checks the bookkeeping of IPTSFrameQueue and then lets a producer, the daemon and an observer run against
+//  it on their own threads, a mutex standing in for the command gate of the driver. The daemon and the observer
+//  read frames outside the lock like they do from user space.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "IPTSProtocol.h"
+#include "IPTSFrameQueue.hpp"
+#include "TestHarness.h"
+
+#define SLOT_SIZE       64
+#define RX_OFFSET       8
+#define RX_SIZE         (RX_OFFSET + SLOT_SIZE)
+
+struct TestRing {
+    UInt8 *memory;
+    UInt32 data_offset;
+
+    TestRing() {
+        data_offset = (sizeof(IPTSFrameRing) + 63) & ~63;
+        memory = reinterpret_cast<UInt8 *>(calloc(1, data_offset + IPTS_FRAME_RING_SIZE * SLOT_SIZE));
+    }
+    ~TestRing() { free(memory); }
+    IPTSFrameRing *ring() { return reinterpret_cast<IPTSFrameRing *>(memory); }
+};
+
+static UInt32 frameSize(UInt32 sequence) {
+    return 16 + sequence % (SLOT_SIZE - 16);
+}
+
+static void fillFrame(UInt8 *data, UInt32 sequence) {
+    UInt32 size = frameSize(sequence);
+    for (UInt32 i = 0; i < size; i++)
+        data[i] = static_cast<UInt8>(sequence * 31 + i);
+}
+
+static bool checkFrame(const UInt8 *data, UInt32 sequence, UInt32 size) {
+    if (size != frameSize(sequence))
+        return false;
+    for (UInt32 i = 0; i < size; i++) {
+        if (data[i] != static_cast<UInt8>(sequence * 31 + i))
+            return false;
+    }
+    return true;
+}
+
+// @return true if the frame was appended
+static bool publish(IPTSFrameQueue *queue, IPTSFrameClass frame_class, UInt32 sequence, UInt32 buffer = IPTS_FRAME_IN_SLOT, UInt32 *released = nullptr) {
+    UInt32 superseded, freed;
+    UInt8 *slot = queue->acquire(frame_class, &superseded);
+    if (!slot)
+        return false;
+    if (buffer == IPTS_FRAME_IN_SLOT)
+        fillFrame(slot, sequence);
+    bool appended = queue->publish(frameSize(sequence), sequence, sequence * 1000, buffer, RX_OFFSET, &freed);
+    if (released)
+        *released = superseded | freed;
+    return appended;
+}
+
+static void testFIFO() {
+    TestRing memory;
+    IPTSFrameQueue queue;
+    queue.reset(memory.ring(), SLOT_SIZE, memory.data_offset);
+    queue.setPolicy(IPTSFrameClassTouch, IPTSDeliveryFIFO);
+    UInt32 cursor;
+    CHECK(queue.attach(true, &cursor));
+    CHECK(queue.isEmpty());
+
+    for (UInt32 seq = 1; seq <= 3; seq++)
+        CHECK(publish(&queue, IPTSFrameClassTouch, seq));
+    CHECK(!queue.isDrained());
+    for (UInt32 seq = 1; seq <= 3; seq++) {
+        UInt64 frame[4];
+        CHECK(queue.hasFrame(cursor));
+        queue.peek(cursor, frame);
+        CHECK_EQ(frame[2], seq);
+        CHECK_EQ(frame[3], IPTS_FRAME_IN_SLOT);
+        CHECK_EQ(queue.getFrameTime(static_cast<UInt32>(frame[0])), seq * 1000);
+        CHECK(checkFrame(IPTS_FRAME_RING_SLOT_DATA(memory.ring(), frame[0]), seq, static_cast<UInt32>(frame[1])));
+        queue.consume(cursor);
+    }
+    CHECK(!queue.hasFrame(cursor));
+    CHECK(queue.isDrained());
+    CHECK(!queue.isEmpty());
+    CHECK_EQ(queue.getOldestTime(), 1000);
+    CHECK_EQ(queue.release(), 0);
+    CHECK(queue.isEmpty());
+}
+
+static void testLatest() {
+    TestRing memory;
+    IPTSFrameQueue queue;
+    queue.reset(memory.ring(), SLOT_SIZE, memory.data_offset);
+    UInt32 cursor;
+    CHECK(queue.attach(true, &cursor));
+
+    // touch is latest wins by default, stylus in order
+    CHECK(publish(&queue, IPTSFrameClassTouch, 1));
+    CHECK(publish(&queue, IPTSFrameClassStylus, 2));
+    CHECK(!publish(&queue, IPTSFrameClassTouch, 3));
+    CHECK(publish(&queue, IPTSFrameClassStylus, 4));
+    CHECK_EQ(memory.ring()->head, 3);
+    CHECK_EQ(queue.getSuperseded(IPTSFrameClassTouch), 1);
+    CHECK_EQ(queue.getSuperseded(IPTSFrameClassStylus), 0);
+
+    UInt32 expected[] = {3, 2, 4};
+    for (UInt32 i = 0; i < 3; i++) {
+        UInt64 frame[4];
+        queue.peek(cursor, frame);
+        CHECK_EQ(frame[2], expected[i]);
+        queue.consume(cursor);
+    }
+
+    // a frame handed to the daemon is never taken back
+    CHECK(publish(&queue, IPTSFrameClassTouch, 5));
+    CHECK_EQ(queue.getSuperseded(IPTSFrameClassTouch), 1);
+}
+
+static void testNotify() {
+    TestRing memory;
+    IPTSFrameQueue queue;
+    queue.reset(memory.ring(), SLOT_SIZE, memory.data_offset);
+    UInt32 cursor, observer;
+    CHECK(queue.attach(true, &cursor));
+    CHECK(queue.attach(false, &observer));
+    CHECK(!queue.canNotify(cursor));
+
+    // the primary is notified of the first frame, the ones after it wait until it is released
+    CHECK(publish(&queue, IPTSFrameClassTouch, 1));
+    CHECK(queue.canNotify(cursor));
+    queue.consume(cursor);
+    CHECK(publish(&queue, IPTSFrameClassTouch, 2));
+    CHECK(!queue.canNotify(cursor));
+    CHECK(queue.canNotify(observer));
+    CHECK(!publish(&queue, IPTSFrameClassTouch, 3));
+    CHECK(publish(&queue, IPTSFrameClassStylus, 4));
+    CHECK(!queue.canNotify(cursor));
+    CHECK_EQ(queue.getSuperseded(IPTSFrameClassTouch), 1);
+
+    // observers are notified of every frame as it comes
+    UInt64 frame[4];
+    UInt32 expected[] = {1, 3, 4};
+    for (UInt32 i = 0; i < 3; i++) {
+        CHECK(queue.canNotify(observer));
+        queue.peek(observer, frame);
+        CHECK_EQ(static_cast<UInt32>(frame[2]), expected[i]);
+        queue.consume(observer);
+    }
+    CHECK(!queue.canNotify(observer));
+
+    // once released the primary gets the newest touch frame, then the stylus one
+    queue.release();
+    for (UInt32 i = 1; i < 3; i++) {
+        CHECK(queue.canNotify(cursor));
+        queue.peek(cursor, frame);
+        CHECK_EQ(frame[2], expected[i]);
+        queue.consume(cursor);
+        CHECK(!queue.canNotify(cursor));
+        queue.release();
+    }
+    CHECK(queue.isEmpty());
+}
+
+static void testRingFull() {
+    TestRing memory;
+    IPTSFrameQueue queue;
+    queue.reset(memory.ring(), SLOT_SIZE, memory.data_offset);
+    UInt32 cursor;
+    CHECK(queue.attach(true, &cursor));
+
+    for (UInt32 seq = 1; seq <= IPTS_FRAME_RING_SIZE; seq++)
+        CHECK(publish(&queue, IPTSFrameClassStylus, seq));
+    CHECK(!publish(&queue, IPTSFrameClassStylus, 9));
+    CHECK_EQ(queue.getRingDrops(), 1);
+    CHECK_EQ(queue.getDropped(IPTSFrameClassStylus), 1);
+    // the waiting touch frame is not of the class, so there is nothing to supersede either
+    CHECK(!publish(&queue, IPTSFrameClassTouch, 10));
+    CHECK_EQ(queue.getDropped(IPTSFrameClassTouch), 1);
+
+    UInt64 frame[4];
+    queue.peek(cursor, frame);
+    queue.consume(cursor);
+    // consumed but not released, the slot still belongs to the daemon
+    CHECK(!publish(&queue, IPTSFrameClassStylus, 11));
+    queue.release();
+    CHECK(publish(&queue, IPTSFrameClassStylus, 12));
+}
+
+static void testHeldBuffers() {
+    TestRing memory;
+    IPTSFrameQueue queue;
+    queue.reset(memory.ring(), SLOT_SIZE, memory.data_offset);
+    UInt32 cursor, released;
+    CHECK(queue.attach(true, &cursor));
+
+    CHECK(publish(&queue, IPTSFrameClassStylus, 1, 3, &released));
+    CHECK_EQ(released, 0);
+    CHECK(publish(&queue, IPTSFrameClassStylus, 2, 5, &released));
+    CHECK_EQ(released, 0);
+
+    // a superseded frame never reached the daemon, its buffer is free right away
+    CHECK(publish(&queue, IPTSFrameClassTouch, 3, 7, &released));
+    CHECK_EQ(released, 0);
+    CHECK(!publish(&queue, IPTSFrameClassTouch, 4, 9, &released));
+    CHECK_EQ(released, 1 << 7);
+
+    UInt64 frame[4];
+    queue.peek(cursor, frame);
+    CHECK_EQ(frame[3], 3);
+    queue.consume(cursor);
+    CHECK_EQ(queue.release(), 1 << 3);
+    CHECK_EQ(memory.ring()->slots[frame[0]].sequence, IPTS_FRAME_SEQUENCE_INVALID);
+
+    queue.peek(cursor, frame);
+    queue.consume(cursor);
+    // whatever the daemon still holds goes back once it detaches, frames it never saw included
+    CHECK_EQ(queue.detach(cursor), (1 << 5) | (1 << 9));
+    CHECK(!queue.hasPrimary());
+    CHECK(queue.isEmpty());
+
+    // without a primary a frame is only kept for observers, its buffer is released right away
+    CHECK(publish(&queue, IPTSFrameClassStylus, 5, 2, &released));
+    CHECK_EQ(released, 1 << 2);
+
+    // an ME reset takes every buffer back, no frame may point into one afterwards, frames in the slot stay valid
+    CHECK(queue.attach(true, &cursor));
+    CHECK(publish(&queue, IPTSFrameClassStylus, 6, 4, &released));
+    CHECK(publish(&queue, IPTSFrameClassStylus, 7));
+    queue.peek(cursor, frame);
+    queue.consume(cursor);
+    queue.resetBuffers();
+    CHECK_EQ(memory.ring()->slots[frame[0]].sequence, IPTS_FRAME_SEQUENCE_INVALID);
+    CHECK_EQ(memory.ring()->slots[(frame[0] + IPTS_FRAME_RING_SIZE - 1) % IPTS_FRAME_RING_SIZE].sequence, IPTS_FRAME_SEQUENCE_INVALID);
+    queue.peek(cursor, frame);
+    CHECK_EQ(frame[2], 7);
+    queue.consume(cursor);
+    CHECK_EQ(queue.release(), 0);
+}
+
+static void testObserver() {
+    TestRing memory;
+    IPTSFrameQueue queue;
+    queue.reset(memory.ring(), SLOT_SIZE, memory.data_offset);
+    UInt32 primary, observer;
+    CHECK(queue.attach(false, &observer));
+    CHECK(!queue.isPrimary(observer));
+
+    for (UInt32 seq = 1; seq <= IPTS_FRAME_RING_SIZE + 2; seq++)
+        CHECK(publish(&queue, IPTSFrameClassStylus, seq));
+    UInt64 frame[4];
+    queue.peek(observer, frame);
+    CHECK_EQ(static_cast<UInt32>(frame[2]), 3);
+    CHECK_EQ(IPTS_FRAME_MISSED(frame[2]), 2);
+    CHECK_EQ(queue.getObserverOverruns(), 2);
+    queue.consume(observer);
+    queue.peek(observer, frame);
+    CHECK_EQ(frame[2], 4);
+
+    // a primary starts at the newest frame, it never sees what was published before it attached
+    CHECK(queue.attach(true, &primary));
+    CHECK(queue.isPrimary(primary));
+    CHECK(!queue.hasFrame(primary));
+
+    UInt32 cursors[IPTS_INPUT_CLIENT_NUM];
+    UInt32 attached = 0;
+    while (attached < IPTS_INPUT_CLIENT_NUM && queue.attach(false, &cursors[attached]))
+        attached++;
+    CHECK_EQ(attached, IPTS_INPUT_CLIENT_NUM - 2);
+
+    // a frame taking over a slot the observer already read is a frame it misses, one still ahead of it is not
+    TestRing latest_memory;
+    IPTSFrameQueue latest;
+    latest.reset(latest_memory.ring(), SLOT_SIZE, latest_memory.data_offset);
+    UInt32 ahead, behind;
+    CHECK(latest.attach(true, &primary));
+    CHECK(latest.attach(false, &ahead));
+    CHECK(latest.attach(false, &behind));
+    CHECK(publish(&latest, IPTSFrameClassTouch, 1));
+    latest.peek(ahead, frame);
+    latest.consume(ahead);
+    CHECK(!publish(&latest, IPTSFrameClassTouch, 2));
+    CHECK_EQ(latest.getObserverOverruns(), 1);
+    CHECK(publish(&latest, IPTSFrameClassStylus, 3));
+    latest.peek(ahead, frame);
+    CHECK_EQ(static_cast<UInt32>(frame[2]), 3);
+    CHECK_EQ(IPTS_FRAME_MISSED(frame[2]), 1);
+    latest.consume(ahead);
+    CHECK(!latest.hasFrame(ahead));
+    latest.peek(behind, frame);
+    CHECK_EQ(frame[2], 2);
+    latest.peek(primary, frame);
+    CHECK_EQ(frame[2], 2);
+}
+
+/*
+ * The producer publishes frames of both classes, copied into the slot or left in a receive buffer, the daemon
+ * consumes them and releases them whenever it runs dry, the observer follows along. Frames are filled from
+ * their sequence, so whoever reads one can tell if it was torn.
+ */
+struct StressState {
+    std::mutex gate;
+    std::condition_variable wakeup;
+    IPTSFrameQueue queue;
+    UInt8 rx[IPTS_BUFFER_NUM][RX_SIZE];
+    UInt32 free_buffers {(1U << IPTS_BUFFER_NUM) - 1};
+    UInt32 held_buffers {0};
+    UInt32 double_releases {0};
+    std::vector<UInt8> frame_class;
+    bool done {false};
+
+    // counted by the threads on their own, checked once they are joined
+    UInt64 attempts {0};
+    UInt64 delivered {0};
+    UInt64 primary_torn {0};
+    UInt64 out_of_order {0};
+    UInt64 observed {0};
+    UInt64 observer_torn {0};
+    UInt64 observer_skipped {0};
+    UInt64 observer_missed {0};
+
+    // the ME gets buffers back, called with the gate held
+    void giveBack(UInt32 mask) {
+        if (mask & ~held_buffers)
+            double_releases++;
+        held_buffers &= ~mask;
+        free_buffers |= mask;
+        if (mask)
+            wakeup.notify_all();
+    }
+
+    const UInt8 *frameData(UInt64 *frame) {
+        if (frame[3] == IPTS_FRAME_IN_SLOT)
+            return IPTS_FRAME_RING_SLOT_DATA(queue.getRing(), frame[0]);
+        return rx[frame[3]] + RX_OFFSET;
+    }
+
+    UInt32 slotSequence(UInt64 slot) {
+        return __atomic_load_n(&queue.getRing()->slots[slot].sequence, __ATOMIC_ACQUIRE);
+    }
+};
+
+static void produce(StressState *state, UInt32 frames) {
+    TestRandom random(7);
+    for (UInt32 seq = 1; seq <= frames; seq++) {
+        bool zero_copy = random.next() & 1;
+        IPTSFrameClass frame_class = (random.next() % 3) ? IPTSFrameClassTouch : IPTSFrameClassStylus;
+        std::unique_lock<std::mutex> lock(state->gate);
+        state->attempts++;
+        state->frame_class[seq] = frame_class;
+        UInt32 buffer = IPTS_FRAME_IN_SLOT;
+        if (zero_copy) {
+            state->wakeup.wait(lock, [state] { return state->free_buffers != 0; });
+            buffer = __builtin_ctz(state->free_buffers);
+        }
+
+        UInt32 released;
+        UInt8 *slot = state->queue.acquire(frame_class, &released);
+        state->giveBack(released);
+        if (!slot)
+            continue;
+        if (zero_copy) {
+            state->free_buffers &= ~(1 << buffer);
+            state->held_buffers |= 1 << buffer;
+            fillFrame(state->rx[buffer] + RX_OFFSET, seq);
+        } else {
+            fillFrame(slot, seq);
+        }
+        bool appended = state->queue.publish(frameSize(seq), seq, 0, buffer, RX_OFFSET, &released);
+        state->giveBack(released);
+        if (appended)
+            state->wakeup.notify_all();
+        lock.unlock();
+
+        // lets the daemon fall behind now and then, so frames are superseded and dropped as well
+        if (random.next() % 64 == 0)
+            std::this_thread::yield();
+    }
+    std::lock_guard<std::mutex> lock(state->gate);
+    state->done = true;
+    state->wakeup.notify_all();
+}
+
+static void consume(StressState *state, UInt32 cursor) {
+    TestRandom random(11);
+    UInt32 last[IPTSFrameClassNum] = {0, 0};
+    std::vector<UInt64> owned;
+    while (true) {
+        UInt64 frame[4];
+        {
+            std::unique_lock<std::mutex> lock(state->gate);
+            if (!state->queue.hasFrame(cursor)) {
+                // processingEnded, everything handed out so far goes back
+                state->giveBack(state->queue.release());
+                owned.clear();
+                state->wakeup.wait(lock, [state, cursor] { return state->done || state->queue.hasFrame(cursor); });
+                if (!state->queue.hasFrame(cursor))
+                    break;
+            }
+            state->queue.peek(cursor, frame);
+            state->queue.consume(cursor);
+            state->delivered++;
+            IPTSFrameClass frame_class = static_cast<IPTSFrameClass>(state->frame_class[frame[2]]);
+            if (frame[2] <= last[frame_class])
+                state->out_of_order++;
+            last[frame_class] = static_cast<UInt32>(frame[2]);
+        }
+        owned.push_back(frame[0]);
+
+        // the frame is the daemon's until it releases it, neither the slot nor the buffer may change under it
+        UInt32 spin = random.next() % 256;
+        for (volatile UInt32 i = 0; i < spin; i++);
+        if (state->slotSequence(frame[0]) != frame[2] || !checkFrame(state->frameData(frame), static_cast<UInt32>(frame[2]), static_cast<UInt32>(frame[1])))
+            state->primary_torn++;
+        for (UInt64 slot : owned) {
+            if (state->slotSequence(slot) == IPTS_FRAME_SEQUENCE_INVALID)
+                state->primary_torn++;
+        }
+    }
+}
+
+static void observe(StressState *state, UInt32 cursor) {
+    UInt8 copy[SLOT_SIZE];
+    while (true) {
+        UInt64 frame[4];
+        {
+            std::unique_lock<std::mutex> lock(state->gate);
+            if (!state->queue.hasFrame(cursor)) {
+                if (state->done)
+                    break;
+                lock.unlock();
+                std::this_thread::yield();
+                continue;
+            }
+            state->queue.peek(cursor, frame);
+            state->queue.consume(cursor);
+        }
+
+        // the seqlock of IPTSFrameRing, copy out and keep the copy only if the sequence held
+        UInt32 size = static_cast<UInt32>(frame[1]);
+        UInt32 sequence = static_cast<UInt32>(frame[2]);
+        state->observer_missed += IPTS_FRAME_MISSED(frame[2]);
+        if (sequence == IPTS_FRAME_SEQUENCE_INVALID || size > SLOT_SIZE) {
+            state->observer_skipped++;
+            continue;
+        }
+        memcpy(copy, state->frameData(frame), size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (state->slotSequence(frame[0]) != sequence) {
+            state->observer_skipped++;
+            continue;
+        }
+        state->observed++;
+        if (!checkFrame(copy, sequence, size))
+            state->observer_torn++;
+    }
+}
+
+static void testThreaded() {
+    const UInt32 frames = 200000;
+    TestRing memory;
+    StressState state;
+    state.frame_class.resize(frames + 1);
+    state.queue.reset(memory.ring(), SLOT_SIZE, memory.data_offset);
+    UInt32 primary, observer;
+    CHECK(state.queue.attach(true, &primary));
+    CHECK(state.queue.attach(false, &observer));
+
+    std::thread daemon(consume, &state, primary);
+    std::thread watcher(observe, &state, observer);
+    std::thread producer(produce, &state, frames);
+    producer.join();
+    daemon.join();
+    watcher.join();
+
+    state.giveBack(state.queue.detach(primary));
+    CHECK_EQ(state.held_buffers, 0);
+    CHECK_EQ(state.free_buffers, (1U << IPTS_BUFFER_NUM) - 1);
+    CHECK_EQ(state.double_releases, 0);
+    CHECK_EQ(state.primary_torn, 0);
+    CHECK_EQ(state.out_of_order, 0);
+    CHECK_EQ(state.observer_torn, 0);
+
+    UInt64 superseded = state.queue.getSuperseded(IPTSFrameClassTouch) + state.queue.getSuperseded(IPTSFrameClassStylus);
+    UInt64 dropped = state.queue.getDropped(IPTSFrameClassTouch) + state.queue.getDropped(IPTSFrameClassStylus);
+    CHECK_EQ(state.attempts, frames);
+    CHECK_EQ(state.delivered + superseded + dropped, frames);
+    CHECK_EQ(dropped, state.queue.getRingDrops());
+    CHECK(state.observed > 0);
+    // only misses since the last frame the observer took can still be unreported
+    CHECK(state.observer_missed <= state.queue.getObserverOverruns());
+    printf("%u frames: %llu delivered, %llu superseded, %llu dropped, observer read %llu and skipped %llu (%llu overrun)\n",
+           frames, (unsigned long long)state.delivered, (unsigned long long)superseded, (unsigned long long)dropped,
+           (unsigned long long)state.observed, (unsigned long long)state.observer_skipped,
+           (unsigned long long)state.queue.getObserverOverruns());
+}
+
+int main() {
+    testFIFO();
+    testLatest();
+    testNotify();
+    testRingFull();
+    testHeldBuffers();
+    testObserver();
+    testThreaded();
+    return TEST_RESULT();
+}
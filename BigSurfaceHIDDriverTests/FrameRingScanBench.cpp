@@ -0,0 +1,107 @@
+//
+//  FrameRingScanBench.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+//  Measures how long a daemon side pass over a heatmap takes when it reads the frame ring mapping, compared to
+//  the same bytes in private memory. Run it on the device once with CacheableFrameRing on and once with it off.
+//  It opens the driver as an observer, so a running daemon is not disturbed.
+//
+//    FrameRingScanBench [heatmap bytes] [iterations]
+//
+
+#include <IOKit/IOKitLib.h>
+#include <mach/mach_time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "IPTSKenerlUserShared.h"
+
+static volatile UInt32 sink;     // keeps the scans from being optimized away
+
+// One pass over every byte, like the daemon looking for the range of a heatmap
+static void scan(const UInt8 *data, UInt32 size) {
+    UInt32 sum = 0;
+    UInt8 low = 0xff, high = 0;
+    for (UInt32 i = 0; i < size; i++) {
+        UInt8 value = data[i];
+        sum += value;
+        if (value < low)
+            low = value;
+        if (value > high)
+            high = value;
+    }
+    sink += sum + low + high;
+}
+
+// @return ns per scan of @size bytes from each of the @slots in turn
+static double measure(const UInt8 *base, UInt32 stride, UInt32 slots, UInt32 size, UInt32 iterations) {
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    UInt64 start = mach_absolute_time();
+    for (UInt32 i = 0; i < iterations; i++)
+        scan(base + (i % slots) * stride, size);
+    UInt64 elapsed = mach_absolute_time() - start;
+    return static_cast<double>(elapsed) * timebase.numer / timebase.denom / iterations;
+}
+
+int main(int argc, char **argv) {
+    UInt32 size = argc > 1 ? atoi(argv[1]) : 44 * 64;
+    UInt32 iterations = argc > 2 ? atoi(argv[2]) : 1000;
+    if (!size || !iterations) {
+        fprintf(stderr, "usage: FrameRingScanBench [heatmap bytes] [iterations]\n");
+        return 2;
+    }
+
+    io_service_t service = IOServiceGetMatchingService(MACH_PORT_NULL, IOServiceMatching("IntelPreciseTouchStylusDriver"));
+    if (!service) {
+        fprintf(stderr, "IntelPreciseTouchStylusDriver not found\n");
+        return 1;
+    }
+    CFTypeRef cacheable = IORegistryEntryCreateCFProperty(service, CFSTR("CacheableFrameRing"), kCFAllocatorDefault, 0);
+
+    io_connect_t connect;
+    kern_return_t ret = IOServiceOpen(service, mach_task_self(), kIPTSClientTypeObserver, &connect);
+    IOObjectRelease(service);
+    if (ret != KERN_SUCCESS) {
+        fprintf(stderr, "Could not open the driver: 0x%x\n", ret);
+        return 1;
+    }
+
+    mach_vm_address_t address = 0;
+    mach_vm_size_t length = 0;
+    ret = IOConnectMapMemory64(connect, kIPTSMemoryTypeFrameRing, mach_task_self(), &address, &length, kIOMapAnywhere);
+    if (ret != KERN_SUCCESS) {
+        fprintf(stderr, "Could not map the frame ring: 0x%x\n", ret);
+        IOServiceClose(connect);
+        return 1;
+    }
+
+    const IPTSFrameRing *ring = reinterpret_cast<const IPTSFrameRing *>(address);
+    if (size > ring->slot_size)
+        size = ring->slot_size;
+    const UInt8 *slots = IPTS_FRAME_RING_SLOT_DATA(ring, 0);
+    std::vector<UInt8> copy(slots, slots + IPTS_FRAME_RING_SIZE * ring->slot_size);
+
+    // warm up both, the first pass over private memory would otherwise pay for the page faults
+    measure(slots, ring->slot_size, IPTS_FRAME_RING_SIZE, size, IPTS_FRAME_RING_SIZE);
+    measure(copy.data(), ring->slot_size, IPTS_FRAME_RING_SIZE, size, IPTS_FRAME_RING_SIZE);
+    double mapped = measure(slots, ring->slot_size, IPTS_FRAME_RING_SIZE, size, iterations);
+    double private_copy = measure(copy.data(), ring->slot_size, IPTS_FRAME_RING_SIZE, size, iterations);
+
+    printf("CacheableFrameRing  %s\n", cacheable == kCFBooleanTrue ? "true" : cacheable == kCFBooleanFalse ? "false" : "unknown");
+    printf("heatmap             %u bytes, %u scans\n", size, iterations);
+    printf("frame ring          %.0f ns per scan\n", mapped);
+    printf("private memory      %.0f ns per scan\n", private_copy);
+    printf("ratio               %.1fx\n", mapped / private_copy);
+
+    if (cacheable)
+        CFRelease(cacheable);
+    IOConnectUnmapMemory64(connect, kIPTSMemoryTypeFrameRing, mach_task_self(), address);
+    IOServiceClose(connect);
+    return 0;
+}
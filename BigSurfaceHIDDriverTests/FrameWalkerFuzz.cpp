@@ -0,0 +1,232 @@
+//
+//  FrameWalkerFuzz.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+//  Fuzzes the parsing the driver does on every touch buffer: IPTSHIDFrameWalker and the heatmap and stylus
+//  decoders behind it, the way splitFrame drives them. Every input is copied to a heap buffer of exactly its size,
+//  so a read past it is caught by AddressSanitizer. make fuzz builds it with ASan and UBSan and runs it over the
+//  seeds in corpus/walker:
+//
+//    FrameWalkerFuzz [-n iterations] [-s seed] corpus/walker/*.bin
+//
+//  Every seed is run whole and cut at every length, then mutated inputs are run for the given iterations. With
+//  clang it can also be built as a libFuzzer target, -DIPTS_LIBFUZZER -fsanitize=fuzzer,address, on the same corpus.
+//
+//  The seeds are frames as the firmware lays them out, [report id][u16 timestamp][root header][frames...]:
+//    heatmap.bin      metadata and an 8x8 heatmap inside a container
+//    stylus.bin       a reports frame with a v1 and a v2 stylus report
+//    mixed.bin        metadata, heatmap, stylus reports and a raw frame in nested containers
+//    nested.bin       containers nested deeper than the walker enters
+//    empty.bin        the root header alone
+//    oversized.bin    a child claiming more than its container holds
+//    undersized.bin   a child whose size is smaller than its header
+//    padded.bin       a container with trailing bytes too short for another header
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "IPTSContactDetector.hpp"
+#include "IPTSHIDFrameWalker.hpp"
+#include "IPTSStylusDecoder.hpp"
+#include "TestHarness.h"
+
+#define FUZZ_ROWS           8
+#define FUZZ_COLUMNS        8
+#define FUZZ_MAX_SAMPLES    32
+
+#define FUZZ_ASSERT(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: invariant broken: %s\n", __FILE__, __LINE__, #cond); \
+        abort(); \
+    } \
+} while (0)
+
+static IPTSContactDetector *detector;
+
+extern "C" int LLVMFuzzerTestOneInput(const UInt8 *data, size_t size) {
+    if (!detector) {
+        detector = new IPTSContactDetector;
+        detector->configure(FUZZ_ROWS, FUZZ_COLUMNS, nullptr);
+    }
+    if (size < 3)
+        return 0;
+
+    UInt8 *frame = new UInt8[size];
+    memcpy(frame, data, size);
+
+    IPTSHIDFrameWalker walker(frame + 3, static_cast<UInt32>(size - 3));
+    IPTSHIDSubFrame sub;
+    size_t frames = 0;
+    while (walker.next(&sub)) {
+        // every frame lies inside the buffer, behind its header, and the walk always moves forward
+        FUZZ_ASSERT(sub.data >= frame + 3 + IPTS_HID_FRAME_HEADER_SIZE);
+        FUZZ_ASSERT(sub.data + sub.size <= frame + size);
+        FUZZ_ASSERT(++frames <= size / IPTS_HID_FRAME_HEADER_SIZE);
+
+        if (sub.type == IPTS_HID_FRAME_TYPE_REPORTS) {
+            IPTSStylusSample samples[FUZZ_MAX_SAMPLES];
+            UInt32 num = IPTSStylusDecoder::decode(sub.data, sub.size, 0, samples, FUZZ_MAX_SAMPLES);
+            FUZZ_ASSERT(num <= FUZZ_MAX_SAMPLES);
+            // samples only ever come from reports the driver keeps to itself
+            FUZZ_ASSERT(!num || (IPTSStylusDecoder::scan(sub.data, sub.size) & IPTS_REPORTS_STYLUS));
+            for (UInt32 i = 0; i < num; i++) {
+                FUZZ_ASSERT(samples[i].x <= IPTS_STYLUS_MAX_X && samples[i].y <= IPTS_STYLUS_MAX_Y);
+                FUZZ_ASSERT(samples[i].pressure <= IPTS_STYLUS_MAX_PRESSURE);
+                FUZZ_ASSERT(samples[i].x_tilt <= 2 * IPTS_STYLUS_TILT_CENTER && samples[i].y_tilt <= 2 * IPTS_STYLUS_TILT_CENTER);
+            }
+        } else if (sub.type == IPTS_HID_FRAME_TYPE_HEATMAP) {
+            const UInt8 *heatmap = detector->findHeatmap(sub.data, sub.size);
+            if (heatmap) {
+                FUZZ_ASSERT(heatmap + FUZZ_ROWS * FUZZ_COLUMNS <= sub.data + sub.size);
+                IPTSContact contacts[IPTS_CONTACT_MAX_NUM];
+                UInt32 num = detector->process(heatmap, contacts, IPTS_CONTACT_MAX_NUM);
+                FUZZ_ASSERT(num <= IPTS_CONTACT_MAX_NUM);
+                for (UInt32 i = 0; i < num; i++)
+                    FUZZ_ASSERT(contacts[i].x <= IPTS_CONTACT_LOGICAL_MAX && contacts[i].y <= IPTS_CONTACT_LOGICAL_MAX);
+            }
+        }
+    }
+    delete[] frame;
+    return 0;
+}
+
+#ifndef IPTS_LIBFUZZER
+
+static bool readFile(const char *path, std::vector<UInt8> *data) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+    UInt8 chunk[4096];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        data->insert(data->end(), chunk, chunk + read);
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+// Sizes that sit on the edges of the checks in the walker and the decoders
+static UInt32 interestingSize(TestRandom *random, size_t offset, size_t size) {
+    static const UInt32 values[] = {0, 1, IPTS_HID_FRAME_HEADER_SIZE - 1, IPTS_HID_FRAME_HEADER_SIZE,
+                                    IPTS_HID_FRAME_HEADER_SIZE + 1, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF,
+                                    FUZZ_ROWS * FUZZ_COLUMNS};
+    size_t remaining = size > offset ? size - offset : 0;
+    switch (random->range(0, 3)) {
+        case 0:
+            return static_cast<UInt32>(remaining);
+        case 1:
+            return static_cast<UInt32>(remaining + 1);
+        case 2:
+            return static_cast<UInt32>(remaining ? remaining - 1 : 0);
+        default:
+            return values[random->range(0, sizeof(values) / sizeof(values[0]) - 1)];
+    }
+}
+
+static void mutate(TestRandom *random, std::vector<UInt8> *input) {
+    std::vector<UInt8> &data = *input;
+    for (int n = static_cast<int>(random->range(1, 4)); n > 0; n--) {
+        size_t at = data.empty() ? 0 : random->range(0, data.size() - 1);
+        switch (random->range(0, 6)) {
+            case 0:     // flip a bit
+                if (!data.empty())
+                    data[at] ^= 1 << random->range(0, 7);
+                break;
+            case 1:     // set a byte, often a frame type
+                if (!data.empty()) {
+                    static const UInt8 types[] = {IPTS_HID_FRAME_TYPE_HID, IPTS_HID_FRAME_TYPE_HEATMAP,
+                                                  IPTS_HID_FRAME_TYPE_METADATA, IPTS_HID_FRAME_TYPE_RAW,
+                                                  IPTS_HID_FRAME_TYPE_REPORTS, IPTS_REPORT_TYPE_STYLUS_V1,
+                                                  IPTS_REPORT_TYPE_STYLUS_V2};
+                    data[at] = random->range(0, 1) ? types[random->range(0, sizeof(types) - 1)] : random->range(0, 0xFF);
+                }
+                break;
+            case 2:     // overwrite a u32, where the size of a header might be
+                if (data.size() >= 4) {
+                    at = random->range(0, data.size() - 4);
+                    UInt32 value = interestingSize(random, at, data.size());
+                    memcpy(&data[at], &value, sizeof(UInt32));
+                }
+                break;
+            case 3:     // overwrite a u16, where the size of a stylus report might be
+                if (data.size() >= 2) {
+                    at = random->range(0, data.size() - 2);
+                    UInt16 value = static_cast<UInt16>(interestingSize(random, at, data.size()));
+                    memcpy(&data[at], &value, sizeof(UInt16));
+                }
+                break;
+            case 4:     // cut short
+                data.resize(at);
+                break;
+            case 5:     // repeat a chunk, makes for more and deeper frames
+                if (!data.empty()) {
+                    size_t length = random->range(1, data.size() - at < 64 ? data.size() - at : 64);
+                    std::vector<UInt8> chunk(data.begin() + at, data.begin() + at + length);
+                    data.insert(data.begin() + random->range(0, data.size()), chunk.begin(), chunk.end());
+                }
+                break;
+            default:    // remove a chunk
+                if (!data.empty())
+                    data.erase(data.begin() + at, data.begin() + at + random->range(1, data.size() - at));
+                break;
+        }
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "usage: FrameWalkerFuzz [-n iterations] [-s seed] seed files...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    unsigned long long iterations = 100000;
+    unsigned long long seed = 1;
+    std::vector<std::vector<UInt8> > seeds;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            iterations = strtoull(argv[++i], nullptr, 0);
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 0);
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            std::vector<UInt8> data;
+            if (!readFile(argv[i], &data)) {
+                fprintf(stderr, "%s: could not read the seed\n", argv[i]);
+                return 1;
+            }
+            seeds.push_back(data);
+        }
+    }
+    if (seeds.empty())
+        usage();
+
+    unsigned long long inputs = 0;
+    for (size_t i = 0; i < seeds.size(); i++) {
+        for (size_t size = 0; size <= seeds[i].size(); size++, inputs++)
+            LLVMFuzzerTestOneInput(seeds[i].data(), size);
+    }
+
+    TestRandom random(seed);
+    std::vector<UInt8> input;
+    for (unsigned long long n = 0; n < iterations; n++, inputs++) {
+        input = seeds[random.range(0, seeds.size() - 1)];
+        mutate(&random, &input);
+        // keeps the pointer valid for an empty input
+        input.reserve(1);
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+
+    printf("%llu inputs from %zu seeds, seed %llu, no invariant broken\n", inputs, seeds.size(), seed);
+    delete detector;
+    return 0;
+}
+
+#endif /* IPTS_LIBFUZZER */
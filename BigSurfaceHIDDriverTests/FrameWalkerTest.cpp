@@ -0,0 +1,283 @@
+//
+//  FrameWalkerTest.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+//  Walks hand built HID frames with IPTSHIDFrameWalker, including children that are cut short, claim more than
+//  their parent holds or are too small for a header. Every frame is copied to a buffer of exactly its size first,
+//  so a build with -fsanitize=address catches any read past the end.
+//
+
+#include <vector>
+
+#include "IPTSHIDFrameWalker.hpp"
+#include "TestFrames.h"
+#include "TestHarness.h"
+
+struct WalkResult {
+    std::vector<IPTSHIDSubFrame> frames;
+    bool malformed;
+};
+
+// Walks the root header of @frame, the report id and timestamp in front of it are skipped like splitFrame does
+static WalkResult walk(const std::vector<UInt8> &frame, size_t size) {
+    std::vector<UInt8> exact(frame.begin(), frame.begin() + size);
+    WalkResult result;
+    IPTSHIDFrameWalker walker(size > 3 ? exact.data() + 3 : nullptr, size > 3 ? static_cast<UInt32>(size - 3) : 0);
+    IPTSHIDSubFrame sub;
+    while (walker.next(&sub)) {
+        CHECK(sub.data >= exact.data() + 3 + IPTS_HID_FRAME_HEADER_SIZE);
+        CHECK(sub.data + sub.size <= exact.data() + size);
+        // handed back as pointers into @frame, the copy is gone after this
+        sub.data = &frame[sub.data - exact.data()];
+        result.frames.push_back(sub);
+    }
+    result.malformed = walker.isMalformed();
+    // a finished walker stays finished
+    CHECK(!walker.next(&sub));
+    return result;
+}
+
+static WalkResult walk(const std::vector<UInt8> &frame) {
+    return walk(frame, frame.size());
+}
+
+static void testEmpty() {
+    TestFrameBuilder builder;
+    WalkResult result = walk(builder.finish());
+    CHECK_EQ(result.frames.size(), 0);
+    CHECK(!result.malformed);
+
+    IPTSHIDFrameWalker null(nullptr, 100);
+    IPTSHIDSubFrame sub;
+    CHECK(!null.next(&sub));
+    CHECK(null.isMalformed());
+
+    // too short for the root header
+    UInt8 root[IPTS_HID_FRAME_HEADER_SIZE] = {IPTS_HID_FRAME_HEADER_SIZE};
+    IPTSHIDFrameWalker short_root(root, IPTS_HID_FRAME_HEADER_SIZE - 1);
+    CHECK(!short_root.next(&sub));
+    CHECK(short_root.isMalformed());
+    IPTSHIDFrameWalker only_root(root, IPTS_HID_FRAME_HEADER_SIZE);
+    CHECK(!only_root.next(&sub));
+    CHECK(!only_root.isMalformed());
+}
+
+static void testFrames() {
+    UInt8 metadata[10] = {1, 2, 3};
+    UInt8 heatmap[24] = {4, 5, 6};
+    UInt8 reports[5] = {7, 8, 9};
+    UInt8 raw[1] = {10};
+    TestFrameBuilder builder;
+    size_t first = builder.add(IPTS_HID_FRAME_TYPE_METADATA, metadata, sizeof(metadata));
+    builder.add(IPTS_HID_FRAME_TYPE_HEATMAP, heatmap, sizeof(heatmap));
+    builder.add(IPTS_HID_FRAME_TYPE_REPORTS, reports, sizeof(reports));
+    builder.add(IPTS_HID_FRAME_TYPE_RAW, raw, sizeof(raw));
+    builder.add(IPTS_HID_FRAME_TYPE_HEATMAP, nullptr, 0);
+    std::vector<UInt8> frame = builder.finish();
+
+    WalkResult result = walk(frame);
+    CHECK(!result.malformed);
+    CHECK_EQ(result.frames.size(), 5);
+    if (result.frames.size() != 5)
+        return;
+    CHECK_EQ(result.frames[0].type, IPTS_HID_FRAME_TYPE_METADATA);
+    CHECK(result.frames[0].data == &frame[first + IPTS_HID_FRAME_HEADER_SIZE]);
+    CHECK_EQ(result.frames[0].size, sizeof(metadata));
+    CHECK_EQ(result.frames[1].type, IPTS_HID_FRAME_TYPE_HEATMAP);
+    CHECK_EQ(result.frames[1].size, sizeof(heatmap));
+    CHECK_EQ(result.frames[1].data[0], 4);
+    CHECK_EQ(result.frames[2].type, IPTS_HID_FRAME_TYPE_REPORTS);
+    CHECK_EQ(result.frames[2].data[2], 9);
+    CHECK_EQ(result.frames[3].type, IPTS_HID_FRAME_TYPE_RAW);
+    CHECK_EQ(result.frames[3].size, 1);
+    CHECK_EQ(result.frames[4].size, 0);
+}
+
+static void testContainers() {
+    UInt8 data[4] = {0};
+    TestFrameBuilder builder;
+    builder.add(IPTS_HID_FRAME_TYPE_METADATA, data, 1);
+    size_t outer = builder.begin();
+    builder.add(IPTS_HID_FRAME_TYPE_HEATMAP, data, 2);
+    size_t inner = builder.begin();
+    builder.add(IPTS_HID_FRAME_TYPE_REPORTS, data, 3);
+    builder.end(inner);
+    builder.add(IPTS_HID_FRAME_TYPE_REPORTS, data, 4);
+    builder.end(outer);
+    size_t empty = builder.begin();
+    builder.end(empty);
+    builder.add(IPTS_HID_FRAME_TYPE_RAW, data, 0);
+
+    // containers are entered, everything else comes out in buffer order
+    WalkResult result = walk(builder.finish());
+    CHECK(!result.malformed);
+    CHECK_EQ(result.frames.size(), 5);
+    if (result.frames.size() != 5)
+        return;
+    for (UInt32 i = 0; i < 4; i++)
+        CHECK_EQ(result.frames[i].size, i + 1);
+    CHECK_EQ(result.frames[2].type, IPTS_HID_FRAME_TYPE_REPORTS);
+    CHECK_EQ(result.frames[4].type, IPTS_HID_FRAME_TYPE_RAW);
+}
+
+static void testDepthLimit() {
+    UInt8 data[3] = {0};
+    TestFrameBuilder builder;
+    size_t first = builder.begin();
+    size_t second = builder.begin();
+    builder.add(IPTS_HID_FRAME_TYPE_HEATMAP, data, sizeof(data));
+    builder.end(second);
+    builder.end(first);
+    WalkResult result = walk(builder.finish());
+    CHECK_EQ(result.frames.size(), 1);
+    CHECK(!result.malformed);
+
+    // the root and two containers are as deep as it goes, a third one is handed out whole
+    TestFrameBuilder deep;
+    first = deep.begin();
+    second = deep.begin();
+    size_t third = deep.begin();
+    deep.add(IPTS_HID_FRAME_TYPE_HEATMAP, data, sizeof(data));
+    deep.end(third);
+    deep.end(second);
+    deep.end(first);
+    result = walk(deep.finish());
+    CHECK(!result.malformed);
+    CHECK_EQ(result.frames.size(), 1);
+    if (result.frames.size() == 1) {
+        CHECK_EQ(result.frames[0].type, IPTS_HID_FRAME_TYPE_HID);
+        CHECK_EQ(result.frames[0].size, IPTS_HID_FRAME_HEADER_SIZE + sizeof(data));
+    }
+}
+
+static void testOversizedChild() {
+    UInt8 data[8] = {0};
+
+    // claims more than the root holds
+    TestFrameBuilder builder;
+    builder.add(IPTS_HID_FRAME_TYPE_METADATA, data, 2);
+    size_t child = builder.add(IPTS_HID_FRAME_TYPE_HEATMAP, data, sizeof(data));
+    builder.add(IPTS_HID_FRAME_TYPE_REPORTS, data, 2);
+    builder.patch(child, IPTS_HID_FRAME_HEADER_SIZE + sizeof(data) + 2 * IPTS_HID_FRAME_HEADER_SIZE + 3);
+    WalkResult result = walk(builder.finish());
+    CHECK(result.malformed);
+    // the frame before it is still good
+    CHECK_EQ(result.frames.size(), 1);
+
+    // fits the root, but not the container around it
+    TestFrameBuilder nested;
+    size_t container = nested.begin();
+    child = nested.add(IPTS_HID_FRAME_TYPE_HEATMAP, data, sizeof(data));
+    nested.end(container);
+    nested.add(IPTS_HID_FRAME_TYPE_REPORTS, data, sizeof(data));
+    nested.patch(child, IPTS_HID_FRAME_HEADER_SIZE + sizeof(data) + 1);
+    result = walk(nested.finish());
+    CHECK(result.malformed);
+    CHECK_EQ(result.frames.size(), 0);
+
+    // a container larger than its parent is not entered
+    TestFrameBuilder container_child;
+    container = container_child.begin();
+    container_child.add(IPTS_HID_FRAME_TYPE_HEATMAP, data, sizeof(data));
+    container_child.end(container);
+    container_child.finish();
+    container_child.patch(container, 0xFFFFFFFF);
+    result = walk(container_child.bytes);
+    CHECK(result.malformed);
+    CHECK_EQ(result.frames.size(), 0);
+}
+
+static void testUndersizedChild() {
+    UInt8 data[4] = {0};
+    for (UInt32 size = 0; size < IPTS_HID_FRAME_HEADER_SIZE; size++) {
+        TestFrameBuilder builder;
+        builder.add(IPTS_HID_FRAME_TYPE_METADATA, data, sizeof(data));
+        size_t child = builder.add(IPTS_HID_FRAME_TYPE_HEATMAP, data, sizeof(data));
+        builder.patch(child, size);
+        WalkResult result = walk(builder.finish());
+        // a size of 0 would never move on
+        CHECK(result.malformed);
+        CHECK_EQ(result.frames.size(), 1);
+    }
+}
+
+static void testRootSize() {
+    UInt8 data[6] = {1, 2, 3, 4, 5, 6};
+
+    // bytes after the root frame are not part of it
+    TestFrameBuilder builder;
+    builder.add(IPTS_HID_FRAME_TYPE_HEATMAP, data, sizeof(data));
+    std::vector<UInt8> frame = builder.finish();
+    frame.insert(frame.end(), IPTS_HID_FRAME_HEADER_SIZE + 1, 0xAA);
+    WalkResult result = walk(frame);
+    CHECK(!result.malformed);
+    CHECK_EQ(result.frames.size(), 1);
+
+    // a root claiming more than the buffer is limited to the buffer
+    builder.patch(3, 0x10000);
+    builder.add(IPTS_HID_FRAME_TYPE_REPORTS, data, sizeof(data));
+    result = walk(builder.bytes);
+    CHECK(!result.malformed);
+    CHECK_EQ(result.frames.size(), 2);
+}
+
+static void testTrailingBytes() {
+    UInt8 data[4] = {0};
+    for (UInt32 trailing = 1; trailing < IPTS_HID_FRAME_HEADER_SIZE; trailing++) {
+        // padding too short for another header ends the container, the walk goes on in its parent
+        TestFrameBuilder builder;
+        size_t container = builder.begin();
+        builder.add(IPTS_HID_FRAME_TYPE_HEATMAP, data, sizeof(data));
+        builder.bytes.insert(builder.bytes.end(), trailing, 0);
+        builder.end(container);
+        builder.add(IPTS_HID_FRAME_TYPE_REPORTS, data, sizeof(data));
+        WalkResult result = walk(builder.finish());
+        CHECK(!result.malformed);
+        CHECK_EQ(result.frames.size(), 2);
+    }
+}
+
+static void testTruncated() {
+    UInt8 data[16] = {0};
+    TestFrameBuilder builder;
+    builder.add(IPTS_HID_FRAME_TYPE_METADATA, data, 5);
+    size_t container = builder.begin();
+    builder.add(IPTS_HID_FRAME_TYPE_HEATMAP, data, sizeof(data));
+    builder.add(IPTS_HID_FRAME_TYPE_REPORTS, data, 9);
+    builder.end(container);
+    std::vector<UInt8> frame = builder.finish();
+    WalkResult whole = walk(frame);
+    CHECK_EQ(whole.frames.size(), 3);
+
+    // every cut of the frame returns a prefix of the whole walk and nothing past the cut
+    for (size_t size = 0; size < frame.size(); size++) {
+        WalkResult result = walk(frame, size);
+        CHECK(result.frames.size() < whole.frames.size());
+        for (size_t i = 0; i < result.frames.size(); i++) {
+            CHECK(result.frames[i].data == whole.frames[i].data);
+            CHECK_EQ(result.frames[i].size, whole.frames[i].size);
+        }
+        // a cut through the data of a child leaves its header claiming more than there is
+        for (size_t i = 0; i < whole.frames.size(); i++) {
+            const UInt8 *cut = &frame[0] + size;
+            if (cut > whole.frames[i].data && cut < whole.frames[i].data + whole.frames[i].size)
+                CHECK(result.malformed);
+        }
+    }
+}
+
+int main() {
+    testEmpty();
+    testFrames();
+    testContainers();
+    testDepthLimit();
+    testOversizedChild();
+    testUndersizedChild();
+    testRootSize();
+    testTrailingBytes();
+    testTruncated();
+    return TEST_RESULT();
+}
@@ -0,0 +1,248 @@
+//
+//  IPTSHostPoller.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#include <chrono>
+#include <string.h>
+
+#include "IPTSHostPoller.hpp"
+#include "IPTSStylusDecoder.hpp"
+
+// the simulated ME writes to host addresses where the real one uses physical ones
+static UInt64 hostAddress(const void *address) {
+    return static_cast<UInt64>(reinterpret_cast<uintptr_t>(address));
+}
+
+IPTSCommandStatus IPTSHostPoller::sendCommand(UInt32 code, const void *payload, UInt32 size, IPTSResponse *rsp) {
+    IPTSCommand cmd;
+    IPTSResponse local;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.code = code;
+    if (payload)
+        memcpy(cmd.payload, payload, size);
+    if (!rsp)
+        rsp = &local;
+    me->handleCommand(&cmd, size, rsp);
+    return rsp->status;
+}
+
+bool IPTSHostPoller::start(UInt64 now) {
+    IPTSResponse rsp;
+    if (sendCommand(IPTS_CMD_GET_DEVICE_INFO, nullptr, 0, &rsp) != IPTSCommandSuccess)
+        return false;
+    memcpy(&device_info, rsp.payload, sizeof(device_info));
+
+    // allocateDMAResources
+    for (int i = 0; i < IPTS_BUFFER_NUM; i++) {
+        rx_buffer[i].assign(device_info.data_size, 0);
+        feedback_buffer[i].assign(device_info.feedback_size, 0);
+    }
+    workqueue_buffer.assign(IPTS_WORKQUEUE_SIZE, 0);
+    tx_buffer.assign(device_info.feedback_size, 0);
+
+    IPTSSetModeCommand set_mode;
+    memset(&set_mode, 0, sizeof(set_mode));
+    set_mode.mode = IPTSModeDoorbell;
+    if (sendCommand(IPTS_CMD_SET_MODE, &set_mode, sizeof(set_mode)) != IPTSCommandSuccess)
+        return false;
+
+    IPTSSetMemoryWindowCommand set_mem;
+    memset(&set_mem, 0, sizeof(set_mem));
+    for (int i = 0; i < IPTS_BUFFER_NUM; i++) {
+        set_mem.data_buffer_addr_lower[i] = hostAddress(rx_buffer[i].data()) & 0xffffffff;
+        set_mem.data_buffer_addr_upper[i] = hostAddress(rx_buffer[i].data()) >> 32;
+
+        set_mem.feedback_buffer_addr_lower[i] = hostAddress(feedback_buffer[i].data()) & 0xffffffff;
+        set_mem.feedback_buffer_addr_upper[i] = hostAddress(feedback_buffer[i].data()) >> 32;
+    }
+    set_mem.workqueue_addr_lower = hostAddress(workqueue_buffer.data()) & 0xffffffff;
+    set_mem.workqueue_addr_upper = hostAddress(workqueue_buffer.data()) >> 32;
+
+    set_mem.doorbell_addr_lower = hostAddress(&doorbell_register) & 0xffffffff;
+    set_mem.doorbell_addr_upper = hostAddress(&doorbell_register) >> 32;
+
+    set_mem.host2me_addr_lower = hostAddress(tx_buffer.data()) & 0xffffffff;
+    set_mem.host2me_addr_upper = hostAddress(tx_buffer.data()) >> 32;
+
+    set_mem.workqueue_size = IPTS_WORKQUEUE_SIZE;
+    set_mem.workqueue_item_size = IPTS_WORKQUEUE_ITEM_SIZE;
+    if (sendCommand(IPTS_CMD_SET_MEM_WINDOW, &set_mem, sizeof(set_mem)) != IPTSCommandSuccess)
+        return false;
+
+    if (sendCommand(IPTS_CMD_READY_FOR_DATA, nullptr, 0) != IPTSCommandSuccess)
+        return false;
+    doorbell.setActions(this, classifyBuffer, handleBuffer, refillBuffers);
+    doorbell.resync(doorbell_register);
+    scheduler.start(now);
+    return true;
+}
+
+IPTSCommandStatus IPTSHostPoller::giveBack(UInt32 buffer) {
+    IPTSFeedbackCommand feedback;
+    memset(&feedback, 0, sizeof(feedback));
+    feedback.buffer = buffer;
+    return sendCommand(IPTS_CMD_FEEDBACK, &feedback, sizeof(feedback));
+}
+
+bool IPTSHostPoller::flushBuffer(UInt32 buffer, UInt32 *retries, bool *done) {
+    // retryQuiesceFeedback, every buffer has its own budget
+    IPTSCommandStatus status = giveBack(buffer);
+    *done = status == IPTSCommandSuccess;
+    return *done || (status == IPTSCommandRequestOutstanding && retries[buffer]++ < IPTS_QUIESCE_RETRIES);
+}
+
+bool IPTSHostPoller::stop() {
+    UInt32 retries[IPTS_TX_BUFFER + 1] = {0};
+    bool done;
+    stats.stop_time = 0;
+    feedback_retry = 0;
+
+    // older firmwares may not know the command, the flush stops them as well
+    IPTSQuiesceIOCommand quiesce;
+    memset(&quiesce, 0, sizeof(quiesce));
+    sendCommand(IPTS_CMD_QUIESCE_IO, &quiesce, sizeof(quiesce));
+    stats.stop_time += link_turnaround + link_command;
+
+    // flushBuffers, the commands of one round go out together and the next round starts once they are answered
+    UInt32 pending = (1 << IPTS_BUFFER_NUM) - 1;
+    while (pending) {
+        UInt32 sent = 0;
+        for (UInt32 i = 0; i < IPTS_BUFFER_NUM; i++) {
+            if (!(pending & (1 << i)))
+                continue;
+            sent++;
+            if (!flushBuffer(i, retries, &done))
+                return false;
+            if (done)
+                pending &= ~(1 << i);
+            if (serial_flush)
+                break;
+        }
+        stats.stop_time += link_turnaround + sent * link_command;
+    }
+
+    IPTSFeedbackHeader *header = reinterpret_cast<IPTSFeedbackHeader *>(tx_buffer.data());
+    memset(tx_buffer.data(), 0, tx_buffer.size());
+    header->cmd_type = IPTSFeedbackCommandTypeSoftReset;
+    header->buffer = IPTS_TX_BUFFER;
+    do {
+        if (!flushBuffer(IPTS_TX_BUFFER, retries, &done))
+            return false;
+        stats.stop_time += link_turnaround + link_command;
+    } while (!done);
+
+    stats.stop_time += link_turnaround + link_command;
+    return sendCommand(IPTS_CMD_CLEAR_MEM_WINDOW, nullptr, 0) == IPTSCommandSuccess;
+}
+
+void IPTSHostPoller::sendFeedback(UInt32 buffer) {
+    if (giveBack(buffer) == IPTSCommandRequestOutstanding) {
+        // given back again on the next poll, like retryFeedback
+        feedback_retry |= 1 << buffer;
+        return;
+    }
+    feedback_retry &= ~(1 << buffer);
+}
+
+const IPTSDataHeader *IPTSHostPoller::getHeader(UInt32 buffer) {
+    const IPTSDataHeader *header = reinterpret_cast<const IPTSDataHeader *>(rx_buffer[buffer].data());
+    if (header->size == 0 || header->size > rx_buffer[buffer].size() - sizeof(IPTSDataHeader))
+        return nullptr;
+    return header;
+}
+
+bool IPTSHostPoller::classifyBuffer(void *owner, UInt32 buffer, IPTSFrameClass *frame_class) {
+    IPTSHostPoller *poller = reinterpret_cast<IPTSHostPoller *>(owner);
+    const IPTSDataHeader *header = poller->getHeader(buffer);
+    *frame_class = IPTSFrameClassTouch;
+    if (!header || header->type != IPTSDataTypeHID || header->data[0] == IPTS_SINGLETOUCH_REPORT_ID ||
+        !IPTS_HID_REPORT_IS_TOUCH(header->data[0]) || header->size < 3)
+        return false;
+
+    // nothing is decoded on the host, a frame without a heatmap only carries pen reports
+    *frame_class = IPTSFrameClassStylus;
+    IPTSHIDFrameWalker walker(header->data + 3, header->size - 3);
+    IPTSHIDSubFrame sub;
+    while (walker.next(&sub)) {
+        if (sub.type == IPTS_HID_FRAME_TYPE_REPORTS) {
+            if (IPTSStylusDecoder::scan(sub.data, sub.size) & IPTS_REPORTS_HEATMAP)
+                *frame_class = IPTSFrameClassTouch;
+        } else if (sub.type != IPTS_HID_FRAME_TYPE_METADATA)
+            *frame_class = IPTSFrameClassTouch;
+    }
+    if (walker.isMalformed())
+        *frame_class = IPTSFrameClassTouch;
+    return true;
+}
+
+bool IPTSHostPoller::handleBuffer(void *owner, UInt32 buffer, UInt32 /* sequence */, bool deliver) {
+    IPTSHostPoller *poller = reinterpret_cast<IPTSHostPoller *>(owner);
+    IPTSHostPollerStatistics *stats = &poller->stats;
+    UInt64 latency = poller->poll_time - poller->me->getProduceTime(buffer);
+    stats->total_latency += latency;
+    if (latency > stats->max_latency)
+        stats->max_latency = latency;
+
+    const IPTSDataHeader *header = poller->getHeader(buffer);
+    if (!header) {
+        if (reinterpret_cast<const IPTSDataHeader *>(poller->rx_buffer[buffer].data())->size)
+            stats->malformed_frames++;
+        return !poller->hold_buffers;
+    }
+    if (header->type != IPTSDataTypeHID || header->data[0] == IPTS_SINGLETOUCH_REPORT_ID ||
+        !IPTS_HID_REPORT_IS_TOUCH(header->data[0]))
+        return !poller->hold_buffers;
+    if (header->size < 3) {
+        stats->malformed_frames++;
+        return !poller->hold_buffers;
+    }
+    if (!deliver)
+        stats->coalesced_frames++;
+
+    IPTSHIDFrameWalker walker(header->data + 3, header->size - 3);
+    IPTSHIDSubFrame sub;
+    while (walker.next(&sub))
+        stats->sub_frames++;
+    if (walker.isMalformed())
+        stats->malformed_frames++;
+    return !poller->hold_buffers;
+}
+
+void IPTSHostPoller::refillBuffers(void *owner, UInt32 mask) {
+    IPTSHostPoller *poller = reinterpret_cast<IPTSHostPoller *>(owner);
+    for (UInt32 i = 0; i < IPTS_BUFFER_NUM; i++) {
+        if (mask & (1 << i))
+            poller->sendFeedback(i);
+    }
+}
+
+UInt64 IPTSHostPoller::poll(UInt64 now) {
+    stats.wakeups++;
+    poll_time = now;
+    for (UInt32 i = 0; feedback_retry && i < IPTS_BUFFER_NUM; i++) {
+        if (feedback_retry & (1 << i)) {
+            stats.feedback_retries++;
+            sendFeedback(i);
+        }
+    }
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    UInt32 pending = doorbell.drain(doorbell_register);
+    stats.processing_time += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+    if (pending == IPTS_DOORBELL_RESET) {
+        // the simulated ME never resets on its own, start over like the driver does
+        scheduler.resync(now);
+        pending = 0;
+    }
+    if (!pending)
+        stats.empty_wakeups++;
+    stats.frames = doorbell.getFrames();
+    stats.doorbell_drops = doorbell.getDrops();
+
+    scheduler.update(now, pending);
+    return now + scheduler.nextPoll(now, false) * 1000ULL;
+}
@@ -0,0 +1,102 @@
+//
+//  IPTSHostPoller.hpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#ifndef IPTSHostPoller_hpp
+#define IPTSHostPoller_hpp
+
+#include <vector>
+
+#include "IPTSMESimulator.hpp"
+#include "IPTSPollScheduler.hpp"
+#include "IPTSDoorbell.hpp"
+
+struct IPTSHostPollerStatistics {
+    UInt64 frames;              // buffers handled
+    UInt64 wakeups;
+    UInt64 empty_wakeups;
+    UInt64 doorbell_drops;      // buffers the doorbell skipped past before they were polled
+    UInt64 malformed_frames;
+    UInt64 sub_frames;          // heatmap, metadata and report frames found in HID data
+    UInt64 coalesced_frames;    // frames for the daemon a newer one of their class followed in the same poll
+    UInt64 feedback_retries;
+    UInt64 total_latency;       // ns from the ME writing a buffer to it being handled
+    UInt64 max_latency;
+    UInt64 processing_time;     // wall clock ns spent handling buffers
+    UInt64 stop_time;           // ns the last stop took on the MEI link
+};
+
+/*
+ * The host half of the simulation. Brings the simulated ME up with the same command sequence handleMessage uses,
+ * then polls the doorbell with IPTSPollScheduler and drains it with IPTSDoorbell like pollTouchData. Where the
+ * driver hands a buffer to handleBuffer, the poller checks its size against the rx buffer, walks HID frames and
+ * gives the buffer back with FEEDBACK.
+ */
+class IPTSHostPoller {
+public:
+    explicit IPTSHostPoller(IPTSMESimulator *me) : me(me) {}
+
+    // GET_DEVICE_INFO -> SET_MODE -> SET_MEM_WINDOW -> READY_FOR_DATA, @return false if the ME refused a step
+    bool start(UInt64 now);
+
+    /*
+     * QUIESCE_IO, FEEDBACK for every rx buffer, the soft reset on the tx buffer and CLEAR_MEM_WINDOW like
+     * stopDevice, the buffers stay allocated until the poller is destroyed
+     *
+     * @return false if the ME refused a step or rejected a buffer more than IPTS_QUIESCE_RETRIES times
+     */
+    bool stop();
+
+    /*
+     * How long commands take on the MEI link, only for measuring stop_time
+     *
+     * @turnaround: ns from a response arriving to the next command going out
+     * @command: ns the ME takes for one command, it answers commands sent together one after another
+     */
+    void setLinkTiming(UInt64 turnaround, UInt64 command) { link_turnaround = turnaround; link_command = command; }
+
+    // Flush one buffer per FEEDBACK response while stopping instead of all at once
+    void flushSerially(bool serial) { serial_flush = serial; }
+
+    // Poll the doorbell at @now, @return when the next poll is due
+    UInt64 poll(UInt64 now);
+
+    // Stop handing buffers back, so the ME runs into buffers the host still owns
+    void holdBuffers(bool hold) { hold_buffers = hold; }
+
+    IPTSHostPollerStatistics stats {};
+    IPTSPollScheduler scheduler;
+    IPTSDoorbell doorbell;
+
+private:
+    IPTSCommandStatus sendCommand(UInt32 code, const void *payload, UInt32 size, IPTSResponse *rsp = nullptr);
+    const IPTSDataHeader *getHeader(UInt32 buffer);
+    IPTSCommandStatus giveBack(UInt32 buffer);
+    void sendFeedback(UInt32 buffer);
+    bool flushBuffer(UInt32 buffer, UInt32 *retries, bool *done);
+
+    // IPTSDoorbell actions
+    static bool classifyBuffer(void *owner, UInt32 buffer, IPTSFrameClass *frame_class);
+    static bool handleBuffer(void *owner, UInt32 buffer, UInt32 sequence, bool deliver);
+    static void refillBuffers(void *owner, UInt32 mask);
+
+    IPTSMESimulator *me;
+    IPTSGetDeviceInfoResponse device_info {};
+    std::vector<UInt8> rx_buffer[IPTS_BUFFER_NUM];
+    std::vector<UInt8> feedback_buffer[IPTS_BUFFER_NUM];
+    std::vector<UInt8> workqueue_buffer;
+    std::vector<UInt8> tx_buffer;
+    UInt32 doorbell_register {0};   // written by the ME
+    UInt64 poll_time {0};
+    UInt32 feedback_retry {0};
+    bool hold_buffers {false};
+    bool serial_flush {false};
+    UInt64 link_turnaround {0};
+    UInt64 link_command {0};
+};
+
+#endif /* IPTSHostPoller_hpp */
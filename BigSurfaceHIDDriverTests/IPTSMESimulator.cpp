@@ -0,0 +1,148 @@
+//
+//  IPTSMESimulator.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#include <string.h>
+
+#include "IPTSMESimulator.hpp"
+
+static void *hostAddress(UInt32 lower, UInt32 upper) {
+    return reinterpret_cast<void *>(static_cast<uintptr_t>((static_cast<UInt64>(upper) << 32) | lower));
+}
+
+IPTSMESimulator::IPTSMESimulator(UInt32 data_size, UInt32 feedback_size) {
+    memset(&device_info, 0, sizeof(device_info));
+    device_info.vendor_id = 0x045E;
+    device_info.device_id = 0x0C1A;
+    device_info.data_size = data_size;
+    device_info.feedback_size = feedback_size;
+    device_info.max_contacts = 10;
+    device_info.intf_eds = 2;
+    memset(rx_buffer, 0, sizeof(rx_buffer));
+    memset(host_owned, 0, sizeof(host_owned));
+    memset(produce_time, 0, sizeof(produce_time));
+}
+
+IPTSCommandStatus IPTSMESimulator::setMemoryWindow(const IPTSSetMemoryWindowCommand *set_mem) {
+    for (int i = 0; i < IPTS_BUFFER_NUM; i++) {
+        rx_buffer[i] = static_cast<UInt8 *>(hostAddress(set_mem->data_buffer_addr_lower[i], set_mem->data_buffer_addr_upper[i]));
+        if (!rx_buffer[i] || !hostAddress(set_mem->feedback_buffer_addr_lower[i], set_mem->feedback_buffer_addr_upper[i]))
+            return IPTSCommandInvalidParams;
+        host_owned[i] = false;
+    }
+    doorbell = static_cast<UInt32 *>(hostAddress(set_mem->doorbell_addr_lower, set_mem->doorbell_addr_upper));
+    if (!doorbell || set_mem->workqueue_size != IPTS_WORKQUEUE_SIZE || set_mem->workqueue_item_size != IPTS_WORKQUEUE_ITEM_SIZE)
+        return IPTSCommandInvalidParams;
+    *doorbell = 0;
+    return IPTSCommandSuccess;
+}
+
+void IPTSMESimulator::handleCommand(const IPTSCommand *cmd, UInt32 payload_size, IPTSResponse *rsp) {
+    memset(rsp, 0, sizeof(IPTSResponse));
+    rsp->code = cmd->code | 0x80000000;
+    rsp->status = IPTSCommandSuccess;
+
+    switch (cmd->code) {
+        case IPTS_CMD_GET_DEVICE_INFO:
+            memcpy(rsp->payload, &device_info, sizeof(device_info));
+            break;
+        case IPTS_CMD_SET_MODE: {
+            IPTSSetModeCommand set_mode;
+            if (payload_size < sizeof(set_mode)) {
+                rsp->status = IPTSCommandPayloadSizeError;
+                break;
+            }
+            memcpy(&set_mode, cmd->payload, sizeof(set_mode));
+            mode = set_mode.mode;
+            state = StateModeSet;
+            break;
+        }
+        case IPTS_CMD_SET_MEM_WINDOW: {
+            IPTSSetMemoryWindowCommand set_mem;
+            if (state != StateModeSet) {
+                rsp->status = IPTSCommandNotReady;
+                break;
+            }
+            if (payload_size < sizeof(set_mem)) {
+                rsp->status = IPTSCommandPayloadSizeError;
+                break;
+            }
+            memcpy(&set_mem, cmd->payload, sizeof(set_mem));
+            rsp->status = setMemoryWindow(&set_mem);
+            if (rsp->status == IPTSCommandSuccess)
+                state = StateMemoryWindowSet;
+            break;
+        }
+        case IPTS_CMD_READY_FOR_DATA:
+            if (state != StateMemoryWindowSet && state != StateStreaming) {
+                rsp->status = IPTSCommandNotReady;
+                break;
+            }
+            state = StateStreaming;
+            quiesced = false;
+            break;
+        case IPTS_CMD_QUIESCE_IO:
+            // the sensor stops writing to the rx buffers, the host flushes them with FEEDBACK afterwards
+            if (state != StateStreaming)
+                rsp->status = IPTSCommandNotReady;
+            else
+                quiesced = true;
+            break;
+        case IPTS_CMD_FEEDBACK: {
+            IPTSFeedbackCommand feedback;
+            memcpy(&feedback, cmd->payload, sizeof(feedback));
+            memcpy(rsp->payload, &feedback.buffer, sizeof(UInt32));
+            if (state != StateStreaming || feedback.buffer > IPTS_TX_BUFFER) {
+                rsp->status = state != StateStreaming ? IPTSCommandNotReady : IPTSCommandInvalidParams;
+                break;
+            }
+            if (feedback_rejects) {
+                feedback_rejects--;
+                rsp->status = IPTSCommandRequestOutstanding;
+                break;
+            }
+            if (feedback.buffer < IPTS_BUFFER_NUM)
+                host_owned[feedback.buffer] = false;
+            feedbacks++;
+            break;
+        }
+        case IPTS_CMD_CLEAR_MEM_WINDOW:
+            // the ME lets go of the host memory, nothing is written to it from now on
+            memset(rx_buffer, 0, sizeof(rx_buffer));
+            doorbell = nullptr;
+            state = StateIdle;
+            quiesced = false;
+            break;
+        default:
+            rsp->status = IPTSCommandInvalidParams;
+            break;
+    }
+}
+
+bool IPTSMESimulator::produce(UInt64 now, UInt8 type, const UInt8 *data, UInt32 size) {
+    if (state != StateStreaming || quiesced || mode != IPTSModeDoorbell || size > device_info.data_size - sizeof(IPTSDataHeader)) {
+        rejected++;
+        return false;
+    }
+
+    UInt32 buffer = *doorbell % IPTS_BUFFER_NUM;
+    if (host_owned[buffer])
+        overruns++;     // the ME does not wait for the host, the data in the buffer is lost
+
+    IPTSDataHeader *header = reinterpret_cast<IPTSDataHeader *>(rx_buffer[buffer]);
+    memset(header, 0, sizeof(IPTSDataHeader));
+    header->type = static_cast<IPTSDataType>(type);
+    header->size = size;
+    header->buffer = buffer;
+    memcpy(header->data, data, size);
+
+    host_owned[buffer] = true;
+    produce_time[buffer] = now;
+    produced++;
+    (*doorbell)++;
+    return true;
+}
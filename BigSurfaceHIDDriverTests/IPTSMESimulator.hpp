@@ -0,0 +1,89 @@
+//
+//  IPTSMESimulator.hpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#ifndef IPTSMESimulator_hpp
+#define IPTSMESimulator_hpp
+
+#include <vector>
+
+#include "IPTSProtocol.h"
+
+/*
+ * Stands in for the IPTS firmware behind SurfaceManagementEngineClient. It answers the commands the driver sends
+ * during bring up and shutdown, writes frames into the rx buffers set up with SET_MEM_WINDOW and rings the
+ * doorbell the same way the ME does in doorbell mode. The buffer addresses in SET_MEM_WINDOW are host addresses.
+ * Commands are answered right away, IPTSHostPoller keeps the time they would take on the MEI link.
+ */
+class IPTSMESimulator {
+public:
+    IPTSMESimulator(UInt32 data_size, UInt32 feedback_size);
+
+    /*
+     * Handle a command the way the ME answers it over MEI
+     *
+     * @payload_size: bytes of payload in @cmd
+     * @rsp: filled with the response, responses without payload only set code and status
+     */
+    void handleCommand(const IPTSCommand *cmd, UInt32 payload_size, IPTSResponse *rsp);
+
+    /*
+     * The sensor has produced data at @now, write it to the next rx buffer and ring the doorbell
+     *
+     * @return false if the data could not be delivered, e.g. before READY_FOR_DATA or when it is too large
+     */
+    bool produce(UInt64 now, UInt8 type, const UInt8 *data, UInt32 size);
+
+    // Number of FEEDBACK commands to reject with IPTSCommandRequestOutstanding before accepting them again
+    void rejectFeedback(UInt32 count) { feedback_rejects = count; }
+
+    bool isStreaming() { return state == StateStreaming && !quiesced; }
+
+    // QUIESCE_IO stopped the data flow, FEEDBACK is still accepted until CLEAR_MEM_WINDOW
+    bool isQuiesced() { return quiesced; }
+
+    // When the data in @buffer was produced, only for measuring latency
+    UInt64 getProduceTime(UInt32 buffer) { return produce_time[buffer % IPTS_BUFFER_NUM]; }
+
+    UInt64 getProduced() { return produced; }
+
+    // Buffers overwritten before the host gave them back with FEEDBACK
+    UInt64 getOverruns() { return overruns; }
+
+    // Data that never made it into a buffer
+    UInt64 getRejected() { return rejected; }
+
+    UInt64 getFeedbacks() { return feedbacks; }
+
+private:
+    enum State {
+        StateIdle,
+        StateModeSet,
+        StateMemoryWindowSet,
+        StateStreaming,
+    };
+
+    IPTSCommandStatus setMemoryWindow(const IPTSSetMemoryWindowCommand *set_mem);
+
+    IPTSGetDeviceInfoResponse device_info;
+    State state {StateIdle};
+    IPTSTouchMode mode {IPTSModeEvent};
+
+    UInt8 *rx_buffer[IPTS_BUFFER_NUM];
+    UInt32 *doorbell {nullptr};
+    bool host_owned[IPTS_BUFFER_NUM];
+    UInt64 produce_time[IPTS_BUFFER_NUM];
+    UInt32 feedback_rejects {0};
+    bool quiesced {false};
+
+    UInt64 produced {0};
+    UInt64 overruns {0};
+    UInt64 rejected {0};
+    UInt64 feedbacks {0};
+};
+
+#endif /* IPTSMESimulator_hpp */
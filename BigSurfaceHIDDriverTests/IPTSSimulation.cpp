@@ -0,0 +1,105 @@
+//
+//  IPTSSimulation.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "IPTSSimulation.hpp"
+#include "TestFrames.h"
+
+#define SIMULATION_START    100000000ULL    // ns, leaves the poller some idle polls first
+#define SIMULATION_TAIL     2000000000ULL   // ns of polling after the last frame
+#define TRACE_MAX_RECORD    (1 << 24)       // larger than any rx buffer, the file is damaged
+
+bool readTrace(const char *path, std::vector<IPTSSimulatedData> *stream) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    bool ok = true;
+    IPTSTraceRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.size > TRACE_MAX_RECORD) {
+            ok = false;
+            break;
+        }
+        IPTSSimulatedData data;
+        data.time = record.timestamp;
+        data.type = record.type;
+        data.data.resize(record.size);
+        if (record.size && fread(data.data.data(), record.size, 1, file) != 1) {
+            ok = false;
+            break;
+        }
+        // records are padded to 8 bytes
+        fseek(file, IPTS_TRACE_RECORD_SIZE(record.size) - sizeof(record) - record.size, SEEK_CUR);
+        stream->push_back(data);
+    }
+    fclose(file);
+    return ok;
+}
+
+bool writeTrace(const char *path, const std::vector<IPTSSimulatedData> &stream) {
+    static const UInt8 padding[8] = {0};
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    bool ok = true;
+    for (size_t i = 0; i < stream.size() && ok; i++) {
+        IPTSTraceRecord record;
+        memset(&record, 0, sizeof(record));
+        record.timestamp = stream[i].time;
+        record.doorbell = static_cast<UInt32>(i);
+        record.size = static_cast<UInt32>(stream[i].data.size());
+        record.type = stream[i].type;
+        record.buffer = i % IPTS_BUFFER_NUM;
+        size_t pad = IPTS_TRACE_RECORD_SIZE(record.size) - sizeof(record) - record.size;
+        ok = fwrite(&record, sizeof(record), 1, file) == 1 &&
+             (!record.size || fwrite(stream[i].data.data(), record.size, 1, file) == 1) &&
+             (!pad || fwrite(padding, pad, 1, file) == 1);
+    }
+    return fclose(file) == 0 && ok;
+}
+
+std::vector<IPTSSimulatedData> makeSyntheticStream(UInt32 rate, UInt64 duration, UInt32 rows, UInt32 columns) {
+    std::vector<IPTSSimulatedData> stream;
+    std::vector<UInt8> heatmap(rows * columns);
+    UInt64 period = 1000000000ULL / rate;
+    UInt32 n = 0;
+    for (UInt64 t = 0; t < duration; t += period, n++) {
+        // a second of touch, then half a second without
+        if (t % 1500000000ULL >= 1000000000ULL)
+            continue;
+        for (size_t i = 0; i < heatmap.size(); i++)
+            heatmap[i] = static_cast<UInt8>(0xff - ((i + n) & 0x3f));
+        TestFrameBuilder frame(TEST_HID_REPORT_ID, static_cast<UInt16>(n));
+        frame.addHeatmap(heatmap);
+        IPTSSimulatedData data;
+        data.time = t;
+        data.type = IPTSDataTypeHID;
+        data.data = frame.finish();
+        stream.push_back(data);
+    }
+    return stream;
+}
+
+void runSimulation(IPTSMESimulator *me, IPTSHostPoller *poller, const std::vector<IPTSSimulatedData> &stream, double speed) {
+    UInt64 next_poll = SIMULATION_START;
+    UInt64 end = SIMULATION_START;
+    for (size_t i = 0; i < stream.size(); i++) {
+        UInt64 at = SIMULATION_START + static_cast<UInt64>((stream[i].time - stream[0].time) / speed);
+        while (next_poll <= at)
+            next_poll = poller->poll(next_poll);
+        me->produce(at, stream[i].type, stream[i].data.data(), static_cast<UInt32>(stream[i].data.size()));
+        end = at;
+    }
+    end += SIMULATION_TAIL;
+    while (next_poll <= end)
+        next_poll = poller->poll(next_poll);
+}
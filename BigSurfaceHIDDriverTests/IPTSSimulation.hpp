@@ -0,0 +1,38 @@
+//
+//  IPTSSimulation.hpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#ifndef IPTSSimulation_hpp
+#define IPTSSimulation_hpp
+
+#include <vector>
+
+#include "IPTSHostPoller.hpp"
+
+struct IPTSSimulatedData {
+    UInt64 time;            // ns
+    UInt8 type;             // IPTSDataType
+    std::vector<UInt8> data;
+};
+
+// Reads a trace drained with kMethodReadTrace, @return false if the file is missing or a record is cut short
+bool readTrace(const char *path, std::vector<IPTSSimulatedData> *stream);
+
+// Writes @stream as a trace that kMethodReplayTrace accepts
+bool writeTrace(const char *path, const std::vector<IPTSSimulatedData> &stream);
+
+// HID frames with a @rows x @columns heatmap at @rate Hz for @duration ns, in bursts with idle gaps in between
+std::vector<IPTSSimulatedData> makeSyntheticStream(UInt32 rate, UInt64 duration, UInt32 rows, UInt32 columns);
+
+/*
+ * Plays @stream into @me while @poller polls the doorbell, on a simulated clock
+ *
+ * @speed: 1 keeps the recorded timing, 2 plays twice as fast and so on
+ */
+void runSimulation(IPTSMESimulator *me, IPTSHostPoller *poller, const std::vector<IPTSSimulatedData> &stream, double speed);
+
+#endif /* IPTSSimulation_hpp */
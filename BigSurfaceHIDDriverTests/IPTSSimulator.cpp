@@ -0,0 +1,114 @@
+//
+//  IPTSSimulator.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+//  Runs a recorded or synthetic IPTS stream through the simulated ME and the host poller and prints frames/sec,
+//  drops and latency.
+//
+//    IPTSSimulator [--trace file] [--speed x] [--rate hz] [--seconds n] [--heatmap rows cols]
+//                  [--data-size bytes] [--write-trace file] [--link turnaround_us command_us]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "IPTSSimulation.hpp"
+
+static void usage() {
+    fprintf(stderr, "usage: IPTSSimulator [--trace file] [--speed x] [--rate hz] [--seconds n] [--heatmap rows cols]\n"
+                    "                     [--data-size bytes] [--write-trace file] [--link turnaround_us command_us]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *trace = nullptr;
+    const char *output = nullptr;
+    double speed = 1;
+    UInt32 rate = 120;
+    UInt32 seconds = 10;
+    UInt32 rows = 44;
+    UInt32 columns = 64;
+    UInt32 data_size = 16384;
+    UInt64 turnaround = 100;
+    UInt64 command = 50;
+
+    for (int i = 1; i < argc; i++) {
+        bool more = i + 1 < argc;
+        if (!strcmp(argv[i], "--trace") && more)
+            trace = argv[++i];
+        else if (!strcmp(argv[i], "--write-trace") && more)
+            output = argv[++i];
+        else if (!strcmp(argv[i], "--speed") && more)
+            speed = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--rate") && more)
+            rate = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seconds") && more)
+            seconds = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--data-size") && more)
+            data_size = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--link") && i + 2 < argc) {
+            turnaround = atoi(argv[++i]);
+            command = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--heatmap") && i + 2 < argc) {
+            rows = atoi(argv[++i]);
+            columns = atoi(argv[++i]);
+        } else
+            usage();
+    }
+    if (speed <= 0 || !rate || !seconds || data_size <= sizeof(IPTSDataHeader))
+        usage();
+
+    std::vector<IPTSSimulatedData> stream;
+    if (trace) {
+        if (!readTrace(trace, &stream))
+            fprintf(stderr, "%s: truncated trace, using the %zu complete records\n", trace, stream.size());
+    } else {
+        stream = makeSyntheticStream(rate, seconds * 1000000000ULL, rows, columns);
+    }
+    if (stream.empty()) {
+        fprintf(stderr, "nothing to play\n");
+        return 1;
+    }
+    if (output && !writeTrace(output, stream)) {
+        fprintf(stderr, "%s: could not write the trace\n", output);
+        return 1;
+    }
+
+    IPTSMESimulator me(data_size, 4096);
+    IPTSHostPoller poller(&me);
+    if (!poller.start(0)) {
+        fprintf(stderr, "the simulated ME refused to start\n");
+        return 1;
+    }
+    runSimulation(&me, &poller, stream, speed);
+    poller.setLinkTiming(turnaround * 1000, command * 1000);
+    bool stopped = poller.stop();
+
+    // the same stop giving back one buffer per response, as the driver did before flushing them all at once
+    IPTSMESimulator serial_me(data_size, 4096);
+    IPTSHostPoller serial(&serial_me);
+    serial.start(0);
+    serial.setLinkTiming(turnaround * 1000, command * 1000);
+    serial.flushSerially(true);
+    serial.stop();
+
+    const IPTSHostPollerStatistics &stats = poller.stats;
+    printf("produced        %llu (%llu rejected)\n", (unsigned long long)me.getProduced(), (unsigned long long)me.getRejected());
+    printf("handled         %llu\n", (unsigned long long)stats.frames);
+    printf("ME overruns     %llu\n", (unsigned long long)me.getOverruns());
+    printf("doorbell drops  %llu\n", (unsigned long long)stats.doorbell_drops);
+    printf("malformed       %llu\n", (unsigned long long)stats.malformed_frames);
+    printf("wakeups         %llu (%llu empty)\n", (unsigned long long)stats.wakeups, (unsigned long long)stats.empty_wakeups);
+    printf("latency         mean %llu us, max %llu us\n",
+           (unsigned long long)(stats.frames ? stats.total_latency / stats.frames / 1000 : 0), (unsigned long long)stats.max_latency / 1000);
+    printf("frame period    %llu us\n", (unsigned long long)poller.scheduler.getFramePeriod() / 1000);
+    if (stats.processing_time)
+        printf("throughput      %.0f frames/s\n", stats.frames * 1e9 / stats.processing_time);
+    printf("sleep entry     %llu us%s, %llu us flushing one buffer per response\n", (unsigned long long)stats.stop_time / 1000,
+           stopped ? "" : " (failed)", (unsigned long long)serial.stats.stop_time / 1000);
+    return 0;
+}
@@ -0,0 +1,198 @@
+//
+//  PollSchedulerTest.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+//  Drives IPTSPollScheduler with a synthetic doorbell and compares it against the fixed BUSY/ACTIVE/IDLE
+//  tiers the driver used before, which polled one buffer at a time and kept polling every 5ms for 500ms
+//  after the last frame.
+//
+
+#include <vector>
+
+#include "IPTSPollScheduler.hpp"
+#include "TestHarness.h"
+
+#define MS 1000000ULL
+
+struct SimResult {
+    unsigned long long frames;
+    unsigned long long wakeups;
+    unsigned long long empty_wakeups;
+    unsigned long long total_latency;
+    unsigned long long max_latency;
+};
+
+// Bursts of frames at @period with a little jitter, separated by idle gaps
+static std::vector<UInt64> makeFrames(UInt64 period, unsigned int bursts, unsigned long long seed) {
+    TestRandom random(seed);
+    std::vector<UInt64> frames;
+    UInt64 t = 100 * MS;
+    for (unsigned int b = 0; b < bursts; b++) {
+        UInt64 end = t + random.range(300, 2000) * MS;
+        for (; t < end; t += period)
+            frames.push_back(t + random.range(0, 200000));
+        t += random.range(200, 3000) * MS;
+    }
+    return frames;
+}
+
+struct LegacyPolicy {
+    bool busy {false};
+    UInt64 last_activate {0};
+
+    // one buffer per poll, @return the delay until the next poll
+    UInt64 poll(UInt64 now, UInt32 pending, UInt32 *consumed) {
+        if (pending) {
+            *consumed = 1;
+            busy = true;
+            last_activate = now;
+            return 5 * MS;
+        }
+        *consumed = 0;
+        if (!busy)
+            return 50 * MS;
+        if (now - last_activate < 500 * MS)
+            return 5 * MS;
+        if (now - last_activate < 1500 * MS)
+            return 10 * MS;
+        busy = false;
+        return 50 * MS;
+    }
+};
+
+struct SchedulerPolicy {
+    IPTSPollScheduler scheduler;
+
+    UInt64 poll(UInt64 now, UInt32 pending, UInt32 *consumed) {
+        *consumed = pending;
+        scheduler.update(now, pending);
+        return scheduler.nextPoll(now, false) * 1000ULL;
+    }
+};
+
+template <class Policy>
+static SimResult simulate(Policy &policy, const std::vector<UInt64> &frames) {
+    SimResult result = {};
+    size_t consumed_until = 0;
+    UInt64 now = 0;
+    UInt64 end = frames.back() + 2000 * MS;
+    while (now < end) {
+        // the doorbell counts every frame that has arrived so far
+        size_t doorbell = consumed_until;
+        while (doorbell < frames.size() && frames[doorbell] <= now)
+            doorbell++;
+        UInt32 pending = static_cast<UInt32>(doorbell - consumed_until);
+
+        UInt32 consumed;
+        UInt64 delay = policy.poll(now, pending, &consumed);
+        result.wakeups++;
+        if (!consumed)
+            result.empty_wakeups++;
+        for (UInt32 i = 0; i < consumed; i++) {
+            UInt64 latency = now - frames[consumed_until + i];
+            result.total_latency += latency;
+            if (latency > result.max_latency)
+                result.max_latency = latency;
+        }
+        consumed_until += consumed;
+        result.frames += consumed;
+        now += delay;
+    }
+    return result;
+}
+
+static void report(const char *name, const SimResult &r) {
+    printf("  %-10s frames %6llu  wakeups %6llu  empty %6llu  mean latency %6llu us  max %6llu us\n", name,
+           r.frames, r.wakeups, r.empty_wakeups, r.total_latency / (r.frames ? r.frames : 1) / 1000, r.max_latency / 1000);
+}
+
+static void compare(UInt64 period) {
+    std::vector<UInt64> frames = makeFrames(period, 20, period);
+    LegacyPolicy legacy;
+    SchedulerPolicy learned;
+    SimResult old_result = simulate(legacy, frames);
+    SimResult new_result = simulate(learned, frames);
+
+    printf("%llu us frame period, %zu frames\n", (unsigned long long)period / 1000, frames.size());
+    report("tiers", old_result);
+    report("scheduler", new_result);
+
+    CHECK_EQ(new_result.frames, frames.size());
+    CHECK(new_result.total_latency / new_result.frames < old_result.total_latency / old_result.frames);
+    CHECK(new_result.wakeups < old_result.wakeups);
+    CHECK(new_result.empty_wakeups < old_result.empty_wakeups);
+
+    // the learned period stays within 5% of the real one
+    UInt64 learned_period = learned.scheduler.getFramePeriod();
+    CHECK(learned_period > period * 95 / 100 && learned_period < period * 105 / 100);
+}
+
+// Polls @scheduler from @now until @until as the driver would, @return the time of the last poll
+static UInt64 run(IPTSPollScheduler &scheduler, const std::vector<UInt64> &frames, size_t *consumed, UInt64 now, UInt64 until, bool *idle) {
+    UInt64 last = now;
+    while (now < until) {
+        size_t doorbell = *consumed;
+        while (doorbell < frames.size() && frames[doorbell] <= now)
+            doorbell++;
+        if (scheduler.update(now, static_cast<UInt32>(doorbell - *consumed)) && idle)
+            *idle = true;
+        *consumed = doorbell;
+        last = now;
+        now += scheduler.nextPoll(now, false) * 1000ULL;
+    }
+    return last;
+}
+
+static void testIdleTransition() {
+    IPTSPollScheduler scheduler;
+    scheduler.start(0);
+    CHECK(!scheduler.isBusy());
+    CHECK_EQ(scheduler.nextPoll(0, false), IPTS_IDLE_TIMEOUT * 1000);
+    CHECK_EQ(scheduler.nextPoll(0, true), IPTS_DOZE_TIMEOUT * 1000);
+
+    // a steady 10ms stream for one second
+    std::vector<UInt64> frames;
+    for (UInt64 t = 100 * MS; t < 1100 * MS; t += 10 * MS)
+        frames.push_back(t);
+    size_t consumed = 0;
+    bool idle = false;
+    UInt64 now = run(scheduler, frames, &consumed, 0, frames.back() + 5 * MS, &idle);
+    CHECK_EQ(consumed, frames.size());
+    CHECK(scheduler.isBusy());
+    CHECK(!idle);
+    UInt64 period = scheduler.getFramePeriod();
+    CHECK(period > 9500000 && period < 10500000);
+
+    // the next poll is armed shortly after the next frame is due
+    UInt32 delay = scheduler.nextPoll(now, false);
+    CHECK(now + delay * 1000ULL >= frames.back() + period);
+    CHECK(now + delay * 1000ULL <= frames.back() + period + 2 * MS);
+
+    // the stream stops, polling relaxes and then goes idle after IPTS_IDLE_THRESHOLD
+    now = run(scheduler, frames, &consumed, now + delay * 1000ULL, frames.back() + 100 * MS, &idle);
+    CHECK(!idle);
+    CHECK_EQ(scheduler.nextPoll(now, false), IPTS_ACTIVE_TIMEOUT * 1000);
+    UInt64 empty = scheduler.getEmptyWakeups();
+    now = run(scheduler, frames, &consumed, now + IPTS_ACTIVE_TIMEOUT * MS, frames.back() + 2 * IPTS_IDLE_THRESHOLD, &idle);
+    CHECK(idle);
+    CHECK(!scheduler.isBusy());
+    CHECK_EQ(scheduler.nextPoll(now, false), IPTS_IDLE_TIMEOUT * 1000);
+    // only the busy polls count as empty wakeups, the idle ones are expected to come up empty
+    CHECK(scheduler.getEmptyWakeups() - empty <= IPTS_IDLE_THRESHOLD / (IPTS_ACTIVE_TIMEOUT * MS) + 1);
+
+    // a lone frame found by an idle poll does not disturb the learned period
+    now += IPTS_IDLE_TIMEOUT * MS;
+    scheduler.update(now, 1);
+    CHECK(scheduler.isBusy());
+    CHECK_EQ(scheduler.getFramePeriod(), period);
+}
+
+int main() {
+    compare(8333333);   // 120Hz
+    compare(16666667);  // 60Hz
+    testIdleTransition();
+    return TEST_RESULT();
+}
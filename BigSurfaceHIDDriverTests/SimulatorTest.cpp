@@ -0,0 +1,243 @@
+//
+//  SimulatorTest.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "IPTSSimulation.hpp"
+#include "TestFrames.h"
+#include "TestHarness.h"
+
+#define DATA_SIZE       16384
+#define FEEDBACK_SIZE   4096
+
+static IPTSCommandStatus send(IPTSMESimulator *me, UInt32 code, const void *payload = nullptr, UInt32 size = 0) {
+    IPTSCommand cmd;
+    IPTSResponse rsp;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.code = code;
+    if (payload)
+        memcpy(cmd.payload, payload, size);
+    me->handleCommand(&cmd, size, &rsp);
+    CHECK_EQ(rsp.code, code | 0x80000000);
+    return rsp.status;
+}
+
+static void testBringUp() {
+    IPTSMESimulator me(DATA_SIZE, FEEDBACK_SIZE);
+    UInt8 data[16] = {0};
+
+    // nothing streams before the memory window is set up
+    CHECK_EQ(send(&me, IPTS_CMD_READY_FOR_DATA), IPTSCommandNotReady);
+    CHECK_EQ(send(&me, IPTS_CMD_SET_MEM_WINDOW, data, sizeof(data)), IPTSCommandNotReady);
+    CHECK(!me.produce(0, IPTSDataTypeHID, data, sizeof(data)));
+
+    IPTSHostPoller poller(&me);
+    CHECK(poller.start(0));
+    CHECK(me.isStreaming());
+    CHECK(me.produce(0, IPTSDataTypeHID, data, sizeof(data)));
+    // too large for the rx buffer
+    std::vector<UInt8> large(DATA_SIZE);
+    CHECK(!me.produce(0, IPTSDataTypeHID, large.data(), DATA_SIZE));
+    CHECK_EQ(me.getRejected(), 2);
+
+    poller.poll(1000000);
+    CHECK_EQ(poller.stats.frames, 1);
+    CHECK_EQ(me.getFeedbacks(), 1);
+
+    CHECK(poller.stop());
+    CHECK(!me.isStreaming());
+    CHECK(!me.produce(0, IPTSDataTypeHID, data, sizeof(data)));
+}
+
+static void testSteadyStream() {
+    IPTSMESimulator me(DATA_SIZE, FEEDBACK_SIZE);
+    IPTSHostPoller poller(&me);
+    CHECK(poller.start(0));
+    std::vector<IPTSSimulatedData> stream = makeSyntheticStream(120, 6000000000ULL, 44, 64);
+    runSimulation(&me, &poller, stream, 1);
+
+    CHECK_EQ(me.getProduced(), stream.size());
+    CHECK_EQ(poller.stats.frames, stream.size());
+    CHECK_EQ(me.getOverruns(), 0);
+    CHECK_EQ(poller.stats.doorbell_drops, 0);
+    CHECK_EQ(poller.stats.malformed_frames, 0);
+    CHECK_EQ(poller.stats.sub_frames, stream.size());
+    // a 120Hz stream is found within a fraction of its period
+    CHECK(poller.stats.total_latency / poller.stats.frames < 2000000);
+    UInt64 period = poller.scheduler.getFramePeriod();
+    CHECK(period > 8000000 && period < 8700000);
+}
+
+static void testHostFallsBehind() {
+    IPTSMESimulator me(DATA_SIZE, FEEDBACK_SIZE);
+    IPTSHostPoller poller(&me);
+    CHECK(poller.start(0));
+    std::vector<IPTSSimulatedData> stream = makeSyntheticStream(120, 500000000ULL, 44, 64);
+
+    // without feedback the ME keeps going and overwrites buffers the host still owns
+    poller.holdBuffers(true);
+    runSimulation(&me, &poller, stream, 1);
+    CHECK_EQ(me.getOverruns(), stream.size() - IPTS_BUFFER_NUM);
+    CHECK_EQ(me.getFeedbacks(), 0);
+
+    // all at once, the doorbell runs more than a ring ahead of the poller
+    IPTSMESimulator burst_me(DATA_SIZE, FEEDBACK_SIZE);
+    IPTSHostPoller burst_poller(&burst_me);
+    CHECK(burst_poller.start(0));
+    runSimulation(&burst_me, &burst_poller, stream, 1e6);
+    CHECK_EQ(burst_poller.stats.frames, IPTS_BUFFER_NUM);
+    CHECK_EQ(burst_poller.stats.doorbell_drops, stream.size() - IPTS_BUFFER_NUM);
+}
+
+static void testFeedbackRejected() {
+    IPTSMESimulator me(DATA_SIZE, FEEDBACK_SIZE);
+    IPTSHostPoller poller(&me);
+    CHECK(poller.start(0));
+    UInt8 data[16] = {0};
+    me.produce(0, IPTSDataTypeHID, data, sizeof(data));
+    me.rejectFeedback(1);
+    poller.poll(1000000);
+    CHECK_EQ(me.getFeedbacks(), 0);
+    // the rejected buffer is given back on the next poll
+    poller.poll(2000000);
+    CHECK_EQ(poller.stats.feedback_retries, 1);
+    CHECK_EQ(me.getFeedbacks(), 1);
+}
+
+static void testQuiesce() {
+    UInt8 data[16] = {0};
+    IPTSMESimulator me(DATA_SIZE, FEEDBACK_SIZE);
+    IPTSHostPoller poller(&me);
+    CHECK(poller.start(0));
+    poller.setLinkTiming(50000, 20000);
+
+    // the sensor goes quiet on QUIESCE_IO while buffers can still be given back
+    CHECK_EQ(send(&me, IPTS_CMD_QUIESCE_IO), IPTSCommandSuccess);
+    CHECK(me.isQuiesced());
+    CHECK(!me.isStreaming());
+    CHECK(!me.produce(0, IPTSDataTypeHID, data, sizeof(data)));
+    CHECK_EQ(me.getRejected(), 1);
+
+    // more rejects than one budget, but spread over the buffers
+    me.rejectFeedback(IPTS_QUIESCE_RETRIES + 4);
+    CHECK(poller.stop());
+    CHECK(!me.isQuiesced());
+    CHECK_EQ(me.getFeedbacks(), IPTS_BUFFER_NUM + 1);
+    // quiesce, three rounds of feedback as the rejects run out, the soft reset and clearing the window
+    CHECK_EQ(poller.stats.stop_time, 70000 + 2 * (50000 + 16 * 20000) + (50000 + 4 * 20000) + 70000 + 70000);
+
+    // one buffer per response takes a round trip for every buffer
+    IPTSMESimulator serial_me(DATA_SIZE, FEEDBACK_SIZE);
+    IPTSHostPoller serial(&serial_me);
+    CHECK(serial.start(0));
+    serial.setLinkTiming(50000, 20000);
+    serial.flushSerially(true);
+    CHECK(serial.stop());
+    CHECK_EQ(serial.stats.stop_time, 70000 + 16 * 70000 + 70000 + 70000);
+
+    // one buffer rejected past its budget gives up
+    IPTSMESimulator stuck_me(DATA_SIZE, FEEDBACK_SIZE);
+    IPTSHostPoller stuck(&stuck_me);
+    CHECK(stuck.start(0));
+    stuck.flushSerially(true);
+    stuck_me.rejectFeedback(IPTS_QUIESCE_RETRIES + 1);
+    CHECK(!stuck.stop());
+}
+
+static void testCoalescing() {
+    IPTSMESimulator me(DATA_SIZE, FEEDBACK_SIZE);
+    IPTSHostPoller poller(&me);
+    CHECK(poller.start(0));
+
+    std::vector<UInt8> heatmap(16 * 16, 0x80);
+    TestFrameBuilder touch;
+    touch.addHeatmap(heatmap);
+    std::vector<UInt8> touch_frame = touch.finish();
+    UInt8 reports[8] = {0};
+    TestFrameBuilder pen;
+    pen.add(IPTS_HID_FRAME_TYPE_REPORTS, reports, sizeof(reports));
+    std::vector<UInt8> pen_frame = pen.finish();
+
+    // three touch frames and two pen frames in one poll, only the newest of each class is delivered
+    me.produce(0, IPTSDataTypeHID, touch_frame.data(), static_cast<UInt32>(touch_frame.size()));
+    me.produce(0, IPTSDataTypeHID, pen_frame.data(), static_cast<UInt32>(pen_frame.size()));
+    me.produce(0, IPTSDataTypeHID, touch_frame.data(), static_cast<UInt32>(touch_frame.size()));
+    me.produce(0, IPTSDataTypeHID, pen_frame.data(), static_cast<UInt32>(pen_frame.size()));
+    me.produce(0, IPTSDataTypeHID, touch_frame.data(), static_cast<UInt32>(touch_frame.size()));
+    poller.poll(1000000);
+    CHECK_EQ(poller.stats.frames, 5);
+    CHECK_EQ(poller.stats.coalesced_frames, 3);
+    CHECK_EQ(poller.doorbell.getSequence(), 5);
+    CHECK_EQ(poller.doorbell.getMaxDrained(), 5);
+    CHECK_EQ(me.getFeedbacks(), 5);
+
+    // one buffer per poll leaves nothing to coalesce
+    poller.doorbell.setOptions(false, true);
+    me.produce(2000000, IPTSDataTypeHID, touch_frame.data(), static_cast<UInt32>(touch_frame.size()));
+    me.produce(2000000, IPTSDataTypeHID, touch_frame.data(), static_cast<UInt32>(touch_frame.size()));
+    poller.poll(3000000);
+    CHECK_EQ(poller.stats.frames, 6);
+    poller.poll(4000000);
+    CHECK_EQ(poller.stats.frames, 7);
+    CHECK_EQ(poller.stats.coalesced_frames, 3);
+
+    // a doorbell that went back is a reset, nothing is handled and polling goes on from there
+    IPTSDoorbell doorbell;
+    doorbell.resync(10);
+    CHECK_EQ(doorbell.drain(4), IPTS_DOORBELL_RESET);
+    CHECK_EQ(doorbell.getCurrent(), 4);
+    CHECK_EQ(doorbell.drain(4), 0);
+    CHECK_EQ(doorbell.getFrames(), 0);
+}
+
+static void testTraceRoundTrip() {
+    char path[] = "/tmp/ipts-trace-XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    close(fd);
+
+    std::vector<IPTSSimulatedData> stream = makeSyntheticStream(60, 1000000000ULL, 10, 12);
+    IPTSSimulatedData feature;
+    feature.time = stream.back().time + 1;
+    feature.type = IPTSDataTypeGetFeatures;
+    feature.data.assign(5, 0x06);   // not a multiple of 8, the record has to be padded
+    stream.push_back(feature);
+    CHECK(writeTrace(path, stream));
+
+    std::vector<IPTSSimulatedData> read;
+    CHECK(readTrace(path, &read));
+    CHECK_EQ(read.size(), stream.size());
+    for (size_t i = 0; i < read.size() && i < stream.size(); i++) {
+        CHECK_EQ(read[i].time, stream[i].time);
+        CHECK_EQ(read[i].type, stream[i].type);
+        CHECK(read[i].data == stream[i].data);
+    }
+
+    // a record cut short is reported, the complete ones before it are kept
+    CHECK_EQ(truncate(path, IPTS_TRACE_RECORD_SIZE(stream[0].data.size()) + sizeof(IPTSTraceRecord) + 1), 0);
+    read.clear();
+    CHECK(!readTrace(path, &read));
+    CHECK_EQ(read.size(), 1);
+    unlink(path);
+}
+
+int main() {
+    testBringUp();
+    testSteadyStream();
+    testHostFallsBehind();
+    testFeedbackRejected();
+    testQuiesce();
+    testCoalescing();
+    testTraceRoundTrip();
+    return TEST_RESULT();
+}
@@ -0,0 +1,375 @@
+//
+//  StylusDecoderTest.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+//  Checks the fixed point trigonometry of IPTSStylusDecoder against known angles and decodes hand built v1 and
+//  v2 stylus reports, including the cut short and oversized ones a damaged frame would contain.
+//
+
+#include <string.h>
+#include <vector>
+
+#include "IPTSStylusDecoder.hpp"
+#include "TestFrames.h"
+#include "TestHarness.h"
+
+#define MAX_SAMPLES     16
+
+// Appends stylus reports to a reports frame payload
+struct TestReports {
+    std::vector<UInt8> bytes;
+
+    // @return offset of the report header, to corrupt its size afterwards
+    size_t report(UInt8 type, const void *data, UInt16 size) {
+        IPTSReportHeader header = {type, 0, size};
+        size_t offset = bytes.size();
+        append(&header, sizeof(header));
+        append(data, size);
+        return offset;
+    }
+
+    template <typename T>
+    size_t stylus(UInt8 type, const std::vector<T> &elements, UInt8 count) {
+        std::vector<UInt8> data(sizeof(IPTSStylusReportHeader), 0);
+        IPTSStylusReportHeader header;
+        memset(&header, 0, sizeof(header));
+        header.elements = count;
+        header.serial = 0x12345678;
+        memcpy(data.data(), &header, sizeof(header));
+        const UInt8 *raw = reinterpret_cast<const UInt8 *>(elements.data());
+        data.insert(data.end(), raw, raw + elements.size() * sizeof(T));
+        return report(type, data.data(), static_cast<UInt16>(data.size()));
+    }
+
+    void patch(size_t offset, UInt16 size) { memcpy(&bytes[offset + offsetof(IPTSReportHeader, size)], &size, sizeof(UInt16)); }
+
+    UInt32 decode(IPTSStylusSample *samples, UInt32 max_samples = MAX_SAMPLES, UInt16 scan_time = 0) {
+        return IPTSStylusDecoder::decode(bytes.data(), static_cast<UInt32>(bytes.size()), scan_time, samples, max_samples);
+    }
+
+private:
+    void append(const void *data, size_t size) {
+        bytes.insert(bytes.end(), static_cast<const UInt8 *>(data), static_cast<const UInt8 *>(data) + size);
+    }
+};
+
+static IPTSStylusDataV1 v1(UInt8 mode, UInt16 x, UInt16 y, UInt16 pressure) {
+    IPTSStylusDataV1 data;
+    memset(&data, 0, sizeof(data));
+    data.mode = mode;
+    data.x = x;
+    data.y = y;
+    data.pressure = pressure;
+    return data;
+}
+
+static IPTSStylusDataV2 v2(UInt16 timestamp, UInt16 mode, UInt16 x, UInt16 y, UInt16 pressure, UInt16 altitude, UInt16 azimuth) {
+    IPTSStylusDataV2 data;
+    memset(&data, 0, sizeof(data));
+    data.timestamp = timestamp;
+    data.mode = mode;
+    data.x = x;
+    data.y = y;
+    data.pressure = pressure;
+    data.altitude = altitude;
+    data.azimuth = azimuth;
+    return data;
+}
+
+static bool near(SInt32 value, SInt32 expected, SInt32 tolerance) {
+    return value >= expected - tolerance && value <= expected + tolerance;
+}
+
+static void testSin() {
+    CHECK_EQ(IPTSStylusDecoder::sin(0), 0);
+    CHECK_EQ(IPTSStylusDecoder::sin(3000), 16383);
+    CHECK_EQ(IPTSStylusDecoder::sin(9000), 32767);
+    CHECK_EQ(IPTSStylusDecoder::sin(15000), 16383);
+    CHECK_EQ(IPTSStylusDecoder::sin(18000), 0);
+    CHECK_EQ(IPTSStylusDecoder::sin(27000), -32767);
+    CHECK_EQ(IPTSStylusDecoder::sin(-9000), -32767);
+    CHECK_EQ(IPTSStylusDecoder::sin(36000 + 9000), 32767);
+    // between two table entries, sin(45.5) * 32768 = 23371
+    CHECK(near(IPTSStylusDecoder::sin(4550), 23371, 2));
+
+    // odd and half period antisymmetric over the whole circle
+    for (SInt32 angle = -36000; angle <= 36000; angle += 250) {
+        SInt32 value = IPTSStylusDecoder::sin(angle);
+        CHECK(value >= -32767 && value <= 32767);
+        CHECK(near(value, -IPTSStylusDecoder::sin(-angle), 0));
+        CHECK(near(IPTSStylusDecoder::sin(angle + 18000), -value, 1));
+    }
+}
+
+// CORDIC with a rounded table, a tenth of a degree off at most
+static void testAtan2() {
+    CHECK_EQ(IPTSStylusDecoder::atan2(0, 0), 0);
+    // the axes stay inside the range
+    CHECK_EQ(IPTSStylusDecoder::atan2(0, 1000), 0);
+    CHECK_EQ(IPTSStylusDecoder::atan2(0, 32767), 0);
+    CHECK(near(IPTSStylusDecoder::atan2(1000, 1000), 4500, 10));
+    CHECK(near(IPTSStylusDecoder::atan2(1000, 0), 9000, 10));
+    CHECK(near(IPTSStylusDecoder::atan2(1000, -1000), 13500, 10));
+    CHECK(near(IPTSStylusDecoder::atan2(0, -1000), 18000, 10));
+    // atan(1/2) = 26.57 degrees
+    CHECK(near(IPTSStylusDecoder::atan2(16384, 32767), 2657, 10));
+    CHECK(near(IPTSStylusDecoder::atan2(32767, -16384), 9000 + 2657, 10));
+    for (SInt32 y = 0; y <= 32767; y += 1024) {
+        for (SInt32 x = -32767; x <= 32767; x += 1024) {
+            SInt32 angle = IPTSStylusDecoder::atan2(y, x);
+            CHECK(angle >= 0 && angle <= 18000);
+        }
+    }
+}
+
+static void testTilt() {
+    UInt16 x_tilt, y_tilt;
+
+    // no altitude reported, upright
+    IPTSStylusDecoder::computeTilt(0, 12345, &x_tilt, &y_tilt);
+    CHECK_EQ(x_tilt, IPTS_STYLUS_TILT_CENTER);
+    CHECK_EQ(y_tilt, IPTS_STYLUS_TILT_CENTER);
+
+    // 45 degrees from the normal towards azimuth 0 tilts along x only
+    IPTSStylusDecoder::computeTilt(4500, 0, &x_tilt, &y_tilt);
+    CHECK(near(x_tilt, IPTS_STYLUS_TILT_CENTER + 4500, 5));
+    CHECK(near(y_tilt, IPTS_STYLUS_TILT_CENTER, 5));
+
+    IPTSStylusDecoder::computeTilt(4500, 9000, &x_tilt, &y_tilt);
+    CHECK(near(x_tilt, IPTS_STYLUS_TILT_CENTER, 5));
+    CHECK(near(y_tilt, IPTS_STYLUS_TILT_CENTER - 4500, 5));
+
+    IPTSStylusDecoder::computeTilt(3000, 18000, &x_tilt, &y_tilt);
+    CHECK(near(x_tilt, IPTS_STYLUS_TILT_CENTER - 3000, 5));
+    CHECK(near(y_tilt, IPTS_STYLUS_TILT_CENTER, 5));
+
+    // lying flat is the end of the range, never beyond it
+    for (UInt32 azimuth = 0; azimuth < 36000; azimuth += 500) {
+        IPTSStylusDecoder::computeTilt(9000, azimuth, &x_tilt, &y_tilt);
+        CHECK(x_tilt <= 2 * IPTS_STYLUS_TILT_CENTER);
+        CHECK(y_tilt <= 2 * IPTS_STYLUS_TILT_CENTER);
+    }
+}
+
+static void testDecodeV1() {
+    TestReports reports;
+    std::vector<IPTSStylusDataV1> elements;
+    elements.push_back(v1(IPTS_STYLUS_MODE_PROXIMITY, 100, 200, 0));
+    elements.push_back(v1(IPTS_STYLUS_MODE_PROXIMITY | IPTS_STYLUS_MODE_TOUCH, 4800, 3600, 512));
+    reports.stylus(IPTS_REPORT_TYPE_STYLUS_V1, elements, 2);
+
+    IPTSStylusSample samples[MAX_SAMPLES];
+    CHECK_EQ(reports.decode(samples, MAX_SAMPLES, 0x4321), 2);
+    CHECK_EQ(samples[0].mode, IPTS_STYLUS_MODE_PROXIMITY);
+    CHECK_EQ(samples[0].x, 100);
+    CHECK_EQ(samples[0].y, 200);
+    CHECK_EQ(samples[1].mode, IPTS_STYLUS_MODE_PROXIMITY | IPTS_STYLUS_MODE_TOUCH);
+    CHECK_EQ(samples[1].x, 4800);
+    CHECK_EQ(samples[1].y, 3600);
+    // v1 pressure is 0 - 1024
+    CHECK_EQ(samples[1].pressure, 2048);
+    for (int i = 0; i < 2; i++) {
+        CHECK_EQ(samples[i].scan_time, 0x4321);
+        CHECK_EQ(samples[i].x_tilt, IPTS_STYLUS_TILT_CENTER);
+        CHECK_EQ(samples[i].y_tilt, IPTS_STYLUS_TILT_CENTER);
+    }
+}
+
+static void testDecodeV2() {
+    TestReports reports;
+    std::vector<IPTSStylusDataV2> elements;
+    elements.push_back(v2(0x1111, IPTS_STYLUS_MODE_PROXIMITY | IPTS_STYLUS_MODE_TOUCH | IPTS_STYLUS_MODE_BUTTON,
+                          1234, 5678, 3000, 4500, 0));
+    elements.push_back(v2(0x2222, IPTS_STYLUS_MODE_PROXIMITY | IPTS_STYLUS_MODE_RUBBER, 9600, 7200, 0, 0, 0));
+    reports.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 2);
+
+    IPTSStylusSample samples[MAX_SAMPLES];
+    CHECK_EQ(reports.decode(samples, MAX_SAMPLES, 0x4321), 2);
+    CHECK_EQ(samples[0].mode, IPTS_STYLUS_MODE_PROXIMITY | IPTS_STYLUS_MODE_TOUCH | IPTS_STYLUS_MODE_BUTTON);
+    CHECK_EQ(samples[0].x, 1234);
+    CHECK_EQ(samples[0].y, 5678);
+    CHECK_EQ(samples[0].pressure, 3000);
+    CHECK_EQ(samples[0].scan_time, 0x1111);
+    CHECK(near(samples[0].x_tilt, IPTS_STYLUS_TILT_CENTER + 4500, 5));
+    CHECK(near(samples[0].y_tilt, IPTS_STYLUS_TILT_CENTER, 5));
+    CHECK_EQ(samples[1].mode, IPTS_STYLUS_MODE_PROXIMITY | IPTS_STYLUS_MODE_RUBBER);
+    CHECK_EQ(samples[1].x, IPTS_STYLUS_MAX_X);
+    CHECK_EQ(samples[1].y, IPTS_STYLUS_MAX_Y);
+    CHECK_EQ(samples[1].scan_time, 0x2222);
+    CHECK_EQ(samples[1].x_tilt, IPTS_STYLUS_TILT_CENTER);
+}
+
+static void testClamp() {
+    TestReports reports;
+    std::vector<IPTSStylusDataV2> elements;
+    elements.push_back(v2(0, IPTS_STYLUS_MODE_TOUCH, 0xffff, 0xffff, 0xffff, 0, 0));
+    reports.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 1);
+    std::vector<IPTSStylusDataV1> old;
+    old.push_back(v1(IPTS_STYLUS_MODE_TOUCH, 0xffff, 0xffff, 0xffff));
+    reports.stylus(IPTS_REPORT_TYPE_STYLUS_V1, old, 1);
+
+    IPTSStylusSample samples[MAX_SAMPLES];
+    CHECK_EQ(reports.decode(samples), 2);
+    for (int i = 0; i < 2; i++) {
+        CHECK_EQ(samples[i].x, IPTS_STYLUS_MAX_X);
+        CHECK_EQ(samples[i].y, IPTS_STYLUS_MAX_Y);
+        CHECK_EQ(samples[i].pressure, IPTS_STYLUS_MAX_PRESSURE);
+    }
+}
+
+static void testOtherReports() {
+    TestReports reports;
+    UInt8 other[12] = {0};
+    std::vector<IPTSStylusDataV2> elements;
+    elements.push_back(v2(7, IPTS_STYLUS_MODE_PROXIMITY, 10, 20, 0, 0, 0));
+
+    // reports the decoder does not know are skipped by their size
+    reports.report(0x25, other, sizeof(other));
+    reports.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 1);
+    reports.report(0x00, other, 0);
+    reports.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 1);
+
+    IPTSStylusSample samples[MAX_SAMPLES];
+    CHECK_EQ(reports.decode(samples), 2);
+    CHECK_EQ(samples[0].x, 10);
+    CHECK_EQ(samples[1].y, 20);
+
+    TestReports none;
+    CHECK_EQ(none.decode(samples), 0);
+    none.report(0x25, other, sizeof(other));
+    CHECK_EQ(none.decode(samples), 0);
+}
+
+// Only frames with reports the decoder skips need the daemon when the driver decodes the pen
+static void testScan() {
+    std::vector<IPTSStylusDataV2> elements;
+    elements.push_back(v2(3, IPTS_STYLUS_MODE_PROXIMITY, 10, 20, 0, 0, 0));
+    UInt8 window[24] = {0};
+
+    TestReports stylus;
+    stylus.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 1);
+    stylus.stylus(IPTS_REPORT_TYPE_STYLUS_V1, std::vector<IPTSStylusDataV1>(1, v1(IPTS_STYLUS_MODE_PROXIMITY, 1, 2, 3)), 1);
+    CHECK_EQ(IPTSStylusDecoder::scan(stylus.bytes.data(), static_cast<UInt32>(stylus.bytes.size())), IPTS_REPORTS_STYLUS);
+
+    // DFT windows of an MPP 2 pen next to the samples
+    TestReports dft = stylus;
+    dft.report(0x5c, window, sizeof(window));
+    CHECK_EQ(IPTSStylusDecoder::scan(dft.bytes.data(), static_cast<UInt32>(dft.bytes.size())), IPTS_REPORTS_STYLUS | IPTS_REPORTS_OTHER);
+
+    TestReports heatmap;
+    heatmap.report(IPTS_REPORT_TYPE_HEATMAP, window, sizeof(window));
+    CHECK_EQ(IPTSStylusDecoder::scan(heatmap.bytes.data(), static_cast<UInt32>(heatmap.bytes.size())), IPTS_REPORTS_HEATMAP);
+
+    // a cut short report may be anything
+    TestReports cut = stylus;
+    size_t offset = cut.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 1);
+    cut.patch(offset, 0xffff);
+    CHECK_EQ(IPTSStylusDecoder::scan(cut.bytes.data(), static_cast<UInt32>(cut.bytes.size())), IPTS_REPORTS_STYLUS | IPTS_REPORTS_OTHER);
+    CHECK_EQ(IPTSStylusDecoder::scan(stylus.bytes.data(), static_cast<UInt32>(stylus.bytes.size() - 1)), IPTS_REPORTS_STYLUS | IPTS_REPORTS_OTHER);
+    CHECK_EQ(IPTSStylusDecoder::scan(nullptr, 0), 0);
+}
+
+static void testElementCount() {
+    std::vector<IPTSStylusDataV2> elements;
+    for (int i = 0; i < 4; i++)
+        elements.push_back(v2(i, IPTS_STYLUS_MODE_PROXIMITY, 100 * i, 0, 0, 0, 0));
+    IPTSStylusSample samples[MAX_SAMPLES];
+
+    // the header count limits the elements
+    TestReports fewer;
+    fewer.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 3);
+    CHECK_EQ(fewer.decode(samples), 3);
+    CHECK_EQ(samples[2].x, 200);
+
+    // and never reads past the report
+    TestReports more;
+    more.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 200);
+    CHECK_EQ(more.decode(samples), 4);
+
+    // a trailing partial element is ignored
+    TestReports partial;
+    size_t offset = partial.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 4);
+    partial.patch(offset, sizeof(IPTSStylusReportHeader) + 4 * sizeof(IPTSStylusDataV2) - 1);
+    CHECK_EQ(partial.decode(samples), 3);
+
+    // too short for the stylus header, the next report is still decoded
+    TestReports short_header;
+    UInt8 stub[4] = {1, 0, 0, 0};
+    short_header.report(IPTS_REPORT_TYPE_STYLUS_V2, stub, sizeof(stub));
+    short_header.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 4);
+    CHECK_EQ(short_header.decode(samples), 4);
+
+    // the caller's array is never overrun
+    CHECK_EQ(more.decode(samples, 2), 2);
+    CHECK_EQ(more.decode(samples, 0), 0);
+}
+
+static void testTruncated() {
+    std::vector<IPTSStylusDataV2> elements;
+    elements.push_back(v2(1, IPTS_STYLUS_MODE_PROXIMITY, 10, 10, 0, 0, 0));
+    elements.push_back(v2(2, IPTS_STYLUS_MODE_PROXIMITY, 20, 20, 0, 0, 0));
+    IPTSStylusSample samples[MAX_SAMPLES];
+
+    // a report claiming more than is left ends the frame, the reports before it are kept
+    TestReports oversized;
+    oversized.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 2);
+    size_t offset = oversized.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 2);
+    oversized.patch(offset, 0xffff);
+    CHECK_EQ(oversized.decode(samples), 2);
+
+    // every cut of a valid payload decodes only the reports that are complete
+    TestReports complete;
+    complete.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 2);
+    size_t first = complete.bytes.size();
+    complete.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 2);
+    for (size_t size = 0; size <= complete.bytes.size(); size++) {
+        std::vector<UInt8> cut(complete.bytes.begin(), complete.bytes.begin() + size);
+        UInt32 num = IPTSStylusDecoder::decode(cut.data(), static_cast<UInt32>(size), 0, samples, MAX_SAMPLES);
+        CHECK_EQ(num, size == complete.bytes.size() ? 4 : size >= first ? 2 : 0);
+    }
+}
+
+// A reports frame inside a HID frame, walked the way splitFrame does
+static void testFrame() {
+    TestReports reports;
+    std::vector<IPTSStylusDataV2> elements;
+    elements.push_back(v2(9, IPTS_STYLUS_MODE_PROXIMITY | IPTS_STYLUS_MODE_TOUCH, 4000, 3000, 1000, 0, 0));
+    reports.stylus(IPTS_REPORT_TYPE_STYLUS_V2, elements, 1);
+
+    TestFrameBuilder builder;
+    size_t container = builder.begin();
+    builder.add(IPTS_HID_FRAME_TYPE_REPORTS, reports.bytes.data(), static_cast<UInt32>(reports.bytes.size()));
+    builder.end(container);
+    std::vector<UInt8> frame = builder.finish();
+
+    IPTSHIDFrameWalker walker(&frame[3], static_cast<UInt32>(frame.size() - 3));
+    IPTSHIDSubFrame sub;
+    IPTSStylusSample samples[MAX_SAMPLES];
+    UInt32 num = 0;
+    while (walker.next(&sub)) {
+        CHECK_EQ(sub.type, IPTS_HID_FRAME_TYPE_REPORTS);
+        num += IPTSStylusDecoder::decode(sub.data, sub.size, 0, samples + num, MAX_SAMPLES - num);
+    }
+    CHECK(!walker.isMalformed());
+    CHECK_EQ(num, 1);
+    CHECK_EQ(samples[0].x, 4000);
+    CHECK_EQ(samples[0].pressure, 1000);
+}
+
+int main() {
+    testSin();
+    testAtan2();
+    testTilt();
+    testDecodeV1();
+    testDecodeV2();
+    testClamp();
+    testOtherReports();
+    testScan();
+    testElementCount();
+    testTruncated();
+    testFrame();
+    return TEST_RESULT();
+}
@@ -0,0 +1,78 @@
+//
+//  TestFrames.h
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#ifndef TestFrames_h
+#define TestFrames_h
+
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+#include "IPTSContactDetector.hpp"
+#include "IPTSHIDFrameWalker.hpp"
+
+#define TEST_HID_REPORT_ID  0x0B    // one of the IPTS_HID_REPORT_IS_TOUCH report ids
+
+/*
+ * Builds HID frames the way the firmware lays them out:
+ * [report id][u16 timestamp][root header][frames...], where every header is
+ * [u32 size including the header][reserved][u8 type][reserved].
+ */
+class TestFrameBuilder {
+public:
+    explicit TestFrameBuilder(UInt8 report_id = TEST_HID_REPORT_ID, UInt16 timestamp = 0) {
+        bytes.push_back(report_id);
+        bytes.push_back(timestamp & 0xff);
+        bytes.push_back(timestamp >> 8);
+        root = header(IPTS_HID_FRAME_TYPE_HID);
+    }
+
+    // @return the offset of the new frame header, so the test can corrupt it afterwards
+    size_t add(UInt8 type, const void *data, UInt32 size) {
+        size_t offset = header(type);
+        bytes.insert(bytes.end(), static_cast<const UInt8 *>(data), static_cast<const UInt8 *>(data) + size);
+        patch(offset, IPTS_HID_FRAME_HEADER_SIZE + size);
+        return offset;
+    }
+
+    // A heatmap frame, the heatmap behind its IPTSHeatmapHeader
+    size_t addHeatmap(const std::vector<UInt8> &heatmap) {
+        std::vector<UInt8> data(sizeof(IPTSHeatmapHeader), 0);
+        UInt32 size = static_cast<UInt32>(heatmap.size());
+        memcpy(&data[offsetof(IPTSHeatmapHeader, size)], &size, sizeof(UInt32));
+        data.insert(data.end(), heatmap.begin(), heatmap.end());
+        return add(IPTS_HID_FRAME_TYPE_HEATMAP, data.data(), static_cast<UInt32>(data.size()));
+    }
+
+    // Frames added until end() go into a container
+    size_t begin() { return header(IPTS_HID_FRAME_TYPE_HID); }
+
+    void end(size_t container) { patch(container, static_cast<UInt32>(bytes.size() - container)); }
+
+    std::vector<UInt8> finish() {
+        patch(root, static_cast<UInt32>(bytes.size() - root));
+        return bytes;
+    }
+
+    // Overwrites the size field of the header at @offset
+    void patch(size_t offset, UInt32 size) { memcpy(&bytes[offset], &size, sizeof(UInt32)); }
+
+    std::vector<UInt8> bytes;
+
+private:
+    size_t header(UInt8 type) {
+        size_t offset = bytes.size();
+        bytes.resize(offset + IPTS_HID_FRAME_HEADER_SIZE, 0);
+        bytes[offset + 5] = type;
+        return offset;
+    }
+
+    size_t root;
+};
+
+#endif /* TestFrames_h */
@@ -0,0 +1,46 @@
+//
+//  TestHarness.h
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+
+#ifndef TestHarness_h
+#define TestHarness_h
+
+#include <stdio.h>
+
+// Minimal checks for the host tests, a failed check is reported and makes the test exit with 1
+static int test_failures __attribute__((unused)) = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+    long long _a = (long long)(a), _b = (long long)(b); \
+    if (_a != _b) { \
+        fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define TEST_RESULT() (test_failures ? (fprintf(stderr, "%d check(s) failed\n", test_failures), 1) : 0)
+
+// Deterministic generator, so every run sees the same synthetic input
+struct TestRandom {
+    unsigned long long state;
+    explicit TestRandom(unsigned long long seed) : state(seed) {}
+    unsigned int next() {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (unsigned int)(state >> 33);
+    }
+    // uniform in [lo, hi]
+    long long range(long long lo, long long hi) { return lo + (long long)(next() % (unsigned long long)(hi - lo + 1)); }
+};
+
+#endif /* TestHarness_h */
@@ -0,0 +1,203 @@
+//
+//  TraceTest.cpp
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+//  Plays captures drained with kMethodReadTrace through IPTSContactDetector and IPTSStylusDecoder the way
+//  splitFrame drives them, metadata configuring the detector, heatmaps going to it and reports frames to the
+//  decoder. Every capture has to keep the invariants the HID stack relies on:
+//
+//    TraceTest [capture.trace...]
+//
+//  Without arguments it plays the captures in corpus/trace and also checks what they are known to hold:
+//    finger_pen.trace    48 frames of a 16x24 sensor at 120 Hz, metadata in the first one. A finger slides along
+//                        row 8 in frames 1 - 40, a second one rests in row 3 in frames 10 - 25. A pen hovers in
+//                        frames 5 - 35 and touches in 10 - 30 with one v2 sample per frame, frame 20 also carries a
+//                        DFT window. A GET_FEATURES response sits between frames 12 and 13.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "IPTSContactDetector.hpp"
+#include "IPTSSimulation.hpp"
+#include "IPTSStylusDecoder.hpp"
+#include "TestHarness.h"
+
+#define MAX_SAMPLES     16
+#define CAPTURE_ROWS    16
+#define CAPTURE_COLUMNS 24
+
+struct TraceContact {
+    UInt32 frame;       // index of the heatmap in the capture
+    IPTSContact contact;
+};
+
+struct TraceResult {
+    UInt32 records {0};
+    UInt32 hid_frames {0};
+    UInt32 heatmaps {0};
+    UInt32 detected_heatmaps {0};   // heatmaps the detector took, the others would go to the daemon
+    UInt32 foreign_reports {0};     // reports frames that still need the daemon with stylus decoding on
+    std::vector<TraceContact> contacts;
+    std::vector<IPTSStylusSample> samples;
+};
+
+static void playFrame(IPTSContactDetector *detector, const std::vector<UInt8> &data, TraceResult *result) {
+    if (data.size() < 3 || data[0] == IPTS_SINGLETOUCH_REPORT_ID || !IPTS_HID_REPORT_IS_TOUCH(data[0]))
+        return;
+    result->hid_frames++;
+
+    UInt16 scan_time;
+    memcpy(&scan_time, &data[1], sizeof(UInt16));
+    IPTSHIDFrameWalker walker(&data[3], static_cast<UInt32>(data.size() - 3));
+    IPTSHIDSubFrame sub;
+    while (walker.next(&sub)) {
+        if (sub.type == IPTS_HID_FRAME_TYPE_METADATA) {
+            // storeMetadata and configureDetector
+            IPTSDeviceMetaData metadata;
+            memset(&metadata, 0, sizeof(metadata));
+            memcpy(&metadata, sub.data, sub.size < sizeof(metadata) ? sub.size : sizeof(metadata));
+            UInt32 transform[6];
+            memcpy(transform, &metadata.transform, sizeof(transform));
+            CHECK(detector->configure(metadata.size.rows, metadata.size.columns, transform));
+        } else if (sub.type == IPTS_HID_FRAME_TYPE_HEATMAP) {
+            result->heatmaps++;
+            const UInt8 *heatmap = detector->findHeatmap(sub.data, sub.size);
+            if (!heatmap)
+                continue;
+            result->detected_heatmaps++;
+            IPTSContact contacts[IPTS_CONTACT_MAX_NUM];
+            UInt32 num = detector->process(heatmap, contacts, IPTS_CONTACT_MAX_NUM);
+            UInt32 ids = 0;
+            for (UInt32 i = 0; i < num; i++) {
+                // the HID stack needs unique ids within a report and coordinates in the descriptor range
+                CHECK(contacts[i].id < IPTS_CONTACT_MAX_NUM);
+                CHECK(!(ids & (1 << contacts[i].id)));
+                CHECK(contacts[i].x <= IPTS_CONTACT_LOGICAL_MAX && contacts[i].y <= IPTS_CONTACT_LOGICAL_MAX);
+                ids |= 1 << contacts[i].id;
+                result->contacts.push_back({result->heatmaps - 1, contacts[i]});
+            }
+        } else if (sub.type == IPTS_HID_FRAME_TYPE_REPORTS) {
+            if (IPTSStylusDecoder::scan(sub.data, sub.size) & ~IPTS_REPORTS_STYLUS)
+                result->foreign_reports++;
+            IPTSStylusSample samples[MAX_SAMPLES];
+            UInt32 num = IPTSStylusDecoder::decode(sub.data, sub.size, scan_time, samples, MAX_SAMPLES);
+            for (UInt32 i = 0; i < num; i++) {
+                CHECK(samples[i].x <= IPTS_STYLUS_MAX_X && samples[i].y <= IPTS_STYLUS_MAX_Y);
+                CHECK(samples[i].pressure <= IPTS_STYLUS_MAX_PRESSURE);
+                CHECK(samples[i].x_tilt <= 2 * IPTS_STYLUS_TILT_CENTER && samples[i].y_tilt <= 2 * IPTS_STYLUS_TILT_CENTER);
+                result->samples.push_back(samples[i]);
+            }
+        }
+    }
+    CHECK(!walker.isMalformed());
+}
+
+static bool playTrace(const char *path, TraceResult *result) {
+    std::vector<IPTSSimulatedData> stream;
+    if (!readTrace(path, &stream)) {
+        fprintf(stderr, "%s: missing or truncated\n", path);
+        return false;
+    }
+    IPTSContactDetector detector;
+    UInt64 previous = 0;
+    for (size_t i = 0; i < stream.size(); i++) {
+        // kMethodReplayTrace keeps the timing only for records in time order
+        CHECK(stream[i].time >= previous);
+        previous = stream[i].time;
+        result->records++;
+        if (stream[i].type == IPTSDataTypeHID)
+            playFrame(&detector, stream[i].data, result);
+    }
+    return true;
+}
+
+// The contacts of one finger, by its id in @frame
+static std::vector<IPTSContact> followContact(const TraceResult &result, UInt32 frame, UInt16 x, UInt16 y) {
+    std::vector<IPTSContact> track;
+    SInt32 id = -1;
+    for (const TraceContact &found : result.contacts) {
+        if (found.frame == frame && found.contact.x == x && found.contact.y == y)
+            id = found.contact.id;
+    }
+    for (const TraceContact &found : result.contacts) {
+        if (found.frame >= frame && found.contact.id == id)
+            track.push_back(found.contact);
+    }
+    return track;
+}
+
+static void testFingerPen() {
+    TraceResult result;
+    CHECK(playTrace("corpus/trace/finger_pen.trace", &result));
+    CHECK_EQ(result.records, 49);
+    CHECK_EQ(result.hid_frames, 48);
+    CHECK_EQ(result.heatmaps, 48);
+    CHECK_EQ(result.detected_heatmaps, 48);
+    CHECK_EQ(result.foreign_reports, 1);
+
+    // both fingers, and the sensor noise never turns into a contact
+    UInt32 per_frame[48] = {0};
+    for (const TraceContact &found : result.contacts) {
+        CHECK(found.frame < 48);
+        per_frame[found.frame]++;
+    }
+    for (UInt32 i = 0; i < 48; i++)
+        CHECK_EQ(per_frame[i], (i >= 1 && i <= 40) + (i >= 10 && i <= 25));
+
+    // the sliding finger keeps its id and moves right, the sensor noise only shakes it by a fraction of a cell
+    UInt32 cell_x = IPTS_CONTACT_LOGICAL_MAX / (CAPTURE_COLUMNS - 1);
+    UInt32 cell_y = IPTS_CONTACT_LOGICAL_MAX / (CAPTURE_ROWS - 1);
+    IPTSContact first;
+    memset(&first, 0, sizeof(first));
+    for (const TraceContact &found : result.contacts) {
+        if (found.frame == 1)
+            first = found.contact;
+    }
+    std::vector<IPTSContact> slide = followContact(result, 1, first.x, first.y);
+    CHECK_EQ(slide.size(), 40);
+    for (size_t i = 1; i < slide.size(); i++) {
+        CHECK(slide[i].x + cell_x / 4 > slide[i - 1].x);
+        UInt32 drift = slide[i].y > slide[0].y ? slide[i].y - slide[0].y : slide[0].y - slide[i].y;
+        CHECK(drift < cell_y / 10);
+    }
+    CHECK(slide.back().x > slide.front().x + 18 * cell_x);
+
+    // the resting finger gets an id of its own
+    for (const TraceContact &found : result.contacts) {
+        if (found.frame >= 10 && found.frame <= 25 && found.contact.y < first.y)
+            CHECK(found.contact.id != first.id);
+    }
+
+    // one sample per reports frame, the DFT window next to one of them is left alone
+    CHECK_EQ(result.samples.size(), 31);
+    UInt32 touching = 0;
+    for (size_t i = 0; i < result.samples.size(); i++) {
+        CHECK(result.samples[i].mode & IPTS_STYLUS_MODE_PROXIMITY);
+        if (i)
+            CHECK(result.samples[i].x > result.samples[i - 1].x);
+        if (result.samples[i].mode & IPTS_STYLUS_MODE_TOUCH) {
+            CHECK(result.samples[i].pressure > 0);
+            touching++;
+        }
+    }
+    CHECK_EQ(touching, 21);
+}
+
+int main(int argc, char **argv) {
+    if (argc == 1) {
+        testFingerPen();
+        return TEST_RESULT();
+    }
+    for (int i = 1; i < argc; i++) {
+        TraceResult result;
+        if (!playTrace(argv[i], &result))
+            return 1;
+        printf("%s: %u records, %u heatmaps (%u detected), %zu contacts, %zu pen samples\n", argv[i], result.records,
+               result.heatmaps, result.detected_heatmaps, result.contacts.size(), result.samples.size());
+    }
+    return TEST_RESULT();
+}
@@ -0,0 +1,27 @@
+//
+//  IOTypes.h
+//  BigSurfaceHIDDriverTests
+//
+//  Created by Xavier on 2026/10/17.
+//  Copyright © 2026 Xia Shangning. All rights reserved.
+//
+//  Stand-in for the IOKit types used by the shared IPTS headers, so that IPTSProtocol.h and
+//  IPTSKenerlUserShared.h can be included by the host simulator.
+//
+
+#ifndef IOTypes_h
+#define IOTypes_h
+
+#include <stdint.h>
+
+typedef uint8_t     UInt8;
+typedef uint16_t    UInt16;
+typedef uint32_t    UInt32;
+typedef uint64_t    UInt64;
+typedef int16_t     SInt16;
+typedef int32_t     SInt32;
+typedef int64_t     SInt64;
+
+typedef float       Float32;
+
+#endif /* IOTypes_h */